@@ -12,6 +12,8 @@ struct Block {
   SIZE_T 	length;
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
+  unsigned long long lsn;      // for use in buffercache only
+  SIZE_T        pins;          // for use in buffercache only, not copied
 
   Block();
   Block(const SIZE_T size);
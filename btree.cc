@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 #include "btree.h"
 
 KeyValuePair::KeyValuePair()
@@ -21,7 +23,12 @@ KeyValuePair::~KeyValuePair()
 
 KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *( new (this) KeyValuePair(rhs));
+  // release what we hold before copying over it
+  if (this!=&rhs) { 
+    this->~KeyValuePair();
+    new (this) KeyValuePair(rhs);
+  }
+  return *this;
 }
 
 // Added to mirror KeyValuePair structure
@@ -45,24 +52,54 @@ KeyPointerPair::~KeyPointerPair()
 
 KeyPointerPair & KeyPointerPair::operator=(const KeyPointerPair &rhs)
 {
-  return *( new (this) KeyPointerPair(rhs));
+  // release what we hold before copying over it
+  if (this!=&rhs) { 
+    this->~KeyPointerPair();
+    new (this) KeyPointerPair(rhs);
+  }
+  return *this;
 }
 // /end added stuff
 
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
 		       SIZE_T valuesize,
 		       BufferCache *cache,
-		       bool unique) 
+		       bool unique,
+		       SIZE_T format) 
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.format=format;
+  superblock.info.maxfill=0;
   buffercache=cache;
+  fixedlookup=0;
+  superblockdirty=false;
+  superblockwrites=0;
   // note: ignoring unique now
 }
 
+BTreeIndex::BTreeIndex(const BTreeKeySchema &schema,
+		       SIZE_T valuesize,
+		       BufferCache *cache,
+		       bool unique,
+		       SIZE_T format) 
+{
+  superblock.info.keysize=schema.GetKeySize();
+  superblock.info.valuesize=valuesize;
+  superblock.info.format=format;
+  superblock.info.maxfill=0;
+  buffercache=cache;
+  fixedlookup=0;
+  superblockdirty=false;
+  superblockwrites=0;
+  keyschema=schema;
+}
+
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  fixedlookup=0;
+  superblockdirty=false;
+  superblockwrites=0;
 }
 
 
@@ -74,6 +111,11 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  superinfo=rhs.superinfo;
+  fixedlookup=rhs.fixedlookup;
+  keyschema=rhs.keyschema;
+  superblockdirty=rhs.superblockdirty;
+  superblockwrites=rhs.superblockwrites;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -84,58 +126,92 @@ BTreeIndex::~BTreeIndex()
 
 BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 {
-  return *(new(this)BTreeIndex(rhs));
+  // release what we hold before copying over it
+  if (this!=&rhs) { 
+    this->~BTreeIndex();
+    new (this) BTreeIndex(rhs);
+  }
+  return *this;
 }
 
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+//
+// Blocks are handed out from the free blocks below the high water
+// mark, the one nearest hint, and otherwise from the high water mark,
+// the first block that has never been used.  Blocks above the high
+// water mark are never read or written, so they need no formatting.
+// Only moving the high water mark changes the superblock, and that is
+// not written out until it has to be (WriteSuperblock); the free
+// blocks are in the disk's bitmap (see BTreeAllocator).
+//
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const SIZE_T hint)
 {
-  n=superblock.info.freelist;
-
-  if (n==0) { 
-    return ERROR_NOSPACE;
+  latches.LockAlloc();
+  if (!allocator.Allocate(hint,n)) { 
+    if (superinfo.highwater>=buffercache->GetNumBlocks()) { 
+      latches.UnlockAlloc();
+      return ERROR_NOSPACE;
+    }
+    n=superinfo.highwater++;
+    superblockdirty=true;
   }
 
-  BTreeNode node;
-
-  node.Unserialize(buffercache,n);
-
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
-
-  superblock.info.freelist=node.info.freelist;
-
-  superblock.Serialize(buffercache,superblock_index);
-
   buffercache->NotifyAllocateBlock(n);
+  latches.UnlockAlloc();
 
   return ERROR_NOERROR;
 }
 
 
+// A freed block is not touched; whoever gets it next formats it
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
-  BTreeNode node;
-
-  node.Unserialize(buffercache,n);
-
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
-
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
-
-  node.info.freelist=superblock.info.freelist;
-
-  node.Serialize(buffercache,n);
-
-  superblock.info.freelist=n;
-
-  superblock.Serialize(buffercache,superblock_index);
+  latches.LockAlloc();
+  assert(n!=superblock_index && n<superinfo.highwater);
+  allocator.Free(n);
 
   buffercache->NotifyDeallocateBlock(n);
+  latches.UnlockAlloc();
 
   return ERROR_NOERROR;
+}
 
+
+// A leaf must hold at least BTREE_OVERFLOW_FANOUT of the longest
+// values; an index with values too long for that keeps them in
+// overflow blocks, and its leaves keep a tag byte and either the value
+// or a reference to it (BTREE_OVERFLOW_REF bytes).  A value out of
+// line takes whole blocks, so only those over about a quarter of a
+// leaf go there.
+#define BTREE_OVERFLOW_FANOUT 4
+#define BTREE_VALUE_INLINE 0
+#define BTREE_VALUE_OVERFLOW 1
+#define BTREE_OVERFLOW_REF (1+2*sizeof(SIZE_T))
+
+// The bytes a leaf of this shape keeps for a value.  Less than
+// shape.valuesize means values go to overflow blocks: in the slotted
+// format only those that do not fit in what the leaf keeps, otherwise
+// all of them.
+static SIZE_T LeafValueSize(const NodeMetadata &shape)
+{
+  NodeMetadata leaf=shape;
+  leaf.nodetype=BTREE_LEAF_NODE;
+  if (leaf.valuesize<=BTREE_OVERFLOW_REF || leaf.GetNumSlotsAsLeaf()>=BTREE_OVERFLOW_FANOUT) { 
+    return leaf.valuesize;
+  }
+  if (leaf.format!=BTREE_FORMAT_SLOTTED) { 
+    return BTREE_OVERFLOW_REF;
+  }
+  if (leaf.valuesize>leaf.GetNumDataBytes()) { 
+    leaf.valuesize=leaf.GetNumDataBytes();
+  }
+  while (leaf.valuesize>BTREE_OVERFLOW_REF && leaf.GetNumSlotsAsLeaf()<BTREE_OVERFLOW_FANOUT) { 
+    leaf.valuesize--;
+  }
+  return leaf.valuesize;
 }
 
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
@@ -144,18 +220,66 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   assert(superblock_index==0);
 
   if (create) {
-    // build a super block, root node, and a free space list
+    // slotted nodes address their data with 16 bit offsets
+    if ((superblock.info.format==BTREE_FORMAT_TRUNCATE || superblock.info.format==BTREE_FORMAT_SLOTTED) &&
+	buffercache->GetBlockSize()-sizeof(NodeMetadata)>65535) { 
+      return ERROR_SIZE;
+    }
+    NodeMetadata shape;
+    shape.keysize=superblock.info.keysize;
+    shape.valuesize=superblock.info.valuesize;
+    shape.blocksize=buffercache->GetBlockSize();
+    shape.format=superblock.info.format;
+    shape.prefixlen=0;
+    SIZE_T leafvaluesize=LeafValueSize(shape);
+    // build a super block and root node
     //
     // Superblock at superblock_index
     // root node at superblock_index+1
-    // free space list for rest
+    // everything after that is above the high water mark
+    // and is allocated on demand, so nothing else is written
     BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			    superblock.info.keysize,
-			    superblock.info.valuesize,
+			    leafvaluesize,
 			    buffercache->GetBlockSize());
     newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
+    newsuperblock.info.freelist=0;
     newsuperblock.info.numkeys=0;
+    newsuperblock.info.format=superblock.info.format;
+    newsuperblock.info.maxfill=superblock.info.maxfill;
+    superinfo.highwater=superblock_index+2;
+    superinfo.overflowsize=leafvaluesize<superblock.info.valuesize ? superblock.info.valuesize : 0;
+    if (sizeof(SuperblockMetadata)+(keyschema.Empty() ? 0 : keyschema.GetStoredSize())>
+	newsuperblock.info.GetNumDataBytes()) { 
+      return ERROR_SIZE;
+    }
+    memcpy(newsuperblock.data,&superinfo,sizeof(SuperblockMetadata));
+    if (!keyschema.Empty()) { 
+      keyschema.Store((BYTE_T*)newsuperblock.data+sizeof(SuperblockMetadata));
+    }
+
+    // The index has the disk to itself, so whatever an earlier one
+    // left allocated is free again.  That one handed out nothing at
+    // or past its high water mark, which was on disk by its last
+    // checkpoint.
+    Block oldblock;
+    rc=buffercache->ReadBlock(superblock_index,oldblock);
+    if (rc) { 
+      return rc;
+    }
+    NodeMetadata oldinfo;
+    memcpy(&oldinfo,oldblock.data,sizeof(oldinfo));
+    if (oldinfo.nodetype==BTREE_SUPERBLOCK && oldinfo.blocksize==buffercache->GetBlockSize() &&
+	oldinfo.GetNumDataBytes()>=sizeof(SuperblockMetadata)) { 
+      SuperblockMetadata oldsuperinfo;
+      memcpy(&oldsuperinfo,oldblock.data+sizeof(oldinfo),sizeof(oldsuperinfo));
+      SIZE_T end=min(oldsuperinfo.highwater,buffercache->GetNumBlocks());
+      for (SIZE_T i=superblock_index+2;i<end;i++) { 
+	if (buffercache->IsBlockAllocated(i)) { 
+	  buffercache->NotifyDeallocateBlock(i);
+	}
+      }
+    }
 
     buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -165,562 +289,2535 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
       return rc;
     }
     
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-			  superblock.info.keysize,
-			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
-
     buffercache->NotifyAllocateBlock(superblock_index+1);
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+    BTreeNodeView newrootnode;
+
+    rc=newrootnode.Pin(buffercache,superblock_index+1,true);
 
     if (rc) { 
       return rc;
     }
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-      
-      rc = newfreenode.Serialize(buffercache,i);
+    newrootnode.Format(BTREE_ROOT_NODE,
+		       superblock.info.keysize,
+		       leafvaluesize,
+		       buffercache->GetBlockSize(),
+		       superblock.info.format,
+		       superblock.info.maxfill);
+    newrootnode.info->rootnode=superblock_index+1;
 
-      if (rc) {
-	return rc;
-      }
+    rc=newrootnode.Unpin();
+
+    if (rc) { 
+      return rc;
+    }
+
+    rc=buffercache->Commit();
 
+    if (rc) { 
+      return rc;
     }
   }
 
   // OK, now, mounting the btree is simply a matter of reading the superblock 
 
-  return superblock.Unserialize(buffercache,initblock);
+  rc=superblock.Unserialize(buffercache,initblock);
+  if (rc) { 
+    return rc;
+  }
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK) { 
+    return ERROR_NOTANINDEX;
+  }
+  if (superblock.info.GetNumDataBytes()<sizeof(SuperblockMetadata)) { 
+    return ERROR_INSANE;
+  }
+  memcpy(&superinfo,superblock.data,sizeof(SuperblockMetadata));
+  rc=keyschema.Load((const BYTE_T*)superblock.data+sizeof(SuperblockMetadata),
+		    superblock.info.GetNumDataBytes()-sizeof(SuperblockMetadata));
+  if (rc) { 
+    return rc;
+  }
+  if (!keyschema.Empty() && keyschema.GetKeySize()!=superblock.info.keysize) { 
+    return ERROR_INSANE;
+  }
+  superblockdirty=false;
+  superblockwrites=0;
+  if (buffercache->GetNumRecoveredBlocks()>0) { 
+    rc=RebuildBitMap();
+    if (rc) { 
+      return rc;
+    }
+  }
+  // An index from before the allocator may have a free list; its
+  // blocks are already free in the bitmap
+  if (superblock.info.freelist!=0) { 
+    superblock.info.freelist=0;
+    superblockdirty=true;
+  }
+  allocator.Build(buffercache,superblock_index+1,superinfo.highwater);
+  fixedlookup=superinfo.overflowsize ? 0 : FixedLookupFor(superblock.info);
+  return ERROR_NOERROR;
 }
     
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+ERROR_T BTreeIndex::SetSplitPolicy(const BTreeSplitPolicy &policy)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  if ((policy.maxfill!=0 && (policy.maxfill<50 || policy.maxfill>100)) ||
+      policy.splitpoint>99) { 
+    return ERROR_SIZE;
+  }
+  superblock.info.maxfill=policy.maxfill;
+  superinfo.splitpoint=policy.splitpoint;
+  superinfo.appendsplit=policy.append;
+  return ERROR_NOERROR;
 }
- 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+
+BTreeSplitPolicy BTreeIndex::GetSplitPolicy() const
 {
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  BTreeSplitPolicy policy;
+  policy.maxfill=superblock.info.maxfill;
+  policy.splitpoint=superinfo.splitpoint;
+  policy.append=superinfo.appendsplit!=0;
+  return policy;
+}
 
-  rc= b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+ERROR_T BTreeIndex::SetConcurrent(const bool concurrent)
+{
+  if (concurrent && buffercache->HasLog()) { 
+    return ERROR_BADCONFIG;
   }
+  latches.Init(concurrent ? buffercache->GetNumBlocks() : 0);
+  buffercache->SetThreadSafe(concurrent);
+  return ERROR_NOERROR;
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-        // OK, so we now have the first key that's larger
-        // so we ned to recurse on the ptr immediately previous to 
-        // this one, if it exists
-        rc=b.GetPtr(offset,ptr);
-        if (rc) { return rc; }
-        return LookupOrUpdateInternal(ptr,op,key,value);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	    if (op==BTREE_OP_LOOKUP) { 
-	      return b.GetVal(offset,value);
-	    } else { 
-      	  rc = b.SetVal(offset,value);
-          if (rc) {  return rc; }
-      	  return b.Serialize(buffercache,node);
-	    }
-      }
-    }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
 
-  return ERROR_INSANE;
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  if (superblockdirty) { 
+    ERROR_T rc=WriteSuperblock();
+    if (rc) { 
+      return rc;
+    }
+  }
+  return buffercache->Commit();
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+// The checkpoint writes out the bitmap, so the high water mark goes
+// out with the operation before it
+ERROR_T BTreeIndex::Commit()
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
-  ERROR_T rc;
-  unsigned i;
-
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  ERROR_T rc=buffercache->Commit();
+  if (rc || !buffercache->CheckpointDue()) { 
+    return rc;
   }
-
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
-      }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
-	}
-	os << " ";
-      }
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-    } else {
-      os << "Leaf: ";
-    }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
-	}
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
-      } else {
-	os << " ";
-      }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
-      } else {
-	os << " ";
-      }
+  if (superblockdirty) { 
+    rc=WriteSuperblock();
+    if (rc==ERROR_NOERROR) { 
+      rc=buffercache->Commit();
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
-    } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+    if (rc) { 
+      return rc;
     }
   }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
+  return buffercache->Checkpoint();
+}
+
+
+// The high water mark can move under concurrent inserts
+ERROR_T BTreeIndex::WriteSuperblock()
+{
+  latches.LockAlloc();
+  memcpy(superblock.data,&superinfo,sizeof(SuperblockMetadata));
+  ERROR_T rc=superblock.Serialize(buffercache,superblock_index);
+  if (rc==ERROR_NOERROR) { 
+    superblockdirty=false;
+    superblockwrites++;
   }
-  return ERROR_NOERROR;
+  latches.UnlockAlloc();
+  return rc;
 }
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+
+// The next part of a value, from done on, in an overflow block
+static void FillOverflow(BTreeNodeView &b, const SIZE_T blocksize, const BYTE_T *bytes, const SIZE_T n, SIZE_T &done)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  SIZE_T len=blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T);
+  if (len>n-done) { 
+    len=n-done;
+  }
+  b.Format(BTREE_OVERFLOW_BLOCK,0,0,blocksize,BTREE_FORMAT_PLAIN);
+  b.info->numkeys=len;
+  memcpy(b.data+sizeof(SIZE_T),bytes+done,len);
+  done+=len;
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+
+static void MakeRef(const SIZE_T block, const SIZE_T length, VALUE_T &stored)
 {
-  KEY_T mrk;
-  SIZE_T mrp;
-  ERROR_T rc;
-  bool c = false;
-  rc = InsertAtNode(superblock.info.rootnode, key, value, mrk, mrp, c);
-  if (rc) { return rc; }
-  if (c) {
-    BTreeNode curr_root, new_root;
-    rc = curr_root.Unserialize(buffercache, superblock.info.rootnode);
-    if (rc) { return rc; }
-    new_root = curr_root;
+  stored.Resize(BTREE_OVERFLOW_REF,false);
+  stored.data[0]=BTREE_VALUE_OVERFLOW;
+  memcpy(stored.data+1,&block,sizeof(SIZE_T));
+  memcpy(stored.data+1+sizeof(SIZE_T),&length,sizeof(SIZE_T));
+}
 
-    new_root.info.numkeys = 1;
-    rc = new_root.SetKey(0, mrk);
-    if (rc) { return rc; }
-    rc = new_root.SetPtr(0, superblock.info.rootnode);
-    if (rc) { return rc; }
-    rc = new_root.SetPtr(0, mrp);
-    if (rc) { return rc; }
 
-    // allocate space for new root on disk
-    SIZE_T root_block;
-    rc = AllocateNode(root_block);
-    if (rc) { return rc; }
+static void GetRef(const VALUE_T &stored, SIZE_T &block, SIZE_T &length)
+{
+  memcpy(&block,stored.data+1,sizeof(SIZE_T));
+  memcpy(&length,stored.data+1+sizeof(SIZE_T),sizeof(SIZE_T));
+}
 
-    superblock.info.rootnode = root_block;
 
-    rc = new_root.Serialize(buffercache, root_block);
-    if (rc) { return rc; }
-    
-    superblock.info.numkeys++;
-    return rc;
+// A value short enough for a leaf that keeps leafvaluesize bytes is
+// kept there, after its tag
+static bool InlineValue(const SIZE_T leafvaluesize, const VALUE_T &value, VALUE_T &stored)
+{
+  if (1+value.length>leafvaluesize) { 
+    return false;
   }
+  stored.Resize(1+value.length,false);
+  stored.data[0]=BTREE_VALUE_INLINE;
+  memcpy(stored.data+1,value.data,value.length);
+  return true;
 }
 
-ERROR_T BTreeIndex::SplitNode(BTreeNode &b,KEY_T &key_to_rhs,SIZE_T &ptr_to_rhs)
+
+// A value from what a leaf keeps of it.  The chain of an overflowed
+// value is copied straight from the cached blocks into value.
+static ERROR_T ReadValue(BufferCache *cache, const VALUE_T &stored, VALUE_T &value)
 {
+  SIZE_T block, length, done=0;
+  BTreeNodeView b;
   ERROR_T rc;
-  int lhs_numkeys = b.info.numkeys / 2;
-  int rhs_numkeys = b.info.numkeys / 2;
-  if (b.info.numkeys % 2 == 0) {  rhs_numkeys--;  }
-
-  BTreeNode rhs = b;
-  rhs.info.numkeys = rhs_numkeys;
-
-  // Write the key to be promoted into key_to_rhs.
-  // This is the key to be promoted from the split.
-  // It will be inserted into our parent node by our caller (i.e. 
-  // the last invocation of InsertAtNode on the call stack).
-  rc = b.GetKey(lhs_numkeys,key_to_rhs);
-  if (rc) {  return rc; }
 
-  // Allocate a node and write the block number allocated for it
-  // into ptr_to_rhs. Now when we serialize rhs to this block,
-  // maybe_rhs_ptr will be the ptr to it. Thus, maybe_rhs_ptr is the
-  // ptr associated with the promoted key.
-  rc = AllocateNode(ptr_to_rhs);
-  if (rc) {  return rc; }
+  if (stored.length==0) { 
+    return ERROR_INSANE;
+  }
+  if (stored.data[0]==BTREE_VALUE_INLINE) { 
+    value.Resize(stored.length-1,false);
+    memcpy(value.data,stored.data+1,stored.length-1);
+    return ERROR_NOERROR;
+  }
+  GetRef(stored,block,length);
+  value.Resize(length,false);
+  while (done<length) { 
+    if (block==0) { 
+      return ERROR_INSANE;
+    }
+    rc=b.Pin(cache,block);
+    if (rc) { return rc; }
+    if (b.info->nodetype!=BTREE_OVERFLOW_BLOCK || b.info->numkeys==0 || b.info->numkeys>length-done) { 
+      return ERROR_INSANE;
+    }
+    memcpy(value.data+done,b.data+sizeof(SIZE_T),b.info->numkeys);
+    done+=b.info->numkeys;
+    memcpy(&block,b.data,sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
 
-  // Copy b's rhs data into rhs's data starting from rhs's beginning
-  // b_offset is initialized to the point in b where rhs data begins
-  // rhs_offset is the point in rhs where we insert each kvp (from b)
-  SIZE_T b_offset, rhs_offset;
-  for (rhs_offset=0, b_offset=lhs_numkeys+1;
-       rhs_offset<rhs.info.numkeys;
-       rhs_offset++, b_offset++) {
-    
-    SIZE_T copied_ptr;
-    KEY_T copied_key;
 
-    rc = b.GetPtr(b_offset,copied_ptr);
-    if (rc) {  return rc;  }
-    rc = rhs.SetPtr(rhs_offset,copied_ptr);
-    if (rc) {  return rc;  }
+ERROR_T BTreeIndex::StoreValue(const VALUE_T &value, VALUE_T &stored)
+{
+  SIZE_T first, block, done=0;
+  BTreeNodeView b;
+  ERROR_T rc;
 
-    rc = b.GetKey(b_offset,copied_key);
-    if (rc) {  return rc;  }
-    rc = rhs.SetKey(rhs_offset,copied_key);
-    if (rc) {  return rc;  }
+  if (InlineValue(superblock.info.valuesize,value,stored)) { 
+    return ERROR_NOERROR;
   }
+  // the chain has no node to be near, but each block follows the last
+  rc=AllocateNode(first,0);
+  if (rc) { return rc; }
+  block=first;
+  for (;;) { 
+    rc=b.Pin(buffercache,block,true);
+    if (rc) { break; }
+    FillOverflow(b,buffercache->GetBlockSize(),value.data,value.length,done);
+    if (done==value.length) { 
+      break;
+    }
+    rc=AllocateNode(block,block);
+    if (rc) { break; }
+    memcpy(b.data,&block,sizeof(SIZE_T));
+  }
+  b.Unpin();
+  if (rc) { 
+    // give back what was written
+    FreeChain(first);
+    return rc;
+  }
+  MakeRef(first,value.length,stored);
+  return ERROR_NOERROR;
+}
 
-  SIZE_T copied_ptr;
-  // Copy the last pointer
-  rc = b.GetPtr(b_offset,copied_ptr);
-  if (rc) {  return rc;  }
-  rc = rhs.SetPtr(rhs_offset,copied_ptr);
-  if (rc) {  return rc;  }
-
-  // Finalize rhs by writing to the buffercache.
-  // No need to serialize b (our new lhs) here since our caller will.
-  rc = rhs.Serialize(buffercache,ptr_to_rhs);
-  if (rc) {  return rc; }
 
-  // Per piazza @487, this is enough to turn original node into lhs.
-  // Data clearing/overwriting unneeded but maybe useful for debugging
-  b.info.numkeys = lhs_numkeys;
+ERROR_T BTreeIndex::LoadValue(const VALUE_T &stored, VALUE_T &value) const
+{
+  return ReadValue(buffercache,stored,value);
 }
 
-ERROR_T BTreeIndex::SplitLeaf(BTreeNode &b,KEY_T &key_to_rhs,SIZE_T &ptr_to_rhs)
-{
-  ERROR_T rc;
-  int lhs_numkeys = b.info.numkeys / 2;
-  int rhs_numkeys = b.info.numkeys / 2;
-  if (b.info.numkeys % 2 == 1) {  rhs_numkeys++;  }
 
-  BTreeNode rhs = b;
-  rhs.info.numkeys = rhs_numkeys;
+ERROR_T BTreeIndex::FreeValue(const VALUE_T &stored)
+{
+  SIZE_T block, length;
 
-  // Write the key to be promoted into key_to_rhs.
-  // This is the key to be promoted from the split.
-  // It will be inserted into our parent node by our caller (i.e. 
-  // the last invocation of InsertAtNode on the call stack).
-  rc = b.GetKey(lhs_numkeys,key_to_rhs);
+  if (stored.length==0 || stored.data[0]==BTREE_VALUE_INLINE) { 
+    return ERROR_NOERROR;
+  }
+  GetRef(stored,block,length);
+  return FreeChain(block);
+}
+
+
+// A failed insert may still have put its pair in, if a read or write
+// failed after the leaf took it, so the value goes back only if key
+// does not hold it.  If that can't be told, it is kept.
+ERROR_T BTreeIndex::FreeUnlessHeld(const KEY_T &key, const VALUE_T &stored, const bool latched)
+{
+  VALUE_T now;
+  ERROR_T rc;
+
+  if (latched) { 
+    BTreeNodeView b;
+    SIZE_T slot;
+    bool found;
+    rc=LatchedDescend(key,false,b);
+    if (rc==ERROR_NOERROR) { 
+      slot=b.FindKey(key,found);
+      rc = found ? b.GetVal(slot,now) : ERROR_NONEXISTENT;
+      LatchedRelease(b);
+    }
+  } else {
+    rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, now);
+  }
+  if (rc==ERROR_NONEXISTENT || (rc==ERROR_NOERROR && !(now==stored))) { 
+    return FreeValue(stored);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FreeChain(SIZE_T block)
+{
+  BTreeNodeView b;
+  SIZE_T next;
+  ERROR_T rc;
+
+  while (block!=0) { 
+    rc=b.Pin(buffercache,block);
+    if (rc) { return rc; }
+    if (b.info->nodetype!=BTREE_OVERFLOW_BLOCK) { 
+      return ERROR_INSANE;
+    }
+    memcpy(&next,b.data,sizeof(SIZE_T));
+    b.Unpin();
+    rc=DeallocateNode(block);
+    if (rc) { return rc; }
+    block=next;
+  }
+  return ERROR_NOERROR;
+}
+ 
+
+// Of room, what a node fills before it splits: its maxfill percent,
+// or by default two thirds
+static SIZE_T FillLimit(const NodeMetadata *info, const SIZE_T room)
+{
+  return info->maxfill ? room*info->maxfill/100 : room*2/3;
+}
+
+// A node splits when it reaches MaxKeys, and is underfull (unless it
+// is the root or one of the root's leaves) below MinKeys.  Two nodes
+// that are each at most half full can always be merged.
+static SIZE_T MaxKeys(const NodeMetadata *info)
+{
+  if (info->nodetype==BTREE_LEAF_NODE) { 
+    return FillLimit(info,info->GetNumSlotsAsLeaf());
+  } else {
+    return FillLimit(info,info->GetNumSlotsAsInterior());
+  }
+}
+
+static SIZE_T MinKeys(const NodeMetadata *info)
+{
+  return (MaxKeys(info)-1)/2;
+}
+
+// MaxKeys of a node like info's whose keys share prefixlen bytes
+static SIZE_T MaxKeys(const NodeMetadata *info, const SIZE_T prefixlen)
+{
+  NodeMetadata shape=*info;
+  shape.prefixlen=prefixlen;
+  return MaxKeys(&shape);
+}
+
+// Slotted nodes are measured in bytes instead, with the same
+// thresholds applied to what their pairs take
+static SIZE_T MaxBytes(const NodeMetadata *info)
+{
+  return FillLimit(info,info->GetNumDataBytes()-sizeof(SIZE_T));
+}
+
+static SIZE_T MinBytes(const NodeMetadata *info)
+{
+  return (MaxBytes(info)-1)/2;
+}
+
+// Whether b has to split, or is underfull
+static bool Full(const BTreeNodeView &b)
+{
+  if (b.info->IsSlotted()) { 
+    return b.GetUsedBytes()-sizeof(SIZE_T) >= MaxBytes(b.info);
+  }
+  return b.info->numkeys >= MaxKeys(b.info);
+}
+
+static bool Underfull(const BTreeNodeView &b)
+{
+  if (b.info->IsSlotted()) { 
+    return b.GetUsedBytes()-sizeof(SIZE_T) < MinBytes(b.info);
+  }
+  return b.info->numkeys < MinKeys(b.info);
+}
+
+// How many keys a node like info's, whose keys share prefixlen bytes,
+// gets when it is filled to fill: that much of what it can hold
+// without splitting, but no less than a node may shrink to
+static SIZE_T FillKeys(const NodeMetadata *info, const SIZE_T prefixlen, const double fill)
+{
+  NodeMetadata shape=*info;
+  shape.prefixlen=prefixlen;
+  SIZE_T most=MaxKeys(&shape)-1;
+  SIZE_T n=(SIZE_T)(fill*most);
+
+  if (n<MinKeys(&shape)) { 
+    n=MinKeys(&shape);
+  }
+  if (n>most) { 
+    n=most;
+  }
+  return n<1 ? 1 : n;
+}
+
+// The bytes of pairs a slotted node like info's gets when filled to
+// fill
+static SIZE_T FillBytes(const NodeMetadata *info, const double fill)
+{
+  SIZE_T most=MaxBytes(info)-1;
+  SIZE_T bytes=(SIZE_T)(fill*most);
+
+  if (bytes<MinBytes(info)) { 
+    bytes=MinBytes(info);
+  }
+  if (bytes>most) { 
+    bytes=most;
+  }
+  return bytes;
+}
+
+// Whether n sorted pairs, from first on, fit in a node like info's
+// filled to fill
+static bool FitsKeys(const NodeMetadata *info,
+		     const BYTE_T *first,
+		     const SIZE_T n,
+		     const SIZE_T pairsize,
+		     const double fill=1.0)
+{
+  if (n==0) { 
+    return true;
+  }
+  if (info->IsSlotted()) { 
+    // a single pair always fits, however long
+    return n==1 || info->GetStoredSize(first,n) <= FillBytes(info,fill);
+  }
+  return n <= FillKeys(info,info->GetPrefixLength(first,first+(n-1)*pairsize),fill);
+}
+
+// Whether p's key at slot can be replaced by key without p then
+// having to split
+static bool FitsKey(const BTreeNodeView &p, const SIZE_T slot, const BYTE_T *key)
+{
+  if (p.info->IsSlotted()) { 
+    KEY_T old;
+    p.GetKey(slot,old);
+    return p.GetUsedBytes()-sizeof(SIZE_T)
+      - p.info->GetStoredKeyLength(old.data) + p.info->GetStoredKeyLength(key) < MaxBytes(p.info);
+  }
+  return p.info->numkeys < MaxKeys(p.info, CommonPrefix((const BYTE_T *)p.ResolvePrefix(), key, p.info->prefixlen));
+}
+
+// The separator between a node ending in last and the one after it,
+// starting with first.  Where separators are stored by length, it is
+// the shortest head of first that is still greater than last, with
+// zeros after it; otherwise all of first.
+static void Separator(const NodeMetadata *info,
+		      const BYTE_T *last,
+		      const BYTE_T *first,
+		      BYTE_T *sep)
+{
+  SIZE_T n=info->keysize;
+
+  if ((info->format==BTREE_FORMAT_TRUNCATE || info->format==BTREE_FORMAT_SLOTTED) && last!=0) { 
+    n=CommonPrefix(last,first,info->keysize)+1;
+  }
+  memcpy(sep,first,n);
+  memset(sep+n,0,info->keysize-n);
+}
+
+// Append to up the separator and block of a new node whose pairs
+// start at start in merged
+static void UpEntry(const NodeMetadata *info,
+		    const BYTE_T *merged,
+		    const SIZE_T start,
+		    const SIZE_T block,
+		    vector<BYTE_T> &up)
+{
+  const SIZE_T keysize = info->keysize;
+  const SIZE_T pairsize = info->GetPairSize();
+  const bool leaf = info->nodetype==BTREE_LEAF_NODE;
+  const BYTE_T *sep = merged+(leaf ? start : start-1)*pairsize;
+
+  up.resize(up.size()+keysize);
+  if (leaf) { 
+    Separator(info,sep-pairsize,sep,&up[up.size()-keysize]);
+  } else {
+    memcpy(&up[up.size()-keysize],sep,keysize);
+  }
+  up.insert(up.end(),(const BYTE_T *)&block,(const BYTE_T *)&block+sizeof(SIZE_T));
+}
+
+// The ith of numnodes nodes that numpairs sorted pairs are spread
+// evenly over gets n of them, starting at start.  Between interior
+// nodes one pair moves up instead, its pointer becoming the first of
+// the node after it.
+static void NodeRun(const SIZE_T i,
+		    const SIZE_T numnodes,
+		    const SIZE_T numpairs,
+		    const bool leaf,
+		    SIZE_T &start,
+		    SIZE_T &n)
+{
+  SIZE_T numkeys = leaf ? numpairs : numpairs-(numnodes-1);
+  SIZE_T extra = numkeys%numnodes;
+
+  n = numkeys/numnodes + (i<extra ? 1 : 0);
+  start = i*(numkeys/numnodes) + (i<extra ? i : extra) + (leaf ? 0 : i);
+}
+
+// The fewest nodes like info's that the pairs can be spread over
+// with none filled past fill.  With prefixes, that depends on which
+// keys end up together.
+static SIZE_T PlanNodes(const NodeMetadata *info,
+			const BYTE_T *pairs,
+			const SIZE_T numpairs,
+			const double fill)
+{
+  const bool leaf = info->nodetype==BTREE_LEAF_NODE;
+  const SIZE_T pairsize = info->GetPairSize();
+  SIZE_T numnodes, i, start, n;
+  bool fits;
+
+  // no node can take more than most, plus the pair that goes up from
+  // after it
+  if (info->IsSlotted()) { 
+    const SIZE_T most = FillBytes(info,fill)+2*(info->keysize+sizeof(SIZE_T));
+    numnodes = (info->GetStoredSize(pairs,numpairs)+most-1)/most;
+  } else {
+    const SIZE_T most = FillKeys(info, info->format==BTREE_FORMAT_PREFIX ? info->keysize : 0, fill);
+    numnodes = (numpairs+most)/(most+1);
+  }
+
+  for (; ; numnodes++) { 
+    if (numnodes==0) { 
+      continue;
+    }
+    fits=true;
+    for (i=0; i<numnodes && fits; i++) { 
+      NodeRun(i,numnodes,numpairs,leaf,start,n);
+      fits=FitsKeys(info,pairs+start*pairsize,n,pairsize,fill);
+    }
+    if (fits) { 
+      return numnodes;
+    }
+  }
+}
+
+
+// Where each of the numnodes nodes that numpairs sorted pairs go into
+// starts, and how many pairs it gets.  They are spread evenly, or a
+// split in two is made at splitpoint percent, or, packed, each node
+// but the last gets as many as it can take without having to split.
+// A plan that would leave a node too full falls back to the even
+// spread.
+static void SplitRuns(const NodeMetadata *info,
+		      const BYTE_T *pairs,
+		      const SIZE_T numpairs,
+		      const SIZE_T numnodes,
+		      const SIZE_T splitpoint,
+		      const bool packed,
+		      vector<SIZE_T> &starts,
+		      vector<SIZE_T> &counts)
+{
+  const bool leaf = info->nodetype==BTREE_LEAF_NODE;
+  const SIZE_T pairsize = info->GetPairSize();
+  SIZE_T i, start=0, n;
+
+  starts.resize(numnodes);
+  counts.resize(numnodes);
+  for (i=0;i<numnodes;i++) { 
+    NodeRun(i,numnodes,numpairs,leaf,starts[i],counts[i]);
+  }
+  if (numnodes<2 || (!packed && (splitpoint==0 || numnodes!=2))) { 
+    return;
+  }
+
+  vector<SIZE_T> s(numnodes), c(numnodes);
+  for (i=0;i+1<numnodes;i++) { 
+    // every node after this one needs a key, and between interior
+    // nodes a pair moves up
+    SIZE_T after = numnodes-1-i;
+    SIZE_T reserve = leaf ? after : 2*after;
+    if (numpairs-start<=reserve) { 
+      return;
+    }
+    SIZE_T most = numpairs-start-reserve;
+    if (packed) { 
+      // more pairs never fit where fewer don't
+      SIZE_T lo=1, hi=most;
+      while (lo<hi) { 
+	SIZE_T mid=lo+(hi-lo+1)/2;
+	if (FitsKeys(info,pairs+start*pairsize,mid,pairsize)) { 
+	  lo=mid;
+	} else {
+	  hi=mid-1;
+	}
+      }
+      n=lo;
+    } else {
+      n=numpairs*splitpoint/100;
+      n = n<1 ? 1 : n>most ? most : n;
+    }
+    s[i]=start;
+    c[i]=n;
+    start+=n+(leaf ? 0 : 1);
+  }
+  s[i]=start;
+  c[i]=numpairs-start;
+
+  for (i=0;i<numnodes;i++) { 
+    if (!FitsKeys(info,pairs+s[i]*pairsize,c[i],pairsize)) { 
+      return;
+    }
+  }
+  starts.swap(s);
+  counts.swap(c);
+}
+
+
+ERROR_T BTreeIndex::Descend(const KEY_T &key,
+			    BTreePath &path,
+			    BTreeNodeView &leaf,
+			    bool &found) const
+{
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  path.clear();
+  found=false;
+
+  for (;;) { 
+    rc=leaf.Pin(buffercache,node);
+    if (rc) { return rc; }
+
+    switch (leaf.info->nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (leaf.info->numkeys==0) { 
+	// There are no keys at all on this node, so nowhere to go
+	path.push_back(BTreePathEntry(node,0));
+	return ERROR_NOERROR;
+      }
+      // Keys equal to a separator live to its right
+      path.push_back(BTreePathEntry(node,leaf.FindChild(key)));
+      rc=leaf.GetPtr(path.back().slot,ptr);
+      if (rc) { return rc; }
+      node=ptr;
+      break;
+    case BTREE_LEAF_NODE:
+      path.push_back(BTreePathEntry(node,leaf.FindKey(key,found)));
+      return ERROR_NOERROR;
+      break;
+    default:
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+      break;
+    }
+  }
+
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value)
+{
+  BTreePath path;
+  BTreeNodeView b;
+  bool found;
+  ERROR_T rc;
+
+  rc=Descend(key,path,b,found);
+  if (rc) { return rc; }
+
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (op==BTREE_OP_LOOKUP) { 
+    return b.GetVal(path.back().slot,value);
+  } else { 
+    if (b.info->IsSlotted()) { 
+      // A longer value only goes in place if the leaf would not then
+      // have to split
+      VALUE_T old;
+      rc = b.GetVal(path.back().slot,old);
+      if (rc) { return rc; }
+      if (value.length>old.length &&
+	  b.GetUsedBytes()-sizeof(SIZE_T)-old.length+value.length >= MaxBytes(b.info)) { 
+	return ERROR_NOSPACE;
+      }
+    }
+    rc = b.SetVal(path.back().slot,value);
+    if (rc) {  return rc; }
+    return b.Unpin();
+  }
+}
+
+
+// A key as the user sees it: in the slotted format, without the zeros
+// it was filled out with
+static void TrimKey(const NodeMetadata *info, KEY_T &key)
+{
+  if (info->format==BTREE_FORMAT_SLOTTED) { 
+    key.Resize(info->GetStoredKeyLength(key.data));
+  }
+}
+
+
+// Typed keys are printed field by field
+static void PrintKey(ostream &os, const BTreeKeySchema &schema, const KEY_T &key, const SIZE_T n)
+{
+  if (!schema.Empty()) { 
+    schema.PrintKey(os,key);
+    return;
+  }
+  for (SIZE_T i=0;i<n;i++) { 
+    os << key.data[i];
+  }
+}
+
+
+// Values are read back from overflow blocks through cache, if it is
+// given
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, const BTreeNodeView &b, BTreeDisplayType dt,
+			 BufferCache *cache, const BTreeKeySchema &schema)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info->nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info->numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info->numkeys) break;
+	rc=b.GetKey(offset,key);
+	if (rc) {  return rc; }
+	PrintKey(os,schema,key,b.info->keysize);
+	os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info->numkeys;offset++) { 
+      if (offset==0) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << "(";
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      TrimKey(b.info,key);
+      PrintKey(os,schema,key,key.length);
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ",";
+      } else {
+	os << " ";
+      }
+      rc=b.GetVal(offset,value);
+      if (rc) {  return rc; }
+      if (cache) { 
+	VALUE_T stored=value;
+	rc=ReadValue(cache,stored,value);
+	if (rc) {  return rc; }
+      }
+      for (i=0;i<value.length;i++) { 
+	os << value.data[i];
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ")\n";
+      } else {
+	os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info->nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info->nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+ERROR_T BTreeIndex::CheckKey(const KEY_T &key) const
+{
+  if (superblock.info.format==BTREE_FORMAT_SLOTTED ? 
+      key.length>superblock.info.keysize : key.length!=superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::CheckValue(const VALUE_T &value) const
+{
+  SIZE_T valuesize = superinfo.overflowsize ? superinfo.overflowsize : superblock.info.valuesize;
+  if (superblock.info.format==BTREE_FORMAT_SLOTTED ? 
+      value.length>valuesize : value.length!=valuesize) { 
+    return ERROR_SIZE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+const KEY_T &BTreeIndex::WholeKey(const KEY_T &key, KEY_T &whole) const
+{
+  if (key.length==superblock.info.keysize) { 
+    return key;
+  }
+  whole.Resize(superblock.info.keysize,false);
+  memcpy(whole.data,key.data,key.length);
+  memset(whole.data+key.length,0,superblock.info.keysize-key.length);
+  return whole;
+}
+
+
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  KEY_T whole;
+  VALUE_T stored;
+  ERROR_T rc;
+  if (CheckKey(key)) { 
+    return ERROR_SIZE;
+  }
+  if (latches.Enabled()) { 
+    BTreeTreeLatch treelatch(latches,false);
+    return LatchedLookup(WholeKey(key,whole),value);
+  }
+  if (fixedlookup) { 
+    return fixedlookup(buffercache,superblock.info.rootnode,key.data,value);
+  }
+  if (!superinfo.overflowsize) { 
+    return LookupOrUpdateInternal(BTREE_OP_LOOKUP, WholeKey(key,whole), value);
+  }
+  rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, WholeKey(key,whole), stored);
+  if (rc) { return rc; }
+  return LoadValue(stored,value);
+}
+
+//
+// Every change made by one public operation is committed to the 
+// buffer cache as a unit, so with a write-ahead log a crash never
+// leaves half of a split on disk.  Without a log this does nothing.
+//
+// With several threads (SetConcurrent), inserts share the tree with
+// each other and with lookups, except for the first key of an empty
+// tree, which makes its first leaves, and a key whose leaf has to
+// split, which have the tree to themselves.
+//
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  KEY_T whole;
+  ERROR_T rc=ERROR_NONEXISTENT;
+  if (CheckKey(key) || CheckValue(value)) { 
+    return ERROR_SIZE;
+  }
+  const KEY_T &k = WholeKey(key,whole);
+  if (latches.Enabled()) { 
+    BTreeTreeLatch treelatch(latches,false);
+    rc=StoreAndInsert(k,value,true);
+  }
+  if (rc==ERROR_NONEXISTENT) { 
+    BTreeTreeLatch treelatch(latches,true);
+    rc=StoreAndInsert(k,value,false);
+  }
+  ERROR_T crc=Commit();
+  return rc ? rc : crc;
+}
+
+
+ERROR_T BTreeIndex::StoreAndInsert(const KEY_T &key, const VALUE_T &value, const bool latched)
+{
+  VALUE_T stored;
+  ERROR_T rc;
+
+  if (!superinfo.overflowsize) { 
+    return latched ? LatchedInsert(key,value) : InsertInternal(key,value);
+  }
+  rc=StoreValue(value,stored);
+  if (rc) { return rc; }
+  rc = latched ? LatchedInsert(key,stored) : InsertInternal(key,stored);
+  // A conflict, or a split left to the exclusive path, changes nothing
+  if (rc==ERROR_CONFLICT || rc==ERROR_NONEXISTENT) { 
+    FreeValue(stored);
+  } else if (rc) { 
+    FreeUnlessHeld(key,stored,latched);
+  }
+  return rc;
+}
+
+//
+// The key goes into its leaf, and then each split walks one step back
+// up the descent path, merging the separators for the new right hand
+// nodes into the parent, until a node has room.  (A node usually
+// splits in two, but one whose prefix got shorter may need more.)  If
+// the root itself splits, the tree grows a new root.  The blocks all
+// of that takes are counted first (PlanInsert), so that an insert
+// that cannot get them fails with ERROR_NOSPACE before it changes
+// anything.
+//
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value)
+{
+  BTreePath path;
+  BTreeNodeView b;
+  bool found;
+  ERROR_T rc;
+
+  rc = Descend(key, path, b, found);
+  if (rc) { return rc; }
+  if (found) {  return ERROR_CONFLICT;  }
+
+  if (b.info->nodetype != BTREE_LEAF_NODE) {
+    // The tree is empty, and b is the root.
+    // Allocate space and assign ptrs for new lhs and rhs leaf nodes.
+    SIZE_T lhs_ptr, rhs_ptr;
+    if (SpareBlocks()<2) { 
+      return ERROR_NOSPACE;
+    }
+    rc = AllocateNode(lhs_ptr, b.block);
+    if (rc) {  return rc;  }
+    rc = AllocateNode(rhs_ptr, lhs_ptr);
+    if (rc) {  return rc;  }
+
+    // Create new lhs leaf node and leave it empty.
+    BTreeNodeView lhs, rhs;
+    rc = lhs.Pin(buffercache,lhs_ptr,true);
+    if (rc) {  return rc;  }
+    lhs.Format(BTREE_LEAF_NODE,
+               b.info->keysize,
+               b.info->valuesize,
+               b.info->blocksize,
+               b.info->format,
+               b.info->maxfill);
+    rc = lhs.SetPtr(0,rhs_ptr);
+    if (rc) {  return rc;  }
+
+    // Create new rhs leaf node and insert first key value pair into 
+    // it, since the key also becomes the root's separator and keys 
+    // equal to a separator are found to its right.
+    rc = rhs.Pin(buffercache,rhs_ptr,true);
+    if (rc) {  return rc;  }
+    rhs.Format(BTREE_LEAF_NODE,
+               b.info->keysize,
+               b.info->valuesize,
+               b.info->blocksize,
+               b.info->format,
+               b.info->maxfill);
+
+    KeyValuePair kvp = KeyValuePair(key,value);
+    rc = rhs.InsertKeyVal(0,kvp);
+    if (rc) {  return rc;  }
+
+    // Insert key into root.
+    b.SetNumKeys(1); // can't insert ptrs without this line either
+    rc = b.SetKey(0, key);
+    if (rc) {  return rc;  }
+
+    // Insert ptr to lhs into root.
+    rc = b.SetPtr(0,lhs_ptr);
+    if (rc) {  return rc;  }
+
+    // Insert ptr to rhs into root.
+    return b.SetPtr(1, rhs_ptr);
+  }
+
+  rc = InsertIntoLeaf(b,path.back().slot,key,value);
+  if (rc != ERROR_NOSPACE) {  return rc; }
+
+  // The leaf has to split
+  vector<BYTE_T> pair(b.GetPairSize()), up, more;
+  bool append;
+  SIZE_T needed;
+  b.info->MakeKeyVal(key, value, &pair[0]);
+  rc = AppendsAt(b,path.back().slot,append);
+  if (rc) {  return rc; }
+  rc = PlanInsert(path,b,&pair[0],append,needed);
+  if (rc) {  return rc; }
+  if (needed > SpareBlocks()) { 
+    return ERROR_NOSPACE;
+  }
+  rc = MergePairs(b,&pair[0],1,up,append);
+  if (rc) {  return rc; }
+
+  SIZE_T level;
+  for (level = path.size()-1; level>0 && !up.empty(); level--) {
+    // The node at level split; its new siblings go just after it
+    // in the parent
+    rc = b.Pin(buffercache, path[level-1].block);
+    if (rc) { return rc; }
+    more.clear();
+    rc = MergePairs(b,&up[0],up.size()/b.GetPairSize(),more,append);
+    if (rc) { return rc; }
+    up.swap(more);
+  }
+
+  rc = b.Unpin();
+  if (rc) { return rc; }
+  if (up.empty()) { 
+    return ERROR_NOERROR;
+  }
+  return GrowRoot(up);
+}
+
+
+ERROR_T BTreeIndex::InsertIntoLeaf(BTreeNodeView &b,
+				   const SIZE_T slot,
+				   const KEY_T &key,
+				   const VALUE_T &value)
+{
+  // If the leaf would be full, or the key would shorten its prefix so
+  // much that it doesn't fit, the leaf has to split instead
+  KeyValuePair kvp = KeyValuePair(key, value);
+  ERROR_T rc = b.InsertKeyVal(slot,kvp);
+  if (rc == ERROR_NOERROR && Full(b)) {
+    rc = b.DeleteKeyVal(slot);
+    if (rc == ERROR_NOERROR) { 
+      rc = ERROR_NOSPACE;
+    }
+  }
+  return rc;
+}
+
+
+// A key after the last one of the last leaf is after every key of
+// the tree, and the splits it causes run up the right edge
+ERROR_T BTreeIndex::AppendsAt(const BTreeNodeView &b, const SIZE_T slot, bool &append) const
+{
+  SIZE_T next;
+  ERROR_T rc = b.GetPtr(0,next);
   if (rc) {  return rc; }
+  append = next==0 && slot==b.info->numkeys;
+  return ERROR_NOERROR;
+}
+
+
+// The blocks the separators in up would take, and the new roots they
+// would stack on the root, which splits
+ERROR_T BTreeIndex::PlanGrowRoot(vector<BYTE_T> &up, SIZE_T &needed)
+{
+  const SIZE_T entrysize = superblock.info.keysize+sizeof(SIZE_T);
+  vector<BYTE_T> buf(buffercache->GetBlockSize()), more;
+  BTreeNodeView root((NodeMetadata *)&buf[0],(char *)&buf[0]+sizeof(NodeMetadata));
+  ERROR_T rc;
+
+  while (!up.empty()) { 
+    root.Format(BTREE_ROOT_NODE,
+		superblock.info.keysize,
+		LeafValueSize(superblock.info),
+		buffercache->GetBlockSize(),
+		superblock.info.format,
+		superblock.info.maxfill);
+    more.clear();
+    rc = MergePairs(root,&up[0],up.size()/root.GetPairSize(),more,false,true);
+    if (rc) { return rc; }
+    needed += 1 + more.size()/entrysize;
+    up.swap(more);
+  }
+  return ERROR_NOERROR;
+}
+
+
+// The blocks merging pair into leaf b, at the end of path, would take
+// for b's new siblings, those of the nodes up the path that split in
+// turn, and new roots
+ERROR_T BTreeIndex::PlanInsert(const BTreePath &path,
+			       BTreeNodeView &b,
+			       const BYTE_T *pair,
+			       const bool append,
+			       SIZE_T &needed)
+{
+  const SIZE_T entrysize = superblock.info.keysize+sizeof(SIZE_T);
+  vector<BYTE_T> up, more;
+  BTreeNodeView p;
+  ERROR_T rc;
+
+  rc = MergePairs(b,pair,1,up,append,true);
+  if (rc) { return rc; }
+  needed = up.size()/entrysize;
+  for (SIZE_T level = path.size()-1; level>0 && !up.empty(); level--) { 
+    rc = p.Pin(buffercache, path[level-1].block);
+    if (rc) { return rc; }
+    more.clear();
+    rc = MergePairs(p,&up[0],up.size()/p.GetPairSize(),more,append,true);
+    if (rc) { return rc; }
+    needed += more.size()/entrysize;
+    up.swap(more);
+  }
+  return PlanGrowRoot(up,needed);
+}
+
+
+SIZE_T BTreeIndex::SpareBlocks() const
+{
+  return allocator.GetNumFree()+buffercache->GetNumBlocks()-superinfo.highwater;
+}
+
+
+ERROR_T BTreeIndex::LatchedRelease(BTreeNodeView &b)
+{
+  SIZE_T block=b.block;
+  ERROR_T rc=b.Unpin();
+  latches.Unlatch(block);
+  return rc;
+}
+
+
+//
+// The height of the tree (superblock.info.numkeys counts the levels
+// between the root and the leaves) says which node is the leaf.  Each
+// child is latched before its parent is let go.  The root and the
+// height only change with the tree latched exclusively.
+//
+ERROR_T BTreeIndex::LatchedDescend(const KEY_T &key,
+				   const bool exclusive,
+				   BTreeNodeView &b)
+{
+  SIZE_T node=superblock.info.rootnode, height=superblock.info.numkeys+1, ptr;
+  ERROR_T rc;
+
+  latches.Latch(node,false);
+  rc=b.Pin(buffercache,node);
+  if (rc) { 
+    latches.Unlatch(node);
+    return rc;
+  }
+  for (;;) { 
+    if (b.info->numkeys==0) { 
+      // Only the root of an empty tree has no keys
+      LatchedRelease(b);
+      return ERROR_NONEXISTENT;
+    }
+    rc=b.GetPtr(b.FindChild(key),ptr);
+    if (rc) { 
+      LatchedRelease(b);
+      return rc;
+    }
+    height--;
+    latches.Latch(ptr,exclusive && height==0);
+    rc=LatchedRelease(b);
+    if (rc==ERROR_NOERROR) { 
+      rc=b.Pin(buffercache,ptr);
+    }
+    if (rc) { 
+      latches.Unlatch(ptr);
+      return rc;
+    }
+    if (height==0) { 
+      return ERROR_NOERROR;
+    }
+  }
+}
+
+
+// The value is copied out of an overflow chain after the leaf is let
+// go; chains are only freed with the tree latched exclusively
+ERROR_T BTreeIndex::LatchedLookup(const KEY_T &key, VALUE_T &value)
+{
+  BTreeNodeView b;
+  VALUE_T stored;
+  SIZE_T slot;
+  bool found;
+  ERROR_T rc;
+
+  rc=LatchedDescend(key,false,b);
+  if (rc) { return rc; }
+  slot=b.FindKey(key,found);
+  if (!found) { 
+    rc=ERROR_NONEXISTENT;
+  } else { 
+    rc=b.GetVal(slot,superinfo.overflowsize ? stored : value);
+  }
+  ERROR_T urc=LatchedRelease(b);
+  if (rc || urc) { 
+    return rc ? rc : urc;
+  }
+  return superinfo.overflowsize ? LoadValue(stored,value) : ERROR_NOERROR;
+}
+
+
+//
+// Like InsertInternal, the key goes into its leaf, latched
+// exclusively.  A leaf that would have to split is left alone: how
+// many blocks the split takes depends on the nodes above it, which
+// other inserts may be splitting too, so the insert is made again
+// with the tree to itself (ERROR_NONEXISTENT), where InsertInternal
+// can count them before it changes anything.
+//
+ERROR_T BTreeIndex::LatchedInsert(const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNodeView b;
+  SIZE_T slot;
+  bool found;
+  ERROR_T rc, urc;
+
+  rc=LatchedDescend(key,true,b);
+  if (rc) { return rc; }
+  slot=b.FindKey(key,found);
+  rc = found ? ERROR_CONFLICT : InsertIntoLeaf(b,slot,key,value);
+  urc=LatchedRelease(b);
+  if (rc==ERROR_NOSPACE) { 
+    rc=ERROR_NONEXISTENT;
+  }
+  return rc ? rc : urc;
+}
+
+//
+// The root split, leaving in up the separators and blocks of its new
+// siblings.  It becomes an interior node under a new root, which
+// takes them in, and may have to split in turn.
+//
+ERROR_T BTreeIndex::GrowRoot(vector<BYTE_T> &up)
+{
+  BTreeNodeView b;
+  ERROR_T rc;
+
+  while (!up.empty()) { 
+    BTreeNodeView new_root;
+    vector<BYTE_T> more;
+    SIZE_T old_root_block = superblock.info.rootnode;
+    SIZE_T root_block;
+
+    rc = b.Pin(buffercache, old_root_block);
+    if (rc) { return rc; }
+
+    // allocate space for new root on disk; the old root stays the
+    // root, typed as one, until the new one has taken in its siblings
+    rc = AllocateNode(root_block, old_root_block);
+    if (rc) { return rc; }
+    rc = new_root.Pin(buffercache, root_block, true);
+    if (rc) { return rc; }
+    new_root.Format(BTREE_ROOT_NODE,
+		    b.info->keysize,
+		    b.info->valuesize,
+		    b.info->blocksize,
+		    b.info->format,
+		    b.info->maxfill);
+    new_root.info->rootnode = root_block;
+    rc = new_root.SetPtr(0, old_root_block);
+    if (rc == ERROR_NOERROR) { 
+      rc = MergePairs(new_root, &up[0], up.size()/new_root.GetPairSize(), more);
+    }
+    if (rc) { 
+      new_root.Unpin();
+      DeallocateNode(root_block);
+      return rc;
+    }
+    up.swap(more);
+
+    b.info->nodetype = BTREE_INTERIOR_NODE;
+    b.MarkDirty();
+
+    superblock.info.rootnode = root_block;
+    superblock.info.numkeys++;
+  }
+
+  return WriteSuperblock();
+}
+
+//
+// The nodes BulkLoad builds go in consecutive blocks, starting at the
+// high water mark.  They are laid out in a buffer and written a run of
+// blocks at a time, around the cache.  The newest node is held back
+// when a run is written, so that an overflow block can still be
+// linked to the next.  A node that has been written already (a leaf
+// followed by the overflow blocks of the next leaf's values) is read
+// back through the cache when the leaves are linked and evened out.
+//
+#define BULKLOAD_RUN_BYTES (1024*1024)
+
+class BulkRun {
+ private:
+  BufferCache     *cache;
+  SIZE_T           blocksize;
+  SIZE_T           maxblocks;
+  vector<BYTE_T>   buf;
+  vector<BYTE_T *> bufs;
+  SIZE_T           first;   // block of the start of buf
+  SIZE_T           count;   // blocks in buf
+ public:
+  BulkRun(BufferCache *c, const SIZE_T start) : 
+    cache(c), blocksize(c->GetBlockSize()), first(start), count(0) {
+    maxblocks = BULKLOAD_RUN_BYTES/blocksize < 2 ? 2 : BULKLOAD_RUN_BYTES/blocksize;
+    buf.resize(maxblocks*blocksize);
+    for (SIZE_T i=0;i<maxblocks;i++) { 
+      bufs.push_back(&buf[i*blocksize]);
+    }
+  }
+
+  // Start the next node, zeroed, in block
+  ERROR_T Append(SIZE_T &block) {
+    ERROR_T rc;
+    if (count==maxblocks) { 
+      rc=cache->WriteBlocks(first,count-1,&bufs[0]);
+      if (rc) { return rc; }
+      memcpy(bufs[0],bufs[count-1],blocksize);
+      first+=count-1;
+      count=1;
+    }
+    block=first+count;
+    if (block>=cache->GetNumBlocks()) { 
+      return ERROR_NOSPACE;
+    }
+    cache->NotifyAllocateBlock(block);
+    memset(bufs[count],0,blocksize);
+    count++;
+    return ERROR_NOERROR;
+  }
+
+  // A node of the run, in the buffer if it has not been written yet
+  ERROR_T Get(const SIZE_T block, BTreeNodeView &node) {
+    if (block<first) { 
+      return node.Pin(cache,block);
+    }
+    assert(block<first+count);
+    BYTE_T *p=bufs[block-first];
+    node=BTreeNodeView((NodeMetadata *)p,(char *)p+sizeof(NodeMetadata));
+    return ERROR_NOERROR;
+  }
+
+  // Write everything
+  ERROR_T Finish() {
+    ERROR_T rc=ERROR_NOERROR;
+    if (count>0) { 
+      rc=cache->WriteBlocks(first,count,&bufs[0]);
+      first+=count;
+      count=0;
+    }
+    return rc;
+  }
+
+  SIZE_T End() const { return first+count; }
+};
+
+
+// Start the next leaf of a level in a new block, with n pairs, after
+// those in blocks, and its separator from the one before
+static ERROR_T AppendLeaf(BulkRun &run,
+			  const NodeMetadata &shape,
+			  const BYTE_T *pairs,
+			  const SIZE_T n,
+			  vector<BYTE_T> &lowkeys,
+			  vector<SIZE_T> &blocks)
+{
+  SIZE_T block;
+  BTreeNodeView leaf, prev;
+  ERROR_T rc;
+
+  rc = run.Append(block);
+  if (rc) { return rc; }
+  rc = run.Get(block, leaf);
+  if (rc) { return rc; }
+  leaf.Format(BTREE_LEAF_NODE, shape.keysize, shape.valuesize, shape.blocksize, shape.format, shape.maxfill);
+  rc = leaf.SetPairs(pairs, n);
+  if (rc) { return rc; }
+  lowkeys.resize(lowkeys.size()+shape.keysize);
+  if (!blocks.empty()) {
+    vector<BYTE_T> last(leaf.GetPairSize());
+    rc = run.Get(blocks.back(), prev);
+    if (rc) { return rc; }
+    prev.SetPtr(0, block);
+    if (n > 0) {
+      prev.GetPairs(prev.info->numkeys-1, 1, &last[0]);
+      Separator(&shape, &last[0], pairs, &lowkeys[lowkeys.size()-shape.keysize]);
+    }
+  }
+  blocks.push_back(block);
+  return ERROR_NOERROR;
+}
+
+
+// A value as a leaf of the run keeps it, written out to overflow
+// blocks of the run if it is too long for the leaf
+static ERROR_T AppendValue(BulkRun &run,
+			   const NodeMetadata &shape,
+			   const VALUE_T &value,
+			   VALUE_T &stored)
+{
+  SIZE_T first, block, done = 0;
+  BTreeNodeView b;
+  ERROR_T rc;
+
+  if (InlineValue(shape.valuesize, value, stored)) {
+    return ERROR_NOERROR;
+  }
+  rc = run.Append(first);
+  if (rc) { return rc; }
+  block = first;
+  for (;;) {
+    rc = run.Get(block, b);
+    if (rc) { return rc; }
+    FillOverflow(b, shape.blocksize, value.data, value.length, done);
+    if (done == value.length) {
+      break;
+    }
+    // the next block is the run's next; Append may move this one
+    block = run.End();
+    memcpy(b.data, &block, sizeof(SIZE_T));
+    rc = run.Append(block);
+    if (rc) { return rc; }
+  }
+  MakeRef(first, value.length, stored);
+  return ERROR_NOERROR;
+}
+
+
+// The separator and block of each child of a level but the first, as
+// its parents take them
+static void LevelPairs(const vector<BYTE_T> &lowkeys,
+		       const vector<SIZE_T> &blocks,
+		       const SIZE_T keysize,
+		       vector<BYTE_T> &pairs)
+{
+  pairs.clear();
+  for (SIZE_T i = 1; i < blocks.size(); i++) {
+    pairs.insert(pairs.end(), &lowkeys[i*keysize], &lowkeys[(i+1)*keysize]);
+    pairs.insert(pairs.end(), (const BYTE_T *)&blocks[i], (const BYTE_T *)&blocks[i]+sizeof(SIZE_T));
+  }
+}
+
+
+ERROR_T BTreeIndex::BulkLoad(BTreeBulkSource &source, const double fill)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  ERROR_T rc=BulkLoadInternal(source,fill);
+  ERROR_T crc=Commit();
+  return rc ? rc : crc;
+}
+
+
+ERROR_T BTreeIndex::BulkLoadInternal(BTreeBulkSource &source, const double fill)
+{
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T valuesize=superblock.info.valuesize;
+  SIZE_T blocksize=buffercache->GetBlockSize();
+  BTreeNodeView root;
+  ERROR_T rc;
+
+  rc = root.Pin(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (root.info->numkeys > 0) {
+    return ERROR_CONFLICT;
+  }
+
+  BulkRun run(buffercache, superinfo.highwater);
+  // The separator before, and the block of, each node of the level
+  // being built
+  vector<BYTE_T> lowkeys;
+  vector<SIZE_T> blocks;
+  // The pairs of the leaf being filled, and the last key seen
+  NodeMetadata leafshape = *root.info;
+  leafshape.nodetype = BTREE_LEAF_NODE;
+  const SIZE_T pairsize = leafshape.GetPairSize();
+  vector<BYTE_T> pending;
+  SIZE_T npending = 0;
+  vector<BYTE_T> last(keysize);
+  bool any = false;
+  KEY_T key, whole;
+  VALUE_T value, stored;
+
+  // Leaves, left to right, each as full as fill allows
+  while ((rc = source.Next(key, value)) == ERROR_NOERROR) {
+    if (CheckKey(key) || CheckValue(value)) {
+      return ERROR_SIZE;
+    }
+    const KEY_T &k = WholeKey(key, whole);
+    if (any && memcmp(&last[0], k.data, keysize) >= 0) {
+      return ERROR_CONFLICT;
+    }
+    memcpy(&last[0], k.data, keysize);
+    any = true;
+    if (superinfo.overflowsize) {
+      rc = AppendValue(run, leafshape, value, stored);
+      if (rc) { return rc; }
+    }
+    pending.resize(pending.size()+pairsize);
+    leafshape.MakeKeyVal(k, superinfo.overflowsize ? stored : value, &pending[pending.size()-pairsize]);
+    npending++;
+    if (!FitsKeys(&leafshape, &pending[0], npending, pairsize, fill)) {
+      // the leaf is full without this pair, which starts the next
+      rc = AppendLeaf(run, leafshape, &pending[0], npending-1, lowkeys, blocks);
+      if (rc) { return rc; }
+      pending.erase(pending.begin(), pending.end()-pairsize);
+      npending = 1;
+    }
+  }
+  if (rc != ERROR_NONEXISTENT) { return rc; }
+
+  if (!any) {
+    return ERROR_NOERROR;
+  }
+  rc = AppendLeaf(run, leafshape, &pending[0], npending, lowkeys, blocks);
+  if (rc) { return rc; }
+
+  if (blocks.size() == 1) {
+    // The root needs two children; the pairs are split between two
+    // leaves below
+    rc = AppendLeaf(run, leafshape, 0, 0, lowkeys, blocks);
+    if (rc) { return rc; }
+  }
+
+  // The last leaf may be short; even it out with the one before, if
+  // the halves fit (they may not if the prefix gets shorter)
+  BTreeNodeView l, r;
+  rc = run.Get(blocks[blocks.size()-2], l);
+  if (rc) { return rc; }
+  rc = run.Get(blocks[blocks.size()-1], r);
+  if (rc) { return rc; }
+  SIZE_T lhs_numkeys = l.info->numkeys;
+  SIZE_T rhs_numkeys = r.info->numkeys;
+  if (rhs_numkeys == 0 || rhs_numkeys < MinKeys(r.info)) {
+    SIZE_T total = lhs_numkeys + rhs_numkeys;
+    SIZE_T half = total/2;
+    vector<BYTE_T> all(total*pairsize);
+    l.GetPairs(0, lhs_numkeys, &all[0]);
+    r.GetPairs(0, rhs_numkeys, &all[lhs_numkeys*pairsize]);
+    if (FitsKeys(l.info, &all[0], half, pairsize) &&
+        FitsKeys(r.info, &all[half*pairsize], total-half, pairsize)) {
+      rc = l.SetPairs(&all[0], half);
+      if (rc) { return rc; }
+      rc = r.SetPairs(&all[half*pairsize], total-half);
+      if (rc) { return rc; }
+      Separator(&leafshape, half>0 ? &all[(half-1)*pairsize] : 0, &all[half*pairsize],
+                &lowkeys[(blocks.size()-1)*keysize]);
+    }
+  }
+
+  l.Unpin();
+  r.Unpin();
+  rc = run.Finish();
+  if (rc) { return rc; }
+
+  // Then interior levels, until what is left fits under the root
+  NodeMetadata shape = *root.info;
+  shape.nodetype = BTREE_INTERIOR_NODE;
+  const SIZE_T ipairsize = keysize+sizeof(SIZE_T);
+  vector<BYTE_T> pairs;
+  SIZE_T levels = 0;
+  for (;;) {
+    LevelPairs(lowkeys, blocks, keysize, pairs);
+    if (FitsKeys(root.info, &pairs[0], blocks.size()-1, ipairsize)) {
+      break;
+    }
+    vector<BYTE_T> uplowkeys;
+    vector<SIZE_T> upblocks;
+    // as few nodes as fill allows, with the children spread evenly
+    SIZE_T numnodes = PlanNodes(&shape, &pairs[0], blocks.size()-1, fill);
+    for (SIZE_T i = 0; i < numnodes; i++) {
+      SIZE_T start, n, block, ptr;
+      NodeRun(i, numnodes, blocks.size()-1, false, start, n);
+      rc = run.Append(block);
+      if (rc) { return rc; }
+      BTreeNodeView node;
+      rc = run.Get(block, node);
+      if (rc) { return rc; }
+      node.Format(BTREE_INTERIOR_NODE, keysize, valuesize, blocksize, shape.format, shape.maxfill);
+      // the first child's separator is the one that goes up
+      if (i == 0) {
+        ptr = blocks[0];
+        uplowkeys.insert(uplowkeys.end(), &lowkeys[0], &lowkeys[keysize]);
+      } else {
+        memcpy(&ptr, &pairs[(start-1)*ipairsize+keysize], sizeof(SIZE_T));
+        uplowkeys.insert(uplowkeys.end(), &pairs[(start-1)*ipairsize], &pairs[(start-1)*ipairsize+keysize]);
+      }
+      node.SetPtr(0, ptr);
+      rc = node.SetPairs(&pairs[start*ipairsize], n);
+      if (rc) { return rc; }
+      upblocks.push_back(block);
+    }
+    rc = run.Finish();
+    if (rc) { return rc; }
+    lowkeys.swap(uplowkeys);
+    blocks.swap(upblocks);
+    levels++;
+  }
+
+  // With a log, the new nodes must be on disk before the root that
+  // points to them can commit
+  rc = buffercache->Checkpoint();
+  if (rc) { return rc; }
+
+  rc = root.SetPtr(0, blocks[0]);
+  if (rc) { return rc; }
+  rc = root.SetPairs(&pairs[0], blocks.size()-1);
+  if (rc) { return rc; }
+
+  superinfo.highwater = run.End();
+  superblock.info.numkeys = levels;
+  return WriteSuperblock();
+}
+
+
+//
+// A batch walks down the tree once, with its keys in sorted order.
+// Each interior node on the way hands each child the run of keys that
+// belong under it, so every node the batch touches is pinned and
+// changed once, however many of its keys fall there.
+//
+
+// Orders batch positions by key, and equal keys by position
+struct BatchOrder {
+  const vector<const KEY_T *> *keys;
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    int c=memcmp((*keys)[a]->data,(*keys)[b]->data,(*keys)[a]->length);
+    return c<0 || (c==0 && a<b);
+  }
+};
+
+static void SortBatch(const vector<const KEY_T *> &keys, vector<SIZE_T> &order)
+{
+  BatchOrder less;
+  less.keys=&keys;
+  order.resize(keys.size());
+  for (SIZE_T i=0;i<keys.size();i++) { 
+    order[i]=i;
+  }
+  sort(order.begin(),order.end(),less);
+}
+
+// The end of the run of sorted keys, from first, that go to the same
+// child of interior node b, and which child that is
+static SIZE_T BatchRun(const BTreeNodeView &b,
+		       const vector<const KEY_T *> &keys,
+		       const vector<SIZE_T> &order,
+		       const SIZE_T first,
+		       const SIZE_T end,
+		       SIZE_T &child)
+{
+  SIZE_T i;
+  child=b.FindChild(*keys[order[first]]);
+  if (child==b.info->numkeys) { 
+    return end;
+  }
+  for (i=first+1; i<end && b.CompareKey(child,*keys[order[i]])>0; i++) { 
+  }
+  return i;
+}
+
+// A node on the way down: its run [lo,hi) of the batch, how far its
+// children have got through it, and the (separator, block) pairs of
+// the nodes they split off
+struct BatchFrame {
+  SIZE_T         block;
+  SIZE_T         lo, hi, next;
+  vector<BYTE_T> up;
+
+  BatchFrame(const SIZE_T b, const SIZE_T l, const SIZE_T h) : block(b), lo(l), hi(h), next(l) {}
+};
+
+
+ERROR_T BTreeIndex::MultiLookup(const vector<KEY_T> &keys, 
+				vector<VALUE_T> &values,
+				vector<ERROR_T> &results)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  vector<const KEY_T *> keyptrs;
+  vector<SIZE_T> order;
+  vector<BatchFrame> stack;
+  BTreeNodeView b;
+  SIZE_T i, end, child, ptr, offset;
+  bool found;
+  ERROR_T rc;
+
+  vector<KEY_T> whole(keys.size());
+
+  for (i=0;i<keys.size();i++) { 
+    if (CheckKey(keys[i])) { 
+      return ERROR_SIZE;
+    }
+    keyptrs.push_back(&WholeKey(keys[i],whole[i]));
+  }
+  values.resize(keys.size());
+  results.assign(keys.size(),ERROR_NONEXISTENT);
+
+  SortBatch(keyptrs,order);
+
+  stack.push_back(BatchFrame(superblock.info.rootnode,0,order.size()));
+
+  while (!stack.empty()) { 
+    rc=b.Pin(buffercache,stack.back().block);
+    if (rc) { return rc; }
+
+    switch (b.info->nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (stack.back().next==stack.back().hi || b.info->numkeys==0) { 
+	stack.pop_back();
+	break;
+      }
+      end=BatchRun(b,keyptrs,order,stack.back().next,stack.back().hi,child);
+      rc=b.GetPtr(child,ptr);
+      if (rc) { return rc; }
+      stack.push_back(BatchFrame(ptr,stack.back().next,end));
+      stack[stack.size()-2].next=end;
+      break;
+    case BTREE_LEAF_NODE:
+      for (i=stack.back().lo;i<stack.back().hi;i++) { 
+	offset=b.FindKey(*keyptrs[order[i]],found);
+	if (found) { 
+	  rc=b.GetVal(offset,values[order[i]]);
+	  if (rc) { return rc; }
+	  results[order[i]]=ERROR_NOERROR;
+	}
+      }
+      stack.pop_back();
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+
+  if (superinfo.overflowsize) { 
+    b.Unpin();
+    for (i=0;i<keys.size();i++) { 
+      if (results[i]==ERROR_NOERROR) { 
+	VALUE_T stored=values[i];
+	rc=LoadValue(stored,values[i]);
+	if (rc) { return rc; }
+      }
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::MultiInsert(const vector<KeyValuePair> &pairs,
+				vector<ERROR_T> &results)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  vector<KeyValuePair> whole;
+  SIZE_T stored=0;
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (SIZE_T i=0;i<pairs.size();i++) { 
+    if (CheckKey(pairs[i].key) || CheckValue(pairs[i].value)) { 
+      return ERROR_SIZE;
+    }
+    if ((pairs[i].key.length!=superblock.info.keysize || superinfo.overflowsize) && whole.empty()) { 
+      whole=pairs;
+    }
+  }
+  for (SIZE_T i=0;i<whole.size();i++) { 
+    KEY_T key;
+    whole[i].key=WholeKey(whole[i].key,key);
+    if (superinfo.overflowsize && rc==ERROR_NOERROR) { 
+      rc=StoreValue(pairs[i].value,whole[i].value);
+      stored += rc==ERROR_NOERROR;
+    }
+  }
+  if (rc==ERROR_NOERROR) { 
+    rc=MultiInsertInternal(whole.empty() ? pairs : whole,results);
+  }
+  // the values that did not go in give back their overflow blocks
+  for (SIZE_T i=0;i<stored;i++) { 
+    if (rc==ERROR_NOERROR && results[i]==ERROR_CONFLICT) { 
+      FreeValue(whole[i].value);
+    } else if (rc || results[i]!=ERROR_NOERROR) { 
+      FreeUnlessHeld(whole[i].key,whole[i].value,false);
+    }
+  }
+  ERROR_T crc=Commit();
+  return rc ? rc : crc;
+}
+
+//
+// Each leaf takes in all of its new pairs at once, and splits into as
+// many nodes as it needs.  The (separator, block) pairs for those are
+// collected in the parent's frame, and the parent takes them all in
+// once its last child is done, splitting in turn.  If the root splits,
+// new roots are stacked on it until one has room.  The walk is made
+// twice, first only counting the blocks the splits will take; if
+// there aren't that many, the pairs go in one at a time instead, and
+// those that find no room fail with ERROR_NOSPACE on their own.
+//
+ERROR_T BTreeIndex::MultiInsertInternal(const vector<KeyValuePair> &pairs,
+					vector<ERROR_T> &results)
+{
+  vector<const KEY_T *> keyptrs;
+  vector<SIZE_T> order, batch;
+  vector<BatchFrame> stack;
+  vector<BYTE_T> add, up;
+  BTreeNodeView b;
+  SIZE_T i, end, child, ptr, first=0, needed=0;
+  bool found;
+  ERROR_T rc;
+
+  for (i=0;i<pairs.size();i++) { 
+    keyptrs.push_back(&pairs[i].key);
+  }
+  results.assign(pairs.size(),ERROR_NOERROR);
+
+  SortBatch(keyptrs,order);
+
+  // As with single inserts, a key repeated in the batch goes in the
+  // first time and conflicts after that
+  for (i=0;i<order.size();i++) { 
+    if (!batch.empty() && *keyptrs[order[i]]==*keyptrs[batch.back()]) { 
+      results[order[i]]=ERROR_CONFLICT;
+    } else {
+      batch.push_back(order[i]);
+    }
+  }
+  if (batch.empty()) { 
+    return ERROR_NOERROR;
+  }
+
+  // An empty tree first needs its two leaves, which a single insert
+  // makes
+  rc=b.Pin(buffercache,superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (b.info->numkeys==0) { 
+    rc=b.Unpin();
+    if (rc) { return rc; }
+    rc=InsertInternal(pairs[batch[0]].key,pairs[batch[0]].value);
+    if (rc) { return rc; }
+    first=1;
+  }
+
+  // With whole keys in every node, none gets more new siblings than
+  // it takes in pairs, so a batch of m pairs takes at most m blocks a
+  // level, and fewer than 2m+1 more for new roots.  With that many to
+  // spare, there is no need to count.
+  const SIZE_T m = batch.size()-first;
+  int pass = 0;
+  if (superblock.info.format==BTREE_FORMAT_PLAIN &&
+      SpareBlocks()>=m*(superblock.info.numkeys+4)+1) { 
+    pass = 1;
+  }
+
+  for (; pass<2; pass++) { 
+    const bool plan = pass==0;
+
+    stack.push_back(BatchFrame(superblock.info.rootnode,first,batch.size()));
+
+    while (!stack.empty()) { 
+      rc=b.Pin(buffercache,stack.back().block);
+      if (rc) { return rc; }
+
+      up.clear();
+
+      switch (b.info->nodetype) { 
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (stack.back().next<stack.back().hi) { 
+	  end=BatchRun(b,keyptrs,batch,stack.back().next,stack.back().hi,child);
+	  rc=b.GetPtr(child,ptr);
+	  if (rc) { return rc; }
+	  stack.push_back(BatchFrame(ptr,stack.back().next,end));
+	  stack[stack.size()-2].next=end;
+	  continue;
+	}
+	// All of the children are done
+	if (!stack.back().up.empty()) { 
+	  rc=MergePairs(b,&stack.back().up[0],stack.back().up.size()/b.GetPairSize(),up,false,plan);
+	  if (rc) { return rc; }
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	add.clear();
+	for (i=stack.back().lo;i<stack.back().hi;i++) { 
+	  const KeyValuePair &p=pairs[batch[i]];
+	  b.FindKey(p.key,found);
+	  if (found) { 
+	    results[batch[i]]=ERROR_CONFLICT;
+	  } else {
+	    add.resize(add.size()+b.GetPairSize());
+	    b.info->MakeKeyVal(p.key,p.value,&add[add.size()-b.GetPairSize()]);
+	  }
+	}
+	if (!add.empty()) { 
+	  rc=MergePairs(b,&add[0],add.size()/b.GetPairSize(),up,false,plan);
+	  if (rc) { return rc; }
+	}
+	break;
+      default:
+	return ERROR_INSANE;
+      }
+
+      needed+=up.size()/(superblock.info.keysize+sizeof(SIZE_T));
+      stack.pop_back();
+      if (!stack.empty()) { 
+	stack.back().up.insert(stack.back().up.end(),up.begin(),up.end());
+      }
+    }
+
+    rc=b.Unpin();
+    if (rc) { return rc; }
+    if (!plan) { 
+      break;
+    }
+    rc=PlanGrowRoot(up,needed);
+    if (rc) { return rc; }
+    if (needed>SpareBlocks()) { 
+      for (i=first;i<batch.size();i++) { 
+	if (results[batch[i]]==ERROR_NOERROR) { 
+	  rc=InsertInternal(pairs[batch[i]].key,pairs[batch[i]].value);
+	  if (rc && rc!=ERROR_CONFLICT && rc!=ERROR_NOSPACE) { 
+	    return rc;
+	  }
+	  results[batch[i]]=rc;
+	}
+      }
+      return ERROR_NOERROR;
+    }
+  }
+
+  if (up.empty()) { 
+    return ERROR_NOERROR;
+  }
+  return GrowRoot(up);
+}
+
+//
+// Merge numpairs sorted pairs (key and value for a leaf, key and
+// pointer for an interior node) into node b.  If they don't all fit,
+// they are spread evenly over b and as few new nodes to its right as
+// will hold them, and the separator and block of each new node are
+// appended to up, in order.  For an interior node, the pair between
+// two nodes moves up, its pointer becoming the new node's first.
+// Planning, b is left as it is and the separators go up with block
+// 0, so that what a merge would take can be counted beforehand.
+//
+ERROR_T BTreeIndex::MergePairs(BTreeNodeView &b,
+			       const BYTE_T *pairs,
+			       const SIZE_T numpairs,
+			       vector<BYTE_T> &up,
+			       const bool append,
+			       const bool plan)
+{
+  const bool leaf = b.info->nodetype==BTREE_LEAF_NODE;
+  const SIZE_T keysize = b.info->keysize;
+  const SIZE_T pairsize = b.GetPairSize();
+  const SIZE_T oldnum = b.info->numkeys;
+  const SIZE_T total = oldnum+numpairs;
+  SIZE_T i=0, j=0;
+  ERROR_T rc;
+
+  if (total==0) { 
+    return ERROR_NOERROR;
+  }
+  // Keys that would fit even with no prefix need no split
+  if (plan && !b.info->IsSlotted() && total<=FillKeys(b.info,0,1.0)) { 
+    return ERROR_NOERROR;
+  }
+
+  vector<BYTE_T> old(oldnum*pairsize), merged(total*pairsize);
+  if (oldnum>0) { 
+    b.GetPairs(0,oldnum,&old[0]);
+  }
+  BYTE_T *out = &merged[0];
+  while (i<oldnum || j<numpairs) { 
+    if (j==numpairs || (i<oldnum && memcmp(&old[i*pairsize],pairs+j*pairsize,keysize)<0)) { 
+      memcpy(out,&old[i*pairsize],pairsize);
+      i++;
+    } else {
+      memcpy(out,pairs+j*pairsize,pairsize);
+      j++;
+    }
+    out+=pairsize;
+  }
+
+  SIZE_T numnodes = PlanNodes(b.info,&merged[0],total,1.0);
+  vector<SIZE_T> starts, counts;
+  SplitRuns(b.info,&merged[0],total,numnodes,superinfo.splitpoint,
+	    append && superinfo.appendsplit,starts,counts);
+
+  // The separator comes from the first key of a new leaf, or is the
+  // pair that moves up from between interior nodes
+  vector<SIZE_T> blocks(numnodes,0);
+  if (plan) { 
+    for (i=1;i<numnodes;i++) { 
+      UpEntry(b.info,&merged[0],starts[i],blocks[i],up);
+    }
+    return ERROR_NOERROR;
+  }
+  blocks[0]=b.block;
+  for (i=1;i<numnodes;i++) { 
+    rc=AllocateNode(blocks[i],blocks[i-1]);
+    if (rc) { 
+      while (--i>0) { 
+	DeallocateNode(blocks[i]);
+      }
+      return rc;
+    }
+  }
+
+  // The new leaves go into the chain just after b
+  SIZE_T next_leaf=0;
+  if (leaf) { 
+    rc=b.GetPtr(0,next_leaf);
+    if (rc) { return rc; }
+  }
+
+  BTreeNodeView node;
+
+  for (i=0;i<numnodes;i++) { 
+    SIZE_T start=starts[i], n=counts[i];
+    BTreeNodeView &dst = i==0 ? b : node;
+
+    if (i>0) { 
+      rc=node.Pin(buffercache,blocks[i],true);
+      if (rc) { return rc; }
+      node.Format(leaf ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+		  keysize,b.info->valuesize,b.info->blocksize,b.info->format,b.info->maxfill);
+      UpEntry(b.info,&merged[0],start,blocks[i],up);
+      if (!leaf) { 
+	SIZE_T ptr;
+	memcpy(&ptr,&merged[(start-1)*pairsize]+keysize,sizeof(SIZE_T));
+	rc=node.SetPtr(0,ptr);
+	if (rc) { return rc; }
+      }
+    }
+    if (leaf) { 
+      rc=dst.SetPtr(0, i+1<numnodes ? blocks[i+1] : next_leaf);
+      if (rc) { return rc; }
+    }
+    rc=dst.SetPairs(&merged[start*pairsize],n);
+    if (rc) { return rc; }
+  }
+
+  return ERROR_NOERROR;
+}
+
+//
+// A longer value (in the slotted format) that its leaf has no room
+// for is deleted and inserted again, letting the leaf split as it
+// needs to.  An old value in overflow blocks is freed once the new one
+// has replaced it.
+//
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  KEY_T whole;
+  if (CheckKey(key) || CheckValue(value)) { 
+    return ERROR_SIZE;
+  }
+  const KEY_T &k = WholeKey(key,whole);
+  VALUE_T val = value;
+  ERROR_T rc;
+  if (superblock.info.format!=BTREE_FORMAT_SLOTTED && !superinfo.overflowsize) { 
+    rc=LookupOrUpdateInternal(BTREE_OP_UPDATE, k, val);
+  } else {
+    VALUE_T old;
+    rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, k, old);
+    if (rc==ERROR_NOERROR && superinfo.overflowsize) { 
+      rc=StoreValue(value,val);
+    }
+    if (rc==ERROR_NOERROR) { 
+      // In place if the leaf has room for it, and otherwise out and
+      // back in, putting the old value back if the new one can't go
+      rc=LookupOrUpdateInternal(BTREE_OP_UPDATE, k, val);
+      // The delete may merge leaves, so there must be blocks for the
+      // old pair to go back in with, up to two new nodes at every
+      // level and a new root
+      if (rc==ERROR_NOSPACE && SpareBlocks()>=2*(superblock.info.numkeys+1)+1) { 
+	rc=DeleteInternal(k);
+	if (rc==ERROR_NOERROR) { 
+	  rc=InsertInternal(k,val);
+	}
+      }
+      // An insert that failed on a read or write may still have put
+      // the new pair in; if it did not, the old pair goes back.  The
+      // old value's chain is freed only once the new pair is in.
+      bool replaced = rc==ERROR_NOERROR;
+      if (rc) { 
+	VALUE_T now;
+	ERROR_T lrc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, k, now);
+	if (lrc==ERROR_NONEXISTENT) { 
+	  InsertInternal(k,old);
+	}
+	replaced = lrc==ERROR_NOERROR && now==val;
+      }
+      if (superinfo.overflowsize) { 
+	FreeValue(replaced ? old : val);
+      }
+    }
+  }
+  ERROR_T crc=Commit();
+  return rc ? rc : crc;
+}
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  KEY_T whole;
+  VALUE_T old;
+  ERROR_T rc=ERROR_NOERROR;
+  if (CheckKey(key)) { 
+    return ERROR_SIZE;
+  }
+  const KEY_T &k = WholeKey(key,whole);
+  if (superinfo.overflowsize) { 
+    rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, k, old);
+  }
+  if (rc==ERROR_NOERROR) { 
+    rc=DeleteInternal(k);
+  }
+  if (rc==ERROR_NOERROR && superinfo.overflowsize) { 
+    rc=FreeValue(old);
+  }
+  ERROR_T crc=Commit();
+  return rc ? rc : crc;
+}
+
+//
+// The key comes out of its leaf, and then each node left underfull is
+// fixed up from its parent, one step back up the descent path at a
+// time, until a node is big enough.  Merges free the right hand node.
+// When the root is left with a single interior child, that child
+// becomes the root and the tree gets shorter.
+//
+ERROR_T BTreeIndex::DeleteInternal(const KEY_T &key)
+{
+  BTreePath path;
+  BTreeNodeView b;
+  bool found;
+  ERROR_T rc;
+
+  rc = Descend(key, path, b, found);
+  if (rc) { return rc; }
+  if (!found) {  return ERROR_NONEXISTENT;  }
+
+  rc = b.DeleteKeyVal(path.back().slot);
+  if (rc) { return rc; }
+
+  SIZE_T level;
+  for (level = path.size()-1; level>0; level--) {
+    if (!Underfull(b)) {
+      return b.Unpin();
+    }
+    rc = b.Pin(buffercache, path[level-1].block);
+    if (rc) { return rc; }
+    rc = RebalanceChild(b, path[level-1].slot);
+    if (rc) { return rc; }
+  }
+
+  // b is the root.  If it has no keys left over interior children, its
+  // only child takes its place.  (Over leaves, no keys means the tree
+  // is empty.)
+  if (b.info->numkeys > 0 || path.size() <= 2) {
+    return b.Unpin();
+  }
+
+  SIZE_T old_root_block = superblock.info.rootnode;
+  SIZE_T child;
+  rc = b.GetPtr(0, child);
+  if (rc) { return rc; }
+  rc = b.Unpin();
+  if (rc) { return rc; }
+
+  rc = b.Pin(buffercache, child);
+  if (rc) { return rc; }
+  b.info->nodetype = BTREE_ROOT_NODE;
+  b.info->rootnode = child;
+  b.MarkDirty();
+  rc = b.Unpin();
+  if (rc) { return rc; }
+
+  superblock.info.rootnode = child;
+  superblock.info.numkeys--;
+
+  rc = WriteSuperblock();
+  if (rc) { return rc; }
+  return DeallocateNode(old_root_block);
+}
+
+
+ERROR_T BTreeIndex::RebalanceChild(BTreeNodeView &p, const SIZE_T slot)
+{
+  ERROR_T rc;
+  BTreeNodeView l, r;
+  SIZE_T lhs_block, rhs_block;
+
+  // The child and its left sibling, or its right one if it has none,
+  // with key sep of p between them
+  SIZE_T sep = slot>0 ? slot-1 : slot;
+
+  rc = p.GetPtr(sep, lhs_block);
+  if (rc) { return rc; }
+  rc = p.GetPtr(sep+1, rhs_block);
+  if (rc) { return rc; }
+  rc = l.Pin(buffercache, lhs_block);
+  if (rc) { return rc; }
+  rc = r.Pin(buffercache, rhs_block);
+  if (rc) { return rc; }
+
+  bool leaf = (l.info->nodetype == BTREE_LEAF_NODE);
+  SIZE_T lhs_numkeys = l.info->numkeys;
+  SIZE_T rhs_numkeys = r.info->numkeys;
+  SIZE_T keysize = l.info->keysize;
+  SIZE_T pairsize = l.GetPairSize();
+  // an interior merge also takes in the separator
+  SIZE_T total = lhs_numkeys + rhs_numkeys + (leaf ? 0 : 1);
+
+  // A root must have two children, so its two leaves are not merged
+  // until both are empty, when the tree is.
+  bool rootleaves = leaf && p.info->nodetype == BTREE_ROOT_NODE && p.info->numkeys == 1;
+
+  if (rootleaves) {
+    if (total == 0) {
+      rc = l.Unpin();
+      if (rc) { return rc; }
+      rc = r.Unpin();
+      if (rc) { return rc; }
+      rc = DeallocateNode(lhs_block);
+      if (rc) { return rc; }
+      rc = DeallocateNode(rhs_block);
+      if (rc) { return rc; }
+      p.SetNumKeys(0);
+      return p.SetPtr(0, 0);
+    }
+  }
+
+  // The pairs of both, in order, with (separator, first pointer of
+  // rhs) between them for interior nodes
+  vector<BYTE_T> all(total*pairsize+1);
+  l.GetPairs(0, lhs_numkeys, &all[0]);
+  if (!leaf) {
+    SIZE_T ptr;
+    KEY_T key;
+    rc = p.GetKey(sep, key);
+    if (rc) { return rc; }
+    memcpy(&all[lhs_numkeys*pairsize], key.data, keysize);
+    rc = r.GetPtr(0, ptr);
+    if (rc) { return rc; }
+    memcpy(&all[lhs_numkeys*pairsize+keysize], &ptr, sizeof(SIZE_T));
+  }
+  r.GetPairs(0, rhs_numkeys, &all[(total-rhs_numkeys)*pairsize]);
+
+  if (!rootleaves && FitsKeys(l.info, &all[0], total, pairsize)) {
+    // Merge: everything in rhs moves onto the end of lhs
+    rc = l.SetPairs(&all[0], total);
+    if (rc) { return rc; }
+    if (leaf) {
+      // and lhs takes over its place in the leaf chain
+      SIZE_T next_leaf;
+      rc = r.GetPtr(0, next_leaf);
+      if (rc) { return rc; }
+      rc = l.SetPtr(0, next_leaf);
+      if (rc) { return rc; }
+    }
+    rc = p.DeleteKeyPtr(sep);
+    if (rc) { return rc; }
+    rc = r.Unpin();
+    if (rc) { return rc; }
+    return DeallocateNode(rhs_block);
+  }
+
+  // Redistribute, so that the two hold about the same number.  Between
+  // interior nodes pair new_lhs_numkeys goes up, its pointer becoming
+  // the first of rhs.  With prefixes the halves, or the parent with its
+  // new separator, may not fit, and then the two are left as they are.
+  SIZE_T new_lhs_numkeys = leaf ? total/2 : (total-1)/2;
+  SIZE_T rhs_start = leaf ? new_lhs_numkeys : new_lhs_numkeys+1;
+  const BYTE_T *up = &all[new_lhs_numkeys*pairsize];
+  KEY_T key(keysize);
+
+  if (leaf) {
+    Separator(p.info, new_lhs_numkeys>0 ? up-pairsize : 0, up, key.data);
+  } else {
+    memcpy(key.data, up, keysize);
+  }
+
+  if (new_lhs_numkeys == lhs_numkeys ||
+      !FitsKeys(l.info, &all[0], new_lhs_numkeys, pairsize) ||
+      !FitsKeys(r.info, &all[rhs_start*pairsize], total-rhs_start, pairsize) ||
+      !FitsKey(p, sep, key.data)) {
+    return ERROR_NOERROR;
+  }
 
-  // Allocate a node and write the block number allocated for it
-  // into ptr_to_rhs. Now when we serialize rhs to this block,
-  // maybe_rhs_ptr will be the ptr to it. Thus, maybe_rhs_ptr is the
-  // ptr associated with the promoted key.
-  rc = AllocateNode(ptr_to_rhs);
-  if (rc) {  return rc; }
+  rc = p.SetKey(sep, key);
+  if (rc) { return rc; }
+  rc = l.SetPairs(&all[0], new_lhs_numkeys);
+  if (rc) { return rc; }
+  if (!leaf) {
+    SIZE_T ptr;
+    memcpy(&ptr, up+keysize, sizeof(SIZE_T));
+    rc = r.SetPtr(0, ptr);
+    if (rc) { return rc; }
+  }
+  return r.SetPairs(&all[rhs_start*pairsize], total-rhs_start);
+}
 
-  // Copy b's rhs data into rhs's data starting from rhs's beginning
-  // b_offset is initialized to the point in b where rhs data begins
-  // rhs_offset is the point in rhs where we insert each kvp (from b)
-  SIZE_T b_offset, rhs_offset;
-  for (rhs_offset=0, b_offset=lhs_numkeys;
-       rhs_offset<rhs.info.numkeys;
-       rhs_offset++, b_offset++) {
-    
-    KeyValuePair copied_kvp;
-    rc = b.GetKeyVal(b_offset,copied_kvp);
-    if (rc) {  return rc;  }
-    rc = rhs.SetKeyVal(rhs_offset,copied_kvp);
-    if (rc) {  return rc;  }
+  
+ERROR_T BTreeIndex::Scan(const KEY_T &lo,
+			 const KEY_T &hi,
+			 BTreeScanCallback callback,
+			 void *arg)
+{
+  BTreeTreeLatch treelatch(latches,true);
+  if (CheckKey(lo) || CheckKey(hi)) { 
+    return ERROR_SIZE;
+  }
+
+  BTreeCursor cursor(this);
+  KEY_T key, wholehi;
+  VALUE_T value;
+  const KEY_T &last = WholeKey(hi,wholehi);
+  ERROR_T rc;
+
+  for (rc=cursor.Seek(lo); rc==ERROR_NOERROR; rc=cursor.Next()) { 
+    if (cursor.CompareKey(last)>0) { 
+      break;
+    }
+    rc=cursor.GetKey(key);
+    if (rc) { return rc; }
+    rc=cursor.GetValue(value);
+    if (rc) { return rc; }
+    if (!callback(key,value,arg)) { 
+      break;
+    }
   }
+  return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
 
-  // Copy the first pointer (does nothing right now)
-  SIZE_T copied_ptr;
-  rc = b.GetPtr(0,copied_ptr);
-  if (rc) {  return rc;  }
-  rc = rhs.SetPtr(0,copied_ptr);
-  if (rc) {  return rc;  }
 
-  // Finalize rhs by writing to the buffercache.
-  // No need to serialize b (our new lhs) here since our caller will.
-  rc = rhs.Serialize(buffercache,ptr_to_rhs);
-  if (rc) {  return rc; }
+BTreeCursor::BTreeCursor(BTreeIndex *i) : index(i), slot(0), valid(false)
+{
+}
 
-  // Per piazza @487, this is enough to turn original node into lhs.
-  // Data clearing/overwriting unneeded but maybe useful for debugging
-  b.info.numkeys = lhs_numkeys;
-}
-
-// Explain params here
-// rhs_created:
-// Indicate to our caller that we split and created a rhs.
-// Put another way, this signals to our caller that maybe_rhs_key
-// and maybe_rhs_ptr are meaningful and in fact rhs's key and ptr.
-// This ensures they'll be inserted into our parent node.
-ERROR_T BTreeIndex::InsertAtNode(const SIZE_T &node,
-                                 const KEY_T &key,
-                                 const VALUE_T &value,
-                                 KEY_T &maybe_rhs_key,
-                                 SIZE_T &maybe_rhs_ptr,
-                                 bool &rhs_created)
-{
-    BTreeNode b;
-    ERROR_T rc;
-    SIZE_T offset;
-    KEY_T testkey;
-    SIZE_T ptr;
 
-    rc = b.Unserialize(buffercache,node);
+ERROR_T BTreeCursor::Seek(const KEY_T &key)
+{
+  BTreePath path;
+  bool found;
+  ERROR_T rc;
+
+  KEY_T whole;
+
+  valid=false;
+
+  if (index->CheckKey(key)) { 
+    return ERROR_SIZE;
+  }
+
+  rc=index->Descend(index->WholeKey(key,whole),path,leaf,found);
+  if (rc) { return rc; }
+
+  if (leaf.info->nodetype!=BTREE_LEAF_NODE) { 
+    // empty tree
+    leaf.Unpin();
+    return ERROR_NONEXISTENT;
+  }
+
+  slot=path.back().slot;
+  valid=true;
+  return SkipEmptyLeaves();
+}
+
+
+// If the cursor is past the end of its leaf, move it to the start of
+// the next leaf with any keys
+ERROR_T BTreeCursor::SkipEmptyLeaves()
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  while (slot>=leaf.info->numkeys) { 
+    rc=leaf.GetPtr(0,next);
     if (rc) { return rc; }
+    if (next==0) { 
+      valid=false;
+      leaf.Unpin();
+      return ERROR_NONEXISTENT;
+    }
+    rc=leaf.Pin(index->buffercache,next);
+    if (rc) { valid=false; return rc; }
+    slot=0;
+  }
+  return ERROR_NOERROR;
+}
 
-    switch (b.info.nodetype) {
-    case BTREE_ROOT_NODE:
-      if (b.info.numkeys == 0) {
-
-        // Create new lhs leaf node and insert first key value pair into it.
-        BTreeNode lhs = BTreeNode(BTREE_LEAF_NODE,
-                                  b.info.keysize,
-                                  b.info.valuesize,
-                                  b.info.blocksize);
-
-        SIZE_T lhs_empty_ptr, rhs_empty_ptr;
-        rc = lhs.SetPtr(0,lhs_empty_ptr);
-        if (rc) {  return rc;  }
-
-        KeyValuePair kvp = KeyValuePair(key,value);
-        rc = lhs.InsertKeyVal(0,kvp);
-        if (rc) {  return rc;  }
-
-        // Create new rhs leaf node and leave it empty.
-        BTreeNode rhs = BTreeNode(BTREE_LEAF_NODE,
-                                  b.info.keysize,
-                                  b.info.valuesize,
-                                  b.info.blocksize);
-
-        rc = rhs.SetPtr(0,rhs_empty_ptr);
-        if (rc) {  return rc;  }
-
-        // Allocate space and assign ptrs for new lhs and rhs leaf nodes.
-        SIZE_T lhs_ptr, rhs_ptr;
-        rc = AllocateNode(lhs_ptr);
-        if (rc) {  return rc;  }
-        rc = AllocateNode(rhs_ptr);
-        if (rc) {  return rc;  }
-
-        // Insert key into root.
-        b.info.numkeys++; // can't insert ptrs without this line either
-        rc = b.SetKey(0, key);
-        if (rc) {  return rc;  }
-
-        // Insert ptr to lhs into root.
-        rc = b.SetPtr(0,lhs_ptr);
-        if (rc) {  return rc;  }
-
-        // Insert ptr to rhs into root.
-        rc = b.SetPtr(1, rhs_ptr);
-        if (rc) {  return rc;  }
-
-        // Write the updated root node and 2 created leaf nodes.
-        rc = b.Serialize(buffercache,node);
-        if (rc) {  return rc; }
-        rc = lhs.Serialize(buffercache,lhs_ptr);
-        if (rc) {  return rc; }
-        rc = rhs.Serialize(buffercache,rhs_ptr);
-        return rc;
-      }
-    case BTREE_INTERIOR_NODE:
-      for (offset=0;offset<b.info.numkeys;offset++) {
-        rc=b.GetKey(offset,testkey);
-        if (rc) {  return rc; }
-        if (testkey==key) {  return ERROR_CONFLICT;  }
-        else if (key<testkey) {
-          rc=b.GetPtr(offset,ptr);
-          if (rc) { return rc; }
-          rc = InsertAtNode(ptr,key,value,maybe_rhs_key,maybe_rhs_ptr,rhs_created);
-          if (rc) { return rc; }
-          if (rhs_created) { //TODO factor into function since repeated after for loop
-            rhs_created = false;
-            KeyPointerPair kpp = KeyPointerPair(maybe_rhs_key, maybe_rhs_ptr);
-            rc = b.InsertKeyPtr(offset,kpp);
-            if (rc) {  return rc; }
-
-            int maxkeys = b.info.GetNumSlotsAsInterior() * 2/3;
-            bool TooFull = (b.info.numkeys >= maxkeys);
-            if (TooFull) {
-              rhs_created = true;
-              rc = SplitNode(b,maybe_rhs_key,maybe_rhs_ptr);
-              if (rc) {  return rc; }
-            }
-            rc = b.Serialize(buffercache,node);
-          }
-          return rc;
-        }
-      }
-      // if we got here, we need to go to the next pointer, if it exists
-      if (b.info.numkeys>0) { 
-        rc=b.GetPtr(b.info.numkeys,ptr);
-        if (rc) { return rc; }
-        rc = InsertAtNode(ptr,key,value,maybe_rhs_key,maybe_rhs_ptr,rhs_created);
-        if (rhs_created) {
-          rhs_created = false;
-          KeyPointerPair kpp = KeyPointerPair(maybe_rhs_key, maybe_rhs_ptr);
-          rc = b.InsertKeyPtr(offset,kpp);
-          if (rc) {  return rc; }
-
-          int maxkeys = b.info.GetNumSlotsAsInterior() * 2/3;
-          bool TooFull = (b.info.numkeys >= maxkeys);
-          if (TooFull) {
-            rhs_created = true;
-            rc = SplitNode(b,maybe_rhs_key,maybe_rhs_ptr);
-            if (rc) {  return rc; }
-          }
-          rc = b.Serialize(buffercache,node);
-        }
-        return rc;
-      } else {
-        // There are no keys at all on this node, so nowhere to go
-        return ERROR_NONEXISTENT;
-      }
-      break;
-    case BTREE_LEAF_NODE:
-      for (offset=0;offset<b.info.numkeys;offset++) {
-        rc=b.GetKey(offset,testkey);
-        if (rc) {  return rc;  }
-        if (testkey==key) {  return ERROR_CONFLICT;  }
-        else if (key<testkey) {
-          KeyValuePair kvp = KeyValuePair(key, value);
-          rc = b.InsertKeyVal(offset,kvp);
-          if (rc) {  return rc; }
-
-          int maxkeys = b.info.GetNumSlotsAsLeaf() * 2/3;
-          bool TooFull = (b.info.numkeys >= maxkeys);
-          if (TooFull) {
-            rhs_created = true;
-            rc = SplitLeaf(b,maybe_rhs_key,maybe_rhs_ptr);
-            if (rc) {  return rc; }
-          }
-       	  return b.Serialize(buffercache,node);
-        }
-      }
-      if (b.info.numkeys>0) {
-        KeyValuePair kvp = KeyValuePair(key, value);
-        rc = b.InsertKeyVal(b.info.numkeys,kvp);
-        if (rc) {  return rc; }
-
-        int maxkeys = b.info.GetNumSlotsAsLeaf() * 2/3;
-        bool TooFull = (b.info.numkeys >= maxkeys);
-        if (TooFull) {
-          rhs_created = true;
-          rc = SplitLeaf(b,maybe_rhs_key,maybe_rhs_ptr);
-          if (rc) {  return rc; }
-        }
-       	return b.Serialize(buffercache,node);
+
+ERROR_T BTreeCursor::Next()
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  slot++;
+  return SkipEmptyLeaves();
+}
+
+
+//
+// Leaves are only linked forward, so to step back across a leaf
+// boundary the cursor descends to its leaf again, climbs the path to
+// the nearest node with a child to the left, and goes down that
+// child's rightmost edge.
+//
+ERROR_T BTreeCursor::Prev()
+{
+  BTreePath path;
+  KEY_T key;
+  bool found;
+  SIZE_T level, node;
+  ERROR_T rc;
+
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (slot>0) { 
+    slot--;
+    return ERROR_NOERROR;
+  }
+
+  valid=false;
+
+  rc=leaf.GetKey(0,key);
+  if (rc) { return rc; }
+  rc=index->Descend(key,path,leaf,found);
+  if (rc) { return rc; }
+
+  for (;;) { 
+    for (level=path.size()-1; level>0 && path[level-1].slot==0; level--) { 
+    }
+    if (level==0) { 
+      leaf.Unpin();
+      return ERROR_NONEXISTENT;
+    }
+    path.resize(level);
+    path.back().slot--;
+
+    rc=leaf.Pin(index->buffercache,path.back().block);
+    if (rc) { return rc; }
+    rc=leaf.GetPtr(path.back().slot,node);
+    if (rc) { return rc; }
+
+    for (;;) { 
+      rc=leaf.Pin(index->buffercache,node);
+      if (rc) { return rc; }
+      path.push_back(BTreePathEntry(node,leaf.info->numkeys));
+      if (leaf.info->nodetype==BTREE_LEAF_NODE) { 
+	break;
       }
-      break;
-    default:
-      return ERROR_INSANE;
-      break;
+      rc=leaf.GetPtr(leaf.info->numkeys,node);
+      if (rc) { return rc; }
     }
 
-  return ERROR_INSANE;
+    if (leaf.info->numkeys>0) { 
+      slot=leaf.info->numkeys-1;
+      valid=true;
+      return ERROR_NOERROR;
+    }
+  }
 }
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+
+ERROR_T BTreeCursor::GetKey(KEY_T &key) const
 {
-  VALUE_T val = value;
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, val);
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  ERROR_T rc=leaf.GetKey(slot,key);
+  if (rc) { return rc; }
+  TrimKey(leaf.info,key);
+  return ERROR_NOERROR;
 }
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+
+ERROR_T BTreeCursor::GetValue(VALUE_T &value) const
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (!index->superinfo.overflowsize) { 
+    return leaf.GetVal(slot,value);
+  }
+  VALUE_T stored;
+  ERROR_T rc=leaf.GetVal(slot,stored);
+  if (rc) { return rc; }
+  return index->LoadValue(stored,value);
+}
+
+
+int BTreeCursor::CompareKey(const KEY_T &key) const
 {
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  KEY_T whole;
+  return leaf.CompareKey(slot,index->WholeKey(key,whole));
 }
 
   
@@ -734,55 +2831,77 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 				    ostream &o,
 				    BTreeDisplayType display_type) const
 {
-  KEY_T testkey;
+  // The stack holds the interior nodes on the way down to the current
+  // one, each with the next of its children to visit
+  BTreePath stack;
+  SIZE_T next=node;
+  bool visit=true;
   SIZE_T ptr;
-  BTreeNode b;
+  BTreeNodeView b;
   ERROR_T rc;
-  SIZE_T offset;
 
-  rc= b.Unserialize(buffercache,node);
+  for (;;) { 
+    if (visit) { 
+      rc= b.Pin(buffercache,next);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
 
-  rc = PrintNode(o,node,b,display_type);
+      rc = PrintNode(o,next,b,display_type,superinfo.overflowsize ? buffercache : 0,keyschema);
   
-  if (rc) { return rc; }
+      if (rc) { return rc; }
 
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << ";";
-  }
+      if (display_type==BTREE_DEPTH_DOT) { 
+	o << ";";
+      }
 
-  if (display_type!=BTREE_SORTED_KEYVAL) {
-    o << endl;
-  }
+      if (display_type!=BTREE_SORTED_KEYVAL) {
+	o << endl;
+      }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (b.info.numkeys>0) { 
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
+      switch (b.info->nodetype) { 
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (b.info->numkeys>0) { 
+	  stack.push_back(BTreePathEntry(next,0));
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	break;
+      default:
 	if (display_type==BTREE_DEPTH_DOT) { 
-	  o << node << " -> "<<ptr<<";\n";
+	} else {
+	  o << "Unsupported Node Type " << b.info->nodetype ;
 	}
-	rc=DisplayInternal(ptr,o,display_type);
-	if (rc) { return rc; }
+	return ERROR_INSANE;
       }
+      visit=false;
     }
-    return ERROR_NOERROR;
-    break;
-  case BTREE_LEAF_NODE:
-    return ERROR_NOERROR;
-    break;
-  default:
+
+    if (stack.empty()) { 
+      return ERROR_NOERROR;
+    }
+
+    BTreePathEntry &top=stack.back();
+
+    rc=b.Pin(buffercache,top.block);
+    if (rc) { return rc; }
+
+    if (top.slot>b.info->numkeys) { 
+      // all children done
+      stack.pop_back();
+      continue;
+    }
+
+    rc=b.GetPtr(top.slot,ptr);
+    if (rc) { return rc; }
     if (display_type==BTREE_DEPTH_DOT) { 
-    } else {
-      o << "Unsupported Node Type " << b.info.nodetype ;
+      o << top.block << " -> "<<ptr<<";\n";
     }
-    return ERROR_INSANE;
+    top.slot++;
+    next=ptr;
+    visit=true;
   }
 
   return ERROR_NOERROR;
@@ -791,6 +2910,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
+  BTreeTreeLatch treelatch(latches,true);
   ERROR_T rc;
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
@@ -799,14 +2919,284 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "}\n";
   }
+  return rc;
+}
+
+
+// The overflow chains of a leaf's values must be whole, and count
+// toward the blocks in use
+ERROR_T BTreeIndex::CheckOverflow(const BTreeNodeView &leaf, SIZE_T &numblocks) const
+{
+  BTreeNodeView b;
+  VALUE_T stored;
+  SIZE_T block, length, done;
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<leaf.info->numkeys;i++) { 
+    rc=leaf.GetVal(i,stored);
+    if (rc) { return rc; }
+    if (stored.length==0 || stored.data[0]==BTREE_VALUE_INLINE) { 
+      continue;
+    }
+    GetRef(stored,block,length);
+    for (done=0; block!=0; done+=b.info->numkeys) { 
+      if (++numblocks>superinfo.highwater) { 
+	cerr << "BTreeIndex::SanityCheck: overflow chain of leaf "<<leaf.block<<" has a cycle"<<endl;
+	return ERROR_INSANE;
+      }
+      if (allocator.IsFree(block)) { 
+	cerr << "BTreeIndex::SanityCheck: block "<<block<<" in an overflow chain of leaf "<<leaf.block<<" is free"<<endl;
+	return ERROR_INSANE;
+      }
+      rc=b.Pin(buffercache,block);
+      if (rc) { return rc; }
+      if (b.info->nodetype!=BTREE_OVERFLOW_BLOCK || b.info->numkeys==0) { 
+	cerr << "BTreeIndex::SanityCheck: block "<<block<<" in an overflow chain of leaf "<<leaf.block<<" is not an overflow block"<<endl;
+	return ERROR_INSANE;
+      }
+      memcpy(&block,b.data,sizeof(SIZE_T));
+    }
+    if (done!=length) { 
+      cerr << "BTreeIndex::SanityCheck: overflow chain of leaf "<<leaf.block<<" holds "<<done<<" bytes, not "<<length<<endl;
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Depth first from the root, following each leaf's overflow chains
+//
+ERROR_T BTreeIndex::FindBlocks(vector<bool> &used) const
+{
+  vector<SIZE_T> stack(1,superblock.info.rootnode);
+  BTreeNodeView b;
+  VALUE_T stored;
+  SIZE_T block, length, ptr;
+  ERROR_T rc;
+
+  while (!stack.empty()) { 
+    block=stack.back();
+    stack.pop_back();
+    if (block>=used.size() || used[block]) { 
+      return ERROR_INSANE;
+    }
+    used[block]=true;
+    rc=b.Pin(buffercache,block);
+    if (rc) { return rc; }
+    if (b.info->nodetype!=BTREE_LEAF_NODE) { 
+      for (SIZE_T i=0;b.info->numkeys>0 && i<=b.info->numkeys;i++) { 
+	rc=b.GetPtr(i,ptr);
+	if (rc) { return rc; }
+	stack.push_back(ptr);
+      }
+      continue;
+    }
+    if (!superinfo.overflowsize) { 
+      continue;
+    }
+    for (SIZE_T i=0;i<b.info->numkeys;i++) { 
+      rc=b.GetVal(i,stored);
+      if (rc) { return rc; }
+      if (stored.length==0 || stored.data[0]==BTREE_VALUE_INLINE) { 
+	continue;
+      }
+      GetRef(stored,block,length);
+      while (block!=0) { 
+	if (block>=used.size() || used[block]) { 
+	  return ERROR_INSANE;
+	}
+	used[block]=true;
+	BTreeNodeView chain;
+	rc=chain.Pin(buffercache,block);
+	if (rc) { return rc; }
+	memcpy(&block,chain.data,sizeof(SIZE_T));
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RebuildBitMap()
+{
+  vector<bool> used(buffercache->GetNumBlocks(),false);
+  ERROR_T rc;
+
+  used[superblock_index]=true;
+  rc=FindBlocks(used);
+  if (rc) { return rc; }
+  for (SIZE_T i=0;i<used.size();i++) { 
+    if (used[i] && !buffercache->IsBlockAllocated(i)) { 
+      buffercache->NotifyAllocateBlock(i);
+    } else if (!used[i] && buffercache->IsBlockAllocated(i)) { 
+      buffercache->NotifyDeallocateBlock(i);
+    }
+    // the redone operations may have gone past the superblock's last
+    // write
+    if (used[i] && i>=superinfo.highwater) { 
+      superinfo.highwater=i+1;
+      superblockdirty=true;
+    }
+  }
   return ERROR_NOERROR;
 }
 
 
+//
+// Walks the whole tree, depth first, checking that every node is of
+// the right type and size, that keys are in order within each node
+// and between each node's separators in its parent, that all leaves
+// are at the same depth, and that no node is overfull.  (A leftmost
+// leaf can be left nearly empty by inserts alone, so nodes are not
+// held to a minimum.)  Every block below the high water mark must be
+// the superblock, in the tree or free, as the disk's bitmap says.
+//
 ERROR_T BTreeIndex::SanityCheck() const
 {
-  // WRITE ME
-  return ERROR_UNIMPL;
+  BTreeTreeLatch treelatch(latches,true);
+  BTreePath stack;
+  SIZE_T next=superblock.info.rootnode;
+  bool visit=true;
+  SIZE_T leafdepth=0;
+  SIZE_T numnodes=0;
+  SIZE_T ptr, i;
+  BTreeNodeView b, parent;
+  KEY_T key, lastkey;
+  ERROR_T rc;
+
+  for (;;) { 
+    if (visit) { 
+      SIZE_T depth=stack.size();
+      bool isleaf;
+
+      if (++numnodes>superinfo.highwater) { 
+	cerr << "BTreeIndex::SanityCheck: more nodes than blocks, tree has a cycle"<<endl;
+	return ERROR_INSANE;
+      }
+
+      if (allocator.IsFree(next)) { 
+	cerr << "BTreeIndex::SanityCheck: node "<<next<<" is in a free block"<<endl;
+	return ERROR_INSANE;
+      }
+
+      rc=b.Pin(buffercache,next);
+      if (rc) { return rc; }
+
+      isleaf = b.info->nodetype==BTREE_LEAF_NODE;
+
+      if (b.info->nodetype!=(depth==0 ? BTREE_ROOT_NODE : BTREE_INTERIOR_NODE) && !(depth>0 && isleaf)) { 
+	cerr << "BTreeIndex::SanityCheck: node "<<next<<" has type "<<b.info->nodetype<<" at depth "<<depth<<endl;
+	return ERROR_INSANE;
+      }
+      if (b.info->keysize!=superblock.info.keysize || 
+	  b.info->valuesize!=superblock.info.valuesize) { 
+	cerr << "BTreeIndex::SanityCheck: node "<<next<<" has the wrong key or value size"<<endl;
+	return ERROR_INSANE;
+      }
+      if (Full(b) && b.info->numkeys>1) { 
+	cerr << "BTreeIndex::SanityCheck: node "<<next<<" has "<<b.info->numkeys<<" keys"<<endl;
+	return ERROR_INSANE;
+      }
+      if (!isleaf && depth>0 && b.info->numkeys==0) { 
+	cerr << "BTreeIndex::SanityCheck: interior node "<<next<<" has no keys"<<endl;
+	return ERROR_INSANE;
+      }
+      if (b.info->format!=superblock.info.format ||
+	  (b.info->IsSlotted() ? 
+	   b.info->heapstart>b.info->GetNumDataBytes() :
+	   (b.info->format==BTREE_FORMAT_PLAIN && b.info->prefixlen!=0) ||
+	   b.info->prefixlen>b.info->keysize)) { 
+	cerr << "BTreeIndex::SanityCheck: node "<<next<<" has the wrong format"<<endl;
+	return ERROR_INSANE;
+      }
+      for (i=0;b.info->IsSlotted() && i<b.info->numkeys;i++) { 
+	if ((SIZE_T)(b.ResolveKey(i)-b.data)<b.info->heapstart) { 
+	  cerr << "BTreeIndex::SanityCheck: node "<<next<<" has a record below its heap"<<endl;
+	  return ERROR_INSANE;
+	}
+      }
+      for (i=1;i<b.info->numkeys;i++) { 
+	rc=b.GetKey(i,key);
+	if (rc) { return rc; }
+	if (b.CompareKey(i-1,key)>=0) { 
+	  cerr << "BTreeIndex::SanityCheck: keys of node "<<next<<" out of order at "<<i<<endl;
+	  return ERROR_INSANE;
+	}
+      }
+      if (depth>0 && b.info->numkeys>0) { 
+	// the keys must lie within [separator before, separator after)
+	SIZE_T slot=stack.back().slot-1;
+	rc=parent.Pin(buffercache,stack.back().block);
+	if (rc) { return rc; }
+	rc=b.GetKey(0,key);
+	if (rc) { return rc; }
+	rc=b.GetKey(b.info->numkeys-1,lastkey);
+	if (rc) { return rc; }
+	if ((slot>0 && parent.CompareKey(slot-1,key)>0) ||
+	    (slot<parent.info->numkeys && parent.CompareKey(slot,lastkey)<=0)) { 
+	  cerr << "BTreeIndex::SanityCheck: keys of node "<<next<<" outside its parent's separators"<<endl;
+	  return ERROR_INSANE;
+	}
+	parent.Unpin();
+      }
+
+      if (isleaf && superinfo.overflowsize) { 
+	rc=CheckOverflow(b,numnodes);
+	if (rc) { return rc; }
+      }
+
+      if (isleaf) { 
+	if (leafdepth==0) { 
+	  leafdepth=depth;
+	} else if (depth!=leafdepth) { 
+	  cerr << "BTreeIndex::SanityCheck: leaf "<<next<<" at depth "<<depth<<", not "<<leafdepth<<endl;
+	  return ERROR_INSANE;
+	}
+      } else if (b.info->numkeys>0) { 
+	stack.push_back(BTreePathEntry(next,0));
+      }
+      visit=false;
+    }
+
+    if (stack.empty()) { 
+      break;
+    }
+
+    BTreePathEntry &top=stack.back();
+
+    rc=b.Pin(buffercache,top.block);
+    if (rc) { return rc; }
+
+    if (top.slot>b.info->numkeys) { 
+      stack.pop_back();
+      continue;
+    }
+
+    rc=b.GetPtr(top.slot,ptr);
+    if (rc) { return rc; }
+    top.slot++;
+    next=ptr;
+    visit=true;
+  }
+
+  // every block is the superblock, in the tree, or free, and the
+  // bitmap agrees
+  for (next=0; next<superinfo.highwater; next++) { 
+    if (allocator.IsFree(next)==buffercache->IsBlockAllocated(next)) { 
+      cerr << "BTreeIndex::SanityCheck: block "<<next<<" is "<<(allocator.IsFree(next) ? "free" : "in use")
+	   << " but the bitmap has it "<<(allocator.IsFree(next) ? "allocated" : "free")<<endl;
+      return ERROR_INSANE;
+    }
+  }
+  numnodes+=allocator.GetNumFree();
+  if (numnodes+1!=superinfo.highwater) { 
+    cerr << "BTreeIndex::SanityCheck: "<<superinfo.highwater-1-numnodes<<" blocks are lost"<<endl;
+    return ERROR_INSANE;
+  }
+
+  return ERROR_NOERROR;
 }
   
 
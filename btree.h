@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +11,10 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "btree_alloc.h"
+#include "btree_latch.h"
+#include "btree_fixed.h"
+#include "btree_keys.h"
 
 using namespace std;
 
@@ -51,24 +56,205 @@ struct KeyPointerPair {
 };
 // end new struct
 
+// One level of a root to leaf descent: the node, and the slot taken
+// in it (the child followed in an interior node, or where the key is
+// or would go in a leaf)
+struct BTreePathEntry {
+  SIZE_T block;
+  SIZE_T slot;
+
+  BTreePathEntry(const SIZE_T b=0, const SIZE_T s=0) : block(b), slot(s) {}
+};
+
+typedef vector<BTreePathEntry> BTreePath;
+
+// Called by Scan on each key and value in order; returning false ends
+// the scan early
+typedef bool (*BTreeScanCallback)(const KEY_T &key, const VALUE_T &value, void *arg);
+
+// Pairs for BulkLoad, in strictly increasing key order
+class BTreeBulkSource {
+ public:
+  virtual ~BTreeBulkSource() {}
+  // return zero and the next pair, or ERROR_NONEXISTENT after the last
+  virtual ERROR_T Next(KEY_T &key, VALUE_T &value) = 0;
+};
+
+// How nodes split.  maxfill is the percent of its room (slots, or
+// bytes in a slotted node) that a node fills before it splits, from
+// 50 to 100, and splitpoint the percent of the keys that the left
+// node keeps when one splits in two, from 1 to 99; 0 is the default
+// for either, two thirds and half.  With append, a leaf that splits
+// because of an insert after the last key of the tree keeps as many
+// keys as it can, and so do the nodes above it that split in turn,
+// so that ascending keys leave full nodes behind them instead of
+// half full ones.
+struct BTreeSplitPolicy {
+  SIZE_T maxfill;
+  SIZE_T splitpoint;
+  bool   append;
+
+  BTreeSplitPolicy() : maxfill(0), splitpoint(0), append(false) {}
+};
+
 enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
 class BTreeIndex {
+  friend class BTreeCursor;
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  // What only the superblock keeps; it goes into the superblock's data
+  // whenever that is written out
+  SuperblockMetadata superinfo;
+  // Lookup specialized for the index's key and value sizes, if any
+  FixedLookupFn fixedlookup;
+  // The layout of typed keys, if the index was created with one
+  BTreeKeySchema keyschema;
+  // The free blocks below the high water mark
+  BTreeAllocator allocator;
+  // The superblock above is the index's own; the copy on disk is
+  // rewritten only when it has to be (WriteSuperblock)
+  bool         superblockdirty;
+  SIZE_T       superblockwrites;
+  // Latches, when several threads share the index (SetConcurrent)
+  mutable BTreeLatches latches;
 
  protected:
 
-  ERROR_T      AllocateNode(SIZE_T &node);
+  // Keys and values must be exactly keysize and valuesize bytes, or,
+  // in the slotted format, at most that long
+  ERROR_T      CheckKey(const KEY_T &key) const;
+  ERROR_T      CheckValue(const VALUE_T &value) const;
+
+  // key filled out with zeros to keysize, as the nodes compare it; key
+  // itself if it is already that long, else whole
+  const KEY_T &WholeKey(const KEY_T &key, KEY_T &whole) const;
+
+  // With overflow blocks (superinfo.overflowsize), what a leaf
+  // keeps of a value: StoreValue writes out a value too long for the
+  // leaf, LoadValue reads it back and FreeValue releases its blocks
+  ERROR_T      StoreValue(const VALUE_T &value, VALUE_T &stored);
+  ERROR_T      LoadValue(const VALUE_T &stored, VALUE_T &value) const;
+  ERROR_T      FreeValue(const VALUE_T &stored);
+  // FreeValue, unless a failed insert left stored in the tree at key
+  ERROR_T      FreeUnlessHeld(const KEY_T &key, const VALUE_T &stored, const bool latched);
+  ERROR_T      FreeChain(SIZE_T block);
+  ERROR_T      CheckOverflow(const BTreeNodeView &leaf, SIZE_T &numblocks) const;
+
+  // A new node, as near hint (the block of its parent or sibling) as
+  // there is a free block
+  ERROR_T      AllocateNode(SIZE_T &node, const SIZE_T hint);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op, 
+  // Mark the blocks of the tree, its overflow chains included, in used
+  ERROR_T      FindBlocks(vector<bool> &used) const;
+
+  // Make the disk's bitmap agree with the tree, after the write-ahead
+  // log has been redone over a bitmap from the last checkpoint, and
+  // raise the high water mark past every block the tree reaches
+  ERROR_T      RebuildBitMap();
+
+  // Write the superblock to its block, as part of the current
+  // operation.  Needed when the root changes, since with a log the
+  // operation must commit with it, before a checkpoint (Commit), and
+  // at Detach, so that the high water mark on disk is past every block
+  // the bitmap on disk has allocated.
+  ERROR_T      WriteSuperblock();
+
+  // Commit the current operation, and checkpoint if the log is due
+  ERROR_T      Commit();
+
+  // Insert without committing; Insert commits the whole operation
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value);
+
+  // Put key and value at slot of leaf b, or, if the leaf would have
+  // to split, leave it as it is and return ERROR_NOSPACE
+  ERROR_T      InsertIntoLeaf(BTreeNodeView &b,
+			      const SIZE_T slot,
+			      const KEY_T &key,
+			      const VALUE_T &value);
+
+  // Whether a key at slot of leaf b is after the last one of the tree
+  ERROR_T      AppendsAt(const BTreeNodeView &b, const SIZE_T slot, bool &append) const;
+
+  // The blocks an insert of pair into leaf b, at the end of path,
+  // would allocate, splitting nodes up the path and growing the root
+  ERROR_T      PlanInsert(const BTreePath &path,
+			  BTreeNodeView &b,
+			  const BYTE_T *pair,
+			  const bool append,
+			  SIZE_T &needed);
+  // The blocks GrowRoot(up) would allocate, added to needed
+  ERROR_T      PlanGrowRoot(vector<BYTE_T> &up, SIZE_T &needed);
+
+  // Blocks that can still be allocated, free or past the high water mark
+  SIZE_T       SpareBlocks() const;
+
+  // Store value in overflow blocks if it goes there, and insert it,
+  // with LatchedInsert if latched, else InsertInternal.  A value that
+  // is not inserted is freed again.
+  ERROR_T      StoreAndInsert(const KEY_T &key, const VALUE_T &value, const bool latched);
+
+  //
+  // Concurrent lookups and inserts (SetConcurrent), under the shared
+  // tree latch.  
+  //
+  // LatchedDescend walks from the root to the leaf whose keys take in
+  // key, crabbing down with shared latches.  The leaf is left pinned
+  // in b and latched, exclusively if exclusive.  An empty tree gives
+  // ERROR_NONEXISTENT, with nothing latched.
+  //
+  ERROR_T      LatchedDescend(const KEY_T &key,
+			      const bool exclusive,
+			      BTreeNodeView &b);
+  // Unpin and unlatch b
+  ERROR_T      LatchedRelease(BTreeNodeView &b);
+  ERROR_T      LatchedLookup(const KEY_T &key, VALUE_T &value);
+  // ERROR_NONEXISTENT for an empty tree, whose first key needs the
+  // tree to itself, and for a leaf that would have to split
+  ERROR_T      LatchedInsert(const KEY_T &key, const VALUE_T &value);
+
+  // Walk from the root to the leaf where key is or would go, recording
+  // each node and slot in path.  The last node of the path is left
+  // pinned in leaf, and found says whether key is there.  An empty tree
+  // stops at the root, which is then not a leaf.
+  ERROR_T      Descend(const KEY_T &key,
+		       BTreePath &path,
+		       BTreeNodeView &leaf,
+		       bool &found) const;
+
+  ERROR_T      BulkLoadInternal(BTreeBulkSource &source, const double fill);
+
+  // MultiInsert without committing
+  ERROR_T      MultiInsertInternal(const vector<KeyValuePair> &pairs,
+				   vector<ERROR_T> &results);
+
+  // Merge sorted pairs into b, splitting it as many ways as it takes;
+  // append is for pairs past the last key of the tree (see
+  // BTreeSplitPolicy).  With plan, only the separators go in up.
+  ERROR_T      MergePairs(BTreeNodeView &b,
+			  const BYTE_T *pairs,
+			  const SIZE_T numpairs,
+			  vector<BYTE_T> &up,
+			  const bool append=false,
+			  const bool plan=false);
+
+  // Stack new roots on a root that split until one has room
+  ERROR_T      GrowRoot(vector<BYTE_T> &up);
+
+  // Delete without committing; Delete commits the whole operation
+  ERROR_T      DeleteInternal(const KEY_T &key);
+
+  // Bring the underfull child at slot of parent back up to size by
+  // merging it with a sibling or moving keys over from one
+  ERROR_T      RebalanceChild(BTreeNodeView &parent, const SIZE_T slot);
+
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op, 
 				      const KEY_T &key,
 				      VALUE_T &val);
   
@@ -90,8 +276,16 @@ public:
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,   // true if a  key maps to a single value
+	     SIZE_T format=BTREE_FORMAT_PLAIN);  // layout of the nodes
 
+  // To create an index of typed keys, whose keysize is the schema's.
+  // The schema is kept in the superblock.
+  BTreeIndex(const BTreeKeySchema &schema,
+	     SIZE_T valuesize,
+	     BufferCache *cache,
+	     bool unique=true,
+	     SIZE_T format=BTREE_FORMAT_PLAIN);
 
   BTreeIndex();
   BTreeIndex(const BTreeIndex &rhs);
@@ -113,20 +307,47 @@ public:
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // Set how nodes split before creating the index with
+  // Attach(initblock,true); the policy is kept in the superblock.
+  // return ERROR_SIZE if maxfill or splitpoint is out of range
+  ERROR_T SetSplitPolicy(const BTreeSplitPolicy &policy);
+  BTreeSplitPolicy GetSplitPolicy() const;
+
+  // The schema of the index's keys (empty if they are just bytes); 
+  // build keys for it with BTreeKeyEncoder
+  const BTreeKeySchema &GetKeySchema() const { return keyschema; }
+
+  // Number of times the superblock has been written since Attach
+  SIZE_T GetNumSuperblockWrites() const { return superblockwrites; }
+
+  // Let several threads use the index at once.  Lookups and inserts
+  // then run side by side, latching nodes as they go (btree_latch.h);
+  // every other operation, Detach included, has the index to itself
+  // while it runs.  Cursors must not be used while other threads may
+  // change the index.  The buffer cache is made thread safe (or not)
+  // along with it.  Call while no other thread is using the index.
+  // return ERROR_BADCONFIG if the cache has a write-ahead log, since
+  // a commit would take in other threads' unfinished changes
+  ERROR_T SetConcurrent(const bool concurrent);
+  bool    GetConcurrent() const { return latches.Enabled(); }
   
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
-  ERROR_T InsertAtNode(const SIZE_T &node,
-                       const KEY_T &key,
-                       const VALUE_T &value,
-                       KEY_T &maybe_rhs_key,
-                       SIZE_T &maybe_rhs_ptr,
-                       bool &rhs_created);
-  ERROR_T SplitNode(BTreeNode &b,KEY_T &key_to_rhs,SIZE_T &ptr_to_rhs);
-  ERROR_T SplitLeaf(BTreeNode &b,KEY_T &key_to_rhs,SIZE_T &ptr_to_rhs);
+
+  // Build an empty index from the bottom up out of sorted pairs.
+  // Leaves are packed left to right, then each interior level on top,
+  // in consecutive new blocks written a run at a time.  Nodes get
+  // fill (from 0.5 to 1) of the keys they can hold before they split.
+  // return zero on success
+  // return ERROR_CONFLICT if the index is not empty, or the keys are
+  //   not in strictly increasing order
+  // return ERROR_SIZE if a key or value is the wrong size for this index
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T BulkLoad(BTreeBulkSource &source, const double fill=1.0);
 
   
   // return zero on success
@@ -143,6 +364,25 @@ public:
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Batches: the keys are sorted and descend the tree together, so
+  // each node on their way is visited, and each leaf written, once.
+  // results[i] is what Lookup or Insert would have returned for the
+  // ith key, taken in order (a key repeated in an insert batch
+  // conflicts with its first copy).  MultiInsert commits as one
+  // operation.
+  // return zero on success, whatever the results
+  // return ERROR_SIZE if a key or value is the wrong size for this
+  //   index, in which case nothing is done
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results);
+  ERROR_T MultiInsert(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+
+  // Call callback on every key from lo to hi inclusive, in order.
+  // The callback must not change the index.
+  // return zero on success, even if there were no keys in range
+  // return ERROR_SIZE if lo or hi are the wrong size for this index
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanCallback callback, void *arg=0);
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
@@ -167,4 +407,45 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+//
+// A position at a key of an index.  The cursor keeps its leaf pinned
+// and Next follows the links between leaves, so walking a range costs
+// one descent and then one read per leaf.  Any change to the index
+// invalidates its cursors.
+//
+class BTreeCursor {
+ private:
+  BTreeIndex    *index;
+  BTreeNodeView  leaf;
+  SIZE_T         slot;
+  bool           valid;
+
+  ERROR_T SkipEmptyLeaves();
+
+  // not copyable, because of the pin
+  BTreeCursor(const BTreeCursor &rhs);
+  BTreeCursor & operator=(const BTreeCursor &rhs);
+
+ public:
+  BTreeCursor(BTreeIndex *index);
+
+  // Move to the first key >= key
+  // return ERROR_NONEXISTENT if there is none
+  ERROR_T Seek(const KEY_T &key);
+
+  // Move to the following or preceding key
+  // return ERROR_NONEXISTENT, leaving the cursor invalid, at the ends
+  ERROR_T Next();
+  ERROR_T Prev();
+
+  bool    Valid() const { return valid; }
+
+  ERROR_T GetKey(KEY_T &key) const;
+  ERROR_T GetValue(VALUE_T &value) const;
+
+  // memcmp of the current key with key
+  int     CompareKey(const KEY_T &key) const;
+};
+
 #endif
@@ -0,0 +1,123 @@
+#include <assert.h>
+
+#include "btree_alloc.h"
+
+
+BTreeAllocator::BTreeAllocator() : numfree(0)
+{}
+
+
+void BTreeAllocator::Clear()
+{
+  extents.clear();
+  numfree=0;
+}
+
+
+void BTreeAllocator::Build(BufferCache *cache, const SIZE_T first, const SIZE_T end)
+{
+  map<SIZE_T,SIZE_T>::iterator last=extents.end();
+
+  Clear();
+  for (SIZE_T i=first;i<end;i++) {
+    if (cache->IsBlockAllocated(i)) {
+      continue;
+    }
+    if (last!=extents.end() && last->first+last->second==i) {
+      last->second++;
+    } else {
+      last=extents.insert(extents.end(),make_pair(i,(SIZE_T)1));
+    }
+    numfree++;
+  }
+}
+
+
+// Remove block from the extent it is in, splitting the extent if the
+// block is in the middle of it
+void BTreeAllocator::Take(map<SIZE_T,SIZE_T>::iterator it, const SIZE_T block)
+{
+  SIZE_T start=it->first, length=it->second;
+
+  assert(block>=start && block<start+length);
+  if (block==start) {
+    extents.erase(it);
+    if (length>1) {
+      extents.insert(make_pair(start+1,length-1));
+    }
+  } else {
+    it->second=block-start;
+    if (block+1<start+length) {
+      extents.insert(make_pair(block+1,start+length-block-1));
+    }
+  }
+  numfree--;
+}
+
+
+bool BTreeAllocator::Allocate(const SIZE_T hint, SIZE_T &block)
+{
+  if (extents.empty()) {
+    return false;
+  }
+
+  // the first extent at or after hint, and the one before it
+  map<SIZE_T,SIZE_T>::iterator after=extents.lower_bound(hint);
+  map<SIZE_T,SIZE_T>::iterator before=after;
+
+  if (after!=extents.begin()) {
+    --before;
+    SIZE_T last=before->first+before->second-1;
+    if (hint<=last) {
+      block=hint;
+      Take(before,block);
+      return true;
+    }
+    if (after==extents.end() || hint-last<after->first-hint) {
+      block=last;
+      Take(before,block);
+      return true;
+    }
+  }
+  block=after->first;
+  Take(after,block);
+  return true;
+}
+
+
+void BTreeAllocator::Free(const SIZE_T block)
+{
+  assert(!IsFree(block));
+
+  map<SIZE_T,SIZE_T>::iterator after=extents.upper_bound(block);
+  map<SIZE_T,SIZE_T>::iterator before=after;
+
+  numfree++;
+  if (after!=extents.begin() && (--before)->first+before->second==block) {
+    before->second++;
+    if (after!=extents.end() && after->first==block+1) {
+      before->second+=after->second;
+      extents.erase(after);
+    }
+    return;
+  }
+  if (after!=extents.end() && after->first==block+1) {
+    SIZE_T length=after->second+1;
+    extents.erase(after);
+    extents.insert(make_pair(block,length));
+    return;
+  }
+  extents.insert(make_pair(block,(SIZE_T)1));
+}
+
+
+bool BTreeAllocator::IsFree(const SIZE_T block) const
+{
+  map<SIZE_T,SIZE_T>::const_iterator it=extents.upper_bound(block);
+
+  if (it==extents.begin()) {
+    return false;
+  }
+  --it;
+  return block<it->first+it->second;
+}
@@ -0,0 +1,47 @@
+#ifndef _btree_alloc
+#define _btree_alloc
+
+#include <map>
+
+#include "global.h"
+#include "buffercache.h"
+
+using namespace std;
+
+//
+// The free blocks of an index below its high water mark, kept in
+// memory as extents (runs of consecutive free blocks).  It is built
+// at Attach from the disk's allocation bitmap, which the buffer cache
+// already keeps and which reaches the disk at checkpoints, so handing
+// out or taking back a block reads and writes nothing.
+//
+// Allocate takes the free block nearest a hint, normally the parent or
+// the sibling of the node being made, so that nodes that are used
+// together, like neighbouring leaves, end up close together on disk.
+//
+class BTreeAllocator {
+ private:
+  map<SIZE_T,SIZE_T> extents;  // first block => number of blocks
+  SIZE_T             numfree;
+
+  void Take(map<SIZE_T,SIZE_T>::iterator it, const SIZE_T block);
+
+ public:
+  BTreeAllocator();
+
+  void   Clear();
+
+  // The blocks in [first,end) that the cache's bitmap has as free
+  void   Build(BufferCache *cache, const SIZE_T first, const SIZE_T end);
+
+  // The free block nearest hint (after it, on a tie)
+  // return false if there are no free blocks
+  bool   Allocate(const SIZE_T hint, SIZE_T &block);
+  void   Free(const SIZE_T block);
+
+  bool   IsFree(const SIZE_T block) const;
+  SIZE_T GetNumFree() const { return numfree; }
+  SIZE_T GetNumExtents() const { return extents.size(); }
+};
+
+#endif
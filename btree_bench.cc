@@ -0,0 +1,748 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "crc32c.h"
+#include "ramdisk.h"
+#include "buffercache.h"
+#include "btree.h"
+#include "keysearch.h"
+
+
+void usage() 
+{
+  cerr << "usage: btree_bench test [args]\n";
+  cerr << "  crc [megabytes]     CRC32C throughput and checksummed I/O overhead\n";
+  cerr << "  search [keysize valuesize numkeys]\n";
+  cerr << "                      in-node key search and per-op B-tree CPU time,\n";
+  cerr << "                      for block sizes from 512 bytes to 64 KB\n";
+  cerr << "  split [numkeys]     space used by ascending and random inserts under\n";
+  cerr << "                      several split policies\n";
+  cerr << "  keys [numkeys]      uint64 keys, typed (btree_keys.h) and formatted\n";
+  cerr << "                      as 20 digit text, per-op CPU time\n";
+  cerr << "  alloc [numkeys]     modeled disk time of a full scan, with and without\n";
+  cerr << "                      readahead, after inserts and deletes have churned\n";
+  cerr << "                      the free blocks\n";
+  cerr << "  threads [numkeys maxthreads]\n";
+  cerr << "                      throughput of lookups and inserts from 1 to\n";
+  cerr << "                      maxthreads threads sharing one index\n";
+}
+
+
+// wall clock in seconds
+static double Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+//
+// Raw CRC32C speed, then the cost that checksums add to moving
+// blocks through a RAM disk, so that no file I/O is measured.
+//
+static int BenchChecksums(int argc, char **argv)
+{
+  SIZE_T megabytes = argc>0 ? atoi(argv[0]) : 256;
+  SIZE_T blocksize = 4096;
+  SIZE_T numblocks = 16384;   // 64 MB device
+  SIZE_T run = 64;
+  double start, elapsed;
+  unsigned int sum=0;
+
+  vector<BYTE_T> buf(1<<20);
+  for (SIZE_T i=0;i<buf.size();i++) { 
+    buf[i]=(BYTE_T)(i*131+7);
+  }
+
+  for (int sw=0;sw<2;sw++) { 
+    CRC32CForceSoftware(sw!=0);
+    start=Now();
+    for (SIZE_T i=0;i<megabytes;i++) { 
+      sum+=CRC32C(&(buf[0]),buf.size());
+    }
+    elapsed=Now()-start;
+    cout << "crc32c " << (CRC32CIsHardware() ? "sse4.2" : "table ")
+	 << "      " << megabytes/elapsed << " MB/s, "
+	 << elapsed*1e9/megabytes << " ns/MB\n";
+  }
+  CRC32CForceSoftware(false);
+
+  vector<BYTE_T> data(run*blocksize);
+  vector<BYTE_T *> bufs(run);
+  for (SIZE_T i=0;i<run;i++) { 
+    bufs[i]=&(data[i*blocksize]);
+    memset(bufs[i],(int)i,blocksize);
+  }
+
+  double persec[2];
+
+  for (int withcrc=0;withcrc<2;withcrc++) { 
+    RamDiskSystem disk(numblocks,blocksize,1,64,numblocks/64,10,1,1,withcrc!=0);
+    double reqtime;
+    SIZE_T moved=0;
+
+    disk.NotifyAllocateBlocks(0,numblocks);
+    start=Now();
+    while (moved < megabytes*(1<<20)) { 
+      for (SIZE_T b=0; b<numblocks; b+=run) { 
+	const BYTE_T * const *wbufs = &(bufs[0]);
+	disk.Write(b,run,wbufs,reqtime);
+	disk.Read(b,run,&(bufs[0]),reqtime);
+	moved += 2*run*blocksize;
+      }
+    }
+    elapsed=Now()-start;
+    persec[withcrc]=elapsed*1e9/(moved>>20);
+    cout << "ramdisk read+write " << (withcrc ? "with   " : "without")
+	 << " checksums " << persec[withcrc] << " ns/MB\n";
+  }
+
+  cout << "checksum overhead            " << persec[1]-persec[0] << " ns/MB ("
+       << 100.0*(persec[1]-persec[0])/persec[0] << "%)\n";
+
+  // keep the compiler honest
+  return sum==1 ? 1 : 0;
+}
+
+
+// distinct, unordered keys: i*odd is a bijection mod 2^32
+static void MakeKey(const SIZE_T i, const SIZE_T keysize, KEY_T &k)
+{
+  char buf[32];
+  SIZE_T j;
+
+  sprintf(buf,"%08x",(unsigned)(i*2654435761U));
+  k.Resize(keysize,false);
+  for (j=0;j<keysize;j++) { 
+    k.data[j] = j<8 ? buf[j] : 'a'+(i+j)%26;
+  }
+}
+
+
+//
+// An index for numkeys pairs, on a RAM disk, with a cache that holds
+// all of it.  The disk has room for four times what the pairs take,
+// since nodes are not kept full and churn leaves blocks free, and for
+// a whole overflow block per value if the values are too long for a
+// leaf.  Open attaches the cache and creates the index, with a split
+// policy if one is given; Close detaches both.
+//
+class BenchIndex {
+ private:
+  static const SIZE_T blockspertrack=64;
+  SIZE_T numblocks;
+
+  static SIZE_T NumBlocks(const SIZE_T numkeys, const SIZE_T keysize,
+			  const SIZE_T valuesize, const SIZE_T blocksize)
+  {
+    SIZE_T n=numkeys*(keysize+valuesize+sizeof(SIZE_T))*4/blocksize + 256;
+    if ((keysize+valuesize)*8>=blocksize) {
+      n+=numkeys*(valuesize/blocksize+1);
+    }
+    return (n+blockspertrack-1)/blockspertrack*blockspertrack;
+  }
+
+ public:
+  RamDiskSystem disk;
+  BufferCache   cache;
+  BTreeIndex    btree;
+
+  BenchIndex(const SIZE_T numkeys, const SIZE_T keysize, const SIZE_T valuesize,
+	     const SIZE_T blocksize, const BTreeKeySchema *schema=0) :
+    numblocks(NumBlocks(numkeys,schema ? schema->GetKeySize() : keysize,valuesize,blocksize)),
+    disk(numblocks,blocksize,1,blockspertrack,numblocks/blockspertrack,10,1,1),
+    cache(&disk,numblocks),
+    btree(schema ? BTreeIndex(*schema,valuesize,&cache) : BTreeIndex(keysize,valuesize,&cache))
+  {}
+
+  ERROR_T Open(const BTreeSplitPolicy *policy=0)
+  {
+    ERROR_T rc;
+    if ((rc=cache.Attach()) || (policy && (rc=btree.SetSplitPolicy(*policy)))) {
+      return rc;
+    }
+    return btree.Attach(0,true);
+  }
+
+  ERROR_T Close()
+  {
+    SIZE_T superblock;
+    ERROR_T rc=btree.Detach(superblock);
+    ERROR_T crc=cache.Detach();
+    return rc ? rc : crc;
+  }
+};
+
+
+//
+// Time to find a key in one full leaf, the old way (copy each key
+// out with GetKey and compare Blocks) and with each search kernel.
+//
+static const KeySearchKernel kernels[] = { 
+  KEYSEARCH_MEMCMP, KEYSEARCH_INTEGER, KEYSEARCH_SSE, KEYSEARCH_AVX2
+};
+static const SIZE_T numkernels = sizeof(kernels)/sizeof(kernels[0]);
+
+static void BenchNodeSearch(const SIZE_T blocksize, const SIZE_T keysize, 
+			    const SIZE_T valuesize)
+{
+  BTreeNode leaf(BTREE_LEAF_NODE,keysize,valuesize,blocksize);
+  SIZE_T n=leaf.info.GetNumSlotsAsLeaf();
+  SIZE_T probes=1<<16;
+  vector<KEY_T> keys(n);
+  KEY_T testkey;
+  VALUE_T v;
+  SIZE_T i, hits=0;
+  double start;
+
+  v.Resize(valuesize,false);
+  memset(v.data,'v',valuesize);
+  for (i=0;i<n;i++) { 
+    MakeKey(i,keysize,keys[i]);
+  }
+  sort(keys.begin(),keys.end());
+  leaf.info.numkeys=n;
+  for (i=0;i<n;i++) { 
+    leaf.SetKey(i,keys[i]);
+    leaf.SetVal(i,v);
+  }
+
+  probes=probes/n+1;
+  start=Now();
+  for (SIZE_T p=0;p<probes;p++) { 
+    for (i=0;i<n;i++) { 
+      SIZE_T offset;
+      for (offset=0;offset<n;offset++) { 
+	leaf.GetKey(offset,testkey);
+	if (keys[i]<testkey || keys[i]==testkey) { 
+	  break;
+	}
+      }
+      hits+=offset;
+    }
+  }
+  cout << blocksize << "\t" << n << "\t" << (Now()-start)*1e9/(probes*n);
+
+  // 64 times as many probes for the fast kernels
+  probes*=64;
+  for (SIZE_T k=0;k<numkernels;k++) { 
+    if (!KeySearchUse(kernels[k]) || KeySearchGetKernel(keysize)!=kernels[k]) { 
+      cout << "\t-";
+      continue;
+    }
+    start=Now();
+    for (SIZE_T p=0;p<probes;p++) { 
+      for (i=0;i<n;i++) { 
+	bool found;
+	SIZE_T offset=leaf.FindKey(keys[i],found);
+	if (offset!=i || !found) { 
+	  cerr << KeySearchName(kernels[k]) << " found key "<<i<<" at "<<offset<<"\n";
+	  return;
+	}
+	hits+=offset;
+      }
+    }
+    cout << "\t" << (Now()-start)*1e9/(probes*n);
+  }
+  KeySearchUse(KEYSEARCH_AUTO);
+  cout << (hits==1 ? " " : "") << "\n";
+}
+
+
+//
+// Inserts and then lookups of numkeys random keys in a tree on a RAM
+// disk with a cache big enough to hold all of it, so that the time
+// is CPU spent in the tree and the cache.  The lookups are timed
+// again without the specialized node layouts (btree_fixed.h), which
+// only matters for the sizes that have one.
+//
+static ERROR_T BenchTree(const SIZE_T blocksize, const SIZE_T keysize, 
+			 const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  BenchIndex index(numkeys,keysize,valuesize,blocksize);
+  BTreeIndex &btree=index.btree;
+  KEY_T key;
+  VALUE_T value;
+  vector<KEY_T> probes(numkeys);
+  double start, insert, lookup[2];
+  ERROR_T rc;
+  SIZE_T i;
+
+  value.Resize(valuesize,false);
+  memset(value.data,'v',valuesize);
+
+  if ((rc=index.Open())) { 
+    return rc;
+  }
+
+  start=Now();
+  for (i=0;i<numkeys;i++) { 
+    MakeKey(i,keysize,key);
+    if ((rc=btree.Insert(key,value))) { 
+      cerr << "insert failed with error "<<rc<<"\n";
+      return rc;
+    }
+  }
+  insert=(Now()-start)*1e6/numkeys;
+
+  for (i=0;i<numkeys;i++) { 
+    MakeKey((i*7919)%numkeys,keysize,probes[i]);
+  }
+  SIZE_T superblock;
+  for (int generic=0;generic<2;generic++) { 
+    FixedLayoutsUse(!generic);
+    if ((rc=btree.Detach(superblock)) || (rc=btree.Attach(0,false))) { 
+      return rc;
+    }
+    start=Now();
+    for (i=0;i<numkeys;i++) { 
+      if ((rc=btree.Lookup(probes[i],value))) { 
+	cerr << "lookup failed with error "<<rc<<"\n";
+	return rc;
+      }
+    }
+    lookup[generic]=(Now()-start)*1e6/numkeys;
+  }
+  FixedLayoutsUse(true);
+
+  cout << blocksize << "\t" << insert << "\t" << lookup[0] << "\t" << lookup[1] << "\n";
+
+  return index.Close();
+}
+
+
+static int BenchSearch(int argc, char **argv)
+{
+  SIZE_T keysize = argc>0 ? atoi(argv[0]) : 8;
+  SIZE_T valuesize = argc>1 ? atoi(argv[1]) : 8;
+  SIZE_T numkeys = argc>2 ? atoi(argv[2]) : 100000;
+  SIZE_T blocksize;
+
+  if (keysize<1 || valuesize<1) { 
+    usage();
+    return -1;
+  }
+
+  cout << "in-node search of a full leaf (ns per search)\n";
+  cout << "blocksize\tkeys\tlinear";
+  for (SIZE_T k=0;k<numkernels;k++) { 
+    cout << "\t" << KeySearchName(kernels[k]);
+  }
+  cout << "\n";
+  for (blocksize=512;blocksize<=65536;blocksize*=2) { 
+    BenchNodeSearch(blocksize,keysize,valuesize);
+  }
+
+  cout << "\n" << numkeys << " keys, CPU time per operation (us), "
+       << KeySearchName(KeySearchGetKernel(keysize)) << " search\n";
+  cout << "blocksize\tinsert\tlookup\tgeneric\n";
+  for (blocksize=512;blocksize<=65536;blocksize*=2) { 
+    if (BenchTree(blocksize,keysize,valuesize,numkeys)) { 
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+//
+// Blocks used by numkeys inserts, ascending or in random order, how
+// much of those blocks the keys and values fill, and how often the
+// superblock was written per 1000 inserts.
+//
+static ERROR_T BenchSplitPolicy(const char *name, const BTreeSplitPolicy &policy,
+				const bool ascending, const SIZE_T numkeys)
+{
+  const SIZE_T blocksize=4096, keysize=16, valuesize=16;
+  BenchIndex index(numkeys,keysize,valuesize,blocksize);
+  BTreeIndex &btree=index.btree;
+  KEY_T key(keysize);
+  VALUE_T value(valuesize);
+  char buf[32];
+  ERROR_T rc;
+
+  memset(value.data,'v',valuesize);
+  if ((rc=index.Open(&policy))) { 
+    return rc;
+  }
+  for (SIZE_T i=0;i<numkeys;i++) { 
+    if (ascending) { 
+      sprintf(buf,"%016u",(unsigned)i);
+      memcpy(key.data,buf,keysize);
+    } else {
+      MakeKey(i,keysize,key);
+    }
+    if ((rc=btree.Insert(key,value))) { 
+      cerr << "insert failed with error "<<rc<<"\n";
+      return rc;
+    }
+  }
+
+  SIZE_T blocks=index.cache.GetNumAllocs()-index.cache.GetNumDeallocs();
+  cout << name << "\t" << (ascending ? "ascending" : "random") << "\t" << blocks << "\t"
+       << 100.0*numkeys*(keysize+valuesize)/((double)blocks*blocksize) << "\t"
+       << 1000.0*btree.GetNumSuperblockWrites()/numkeys << "\n";
+
+  return index.Close();
+}
+
+
+static int BenchSplit(int argc, char **argv)
+{
+  SIZE_T numkeys = argc>0 ? atoi(argv[0]) : 100000;
+  BTreeSplitPolicy policies[4];
+  const char *names[4] = { "default", "append", "fill90", "fill90+append" };
+
+  policies[1].append=true;
+  policies[2].maxfill=90;
+  policies[3].maxfill=90;
+  policies[3].append=true;
+
+  cout << numkeys << " keys, 16 byte keys and values, 4 KB blocks\n";
+  cout << "policy\torder\tblocks\tused(%)\tsuperblock writes/1000\n";
+  for (int p=0;p<4;p++) { 
+    if (BenchSplitPolicy(names[p],policies[p],true,numkeys) ||
+	BenchSplitPolicy(names[p],policies[p],false,numkeys)) { 
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+//
+// Random 64 bit numbers as keys, built by the client for each insert
+// and lookup, either formatted as 20 digits of text, the way
+// memcmp ordered integer keys had to be made, or encoded for a u64
+// schema.  The key building is part of the time.
+//
+static ERROR_T BenchKeyType(const bool typed, const SIZE_T numkeys)
+{
+  const SIZE_T blocksize=4096, valuesize=8;
+  BTreeKeySchema schema;
+  schema.Add(BTREE_KEY_UINT64);
+  SIZE_T keysize = typed ? schema.GetKeySize() : 20;
+  BenchIndex index(numkeys,keysize,valuesize,blocksize,typed ? &schema : 0);
+  BTreeIndex &btree=index.btree;
+  KEY_T key;
+  VALUE_T value(valuesize);
+  char buf[32];
+  double start, insert, lookup;
+  ERROR_T rc;
+  SIZE_T i;
+
+  memset(value.data,'v',valuesize);
+  if ((rc=index.Open())) { 
+    return rc;
+  }
+
+  for (int pass=0;pass<2;pass++) { 
+    start=Now();
+    for (i=0;i<numkeys;i++) { 
+      unsigned long long n=(unsigned long long)(i*2654435761U)*2654435761U;
+      if (typed) { 
+	BTreeKeyEncoder enc(schema,key);
+	rc=enc.PutUInt64(n);
+      } else { 
+	sprintf(buf,"%020llu",n);
+	key.Resize(keysize,false);
+	memcpy(key.data,buf,keysize);
+	rc=ERROR_NOERROR;
+      }
+      if (!rc) { 
+	rc = pass==0 ? btree.Insert(key,value) : btree.Lookup(key,value);
+      }
+      if (rc) { 
+	cerr << (pass==0 ? "insert" : "lookup") << " failed with error "<<rc<<"\n";
+	return rc;
+      }
+    }
+    (pass==0 ? insert : lookup)=(Now()-start)*1e6/numkeys;
+  }
+
+  cout << (typed ? "u64" : "text") << "\t" << keysize << "\t" << insert << "\t" << lookup << "\n";
+
+  return index.Close();
+}
+
+
+static int BenchKeys(int argc, char **argv)
+{
+  SIZE_T numkeys = argc>0 ? atoi(argv[0]) : 200000;
+
+  cout << numkeys << " keys, 4 KB blocks, CPU time per operation (us)\n";
+  cout << "key\tkeysize\tinsert\tlookup\n";
+  if (BenchKeyType(false,numkeys) || BenchKeyType(true,numkeys)) { 
+    return -1;
+  }
+  return 0;
+}
+
+
+//
+// Random inserts, then rounds of deleting half the keys and inserting
+// as many new ones, which free blocks all over the index and then
+// reuse them.  Where the reused blocks go decides how far apart
+// neighbouring leaves end up, which a scan in key order then pays
+// for in seeks.  The scan starts with a cold cache, one leaf at a
+// time and then with 8 blocks of readahead, and its time is the disk
+// model's.
+//
+static int BenchAlloc(int argc, char **argv)
+{
+  SIZE_T numkeys = argc>0 ? atoi(argv[0]) : 100000;
+  const SIZE_T blocksize=4096, keysize=16, valuesize=16, rounds=4;
+  BenchIndex index(numkeys,keysize,valuesize,blocksize);
+  RamDiskSystem &disk=index.disk;
+  KEY_T key;
+  VALUE_T value(valuesize);
+  SIZE_T superblock, next=numkeys, scanned=0;
+  vector<SIZE_T> live(numkeys);
+  ERROR_T rc;
+
+  memset(value.data,'v',valuesize);
+  {
+    BTreeIndex &btree=index.btree;
+    if ((rc=index.Open())) { 
+      return rc;
+    }
+    for (SIZE_T i=0;i<numkeys;i++) { 
+      live[i]=i;
+      MakeKey(i,keysize,key);
+      if ((rc=btree.Insert(key,value))) { 
+	cerr << "insert failed with error "<<rc<<"\n";
+	return rc;
+      }
+    }
+    for (SIZE_T r=0;r<rounds;r++) { 
+      for (SIZE_T i=r%2;i<numkeys;i+=2) { 
+	MakeKey(live[i],keysize,key);
+	if ((rc=btree.Delete(key))) { 
+	  cerr << "delete failed with error "<<rc<<"\n";
+	  return rc;
+	}
+      }
+      for (SIZE_T i=r%2;i<numkeys;i+=2) { 
+	live[i]=next++;
+	MakeKey(live[i],keysize,key);
+	if ((rc=btree.Insert(key,value))) { 
+	  cerr << "insert failed with error "<<rc<<"\n";
+	  return rc;
+	}
+      }
+    }
+    cout << numkeys << " keys, 16 byte keys and values, 4 KB blocks, "
+	 << rounds << " rounds of replacing half the keys, "
+	 << index.cache.GetNumAllocs()-index.cache.GetNumDeallocs() << " blocks in use\n";
+    if ((rc=index.Close())) { 
+      return rc;
+    }
+  }
+
+  cout << "readahead\treads\tseek(ms)\ttotal(ms)\n";
+  for (SIZE_T readahead=0;readahead<=8;readahead+=8) { 
+    BufferCache cache(&disk,64);
+    BTreeIndex btree(keysize,valuesize,&cache);
+    cache.SetReadAhead(readahead);
+    if ((rc=cache.Attach()) || (rc=btree.Attach(0,false))) { 
+      return rc;
+    }
+    disk.ClearStats();
+    BTreeCursor cursor(&btree);
+    key.Resize(keysize,false);
+    memset(key.data,0,keysize);
+    scanned=0;
+    for (rc=cursor.Seek(key); rc==ERROR_NOERROR; rc=cursor.Next()) { 
+      scanned++;
+    }
+    if (rc!=ERROR_NONEXISTENT || scanned!=numkeys) { 
+      cerr << "scan failed with error "<<rc<<" after "<<scanned<<" keys\n";
+      return -1;
+    }
+    const DiskStats &stats=disk.GetStats();
+    cout << readahead << "\t" << stats.requests << "\t" << stats.seektime << "\t" << stats.GetTotalTime() << "\n";
+
+    btree.Detach(superblock);
+    if ((rc=cache.Detach())) { 
+      return rc;
+    }
+  }
+  return 0;
+}
+
+
+//
+// Threads sharing one index (SetConcurrent), each doing its share of
+// a mix of inserts of new keys and lookups of keys already there, one
+// of each in turn, on a tree of numkeys keys on a RAM disk with a
+// cache that holds all of it.  The same work is timed in one thread
+// without latches, and then with 1, 2, 4, ... threads.  Afterwards
+// every key is looked up again and the tree is sanity checked.  How
+// far the threads can scale is bounded by the number of CPUs, and by
+// the buffer cache, whose lock each pin and unpin takes.
+//
+struct BenchWorker {
+  BTreeIndex *btree;
+  SIZE_T      first;     // inserts first, first+stride, ...
+  SIZE_T      stride;
+  SIZE_T      count;
+  SIZE_T      numloaded; // and looks up keys below this
+  ERROR_T     rc;
+};
+
+static const SIZE_T threadkeysize=16, threadvaluesize=16;
+
+static void *RunBenchWorker(void *arg)
+{
+  BenchWorker *w=(BenchWorker *)arg;
+  KEY_T key;
+  VALUE_T value;
+
+  w->rc=ERROR_NOERROR;
+  for (SIZE_T i=0;i<w->count && !w->rc;i++) { 
+    MakeKey(w->first+i*w->stride,threadkeysize,key);
+    w->rc=w->btree->Insert(key,key);
+    if (w->rc==ERROR_NOERROR) { 
+      MakeKey((w->first+i*7919)%w->numloaded,threadkeysize,key);
+      w->rc=w->btree->Lookup(key,value);
+      if (w->rc==ERROR_NOERROR && !(value==key)) { 
+	w->rc=ERROR_INSANE;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// numthreads 0 is one thread, without latches
+static ERROR_T BenchThreadCount(const SIZE_T numthreads, const SIZE_T numkeys, double &opspersec)
+{
+  const SIZE_T blocksize=4096;
+  const SIZE_T workers = numthreads ? numthreads : 1;
+  const SIZE_T count=numkeys/workers;
+  // numkeys to start with, and as many again from the threads
+  BenchIndex index(2*numkeys,threadkeysize,threadvaluesize,blocksize);
+  BTreeIndex &btree=index.btree;
+  vector<BenchWorker> w(workers);
+  vector<pthread_t> threads(workers);
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+  SIZE_T i;
+
+  if ((rc=index.Open())) { 
+    return rc;
+  }
+  for (i=0;i<numkeys;i++) { 
+    MakeKey(i,threadkeysize,key);
+    if ((rc=btree.Insert(key,key))) { 
+      cerr << "insert failed with error "<<rc<<"\n";
+      return rc;
+    }
+  }
+  if ((rc=btree.SetConcurrent(numthreads>0))) { 
+    return rc;
+  }
+
+  for (i=0;i<workers;i++) { 
+    w[i].btree=&btree;
+    w[i].first=numkeys+i;
+    w[i].stride=workers;
+    w[i].count=count;
+    w[i].numloaded=numkeys;
+  }
+  double start=Now();
+  if (numthreads==0) { 
+    RunBenchWorker(&w[0]);
+  } else {
+    for (i=0;i<workers;i++) { 
+      if (pthread_create(&threads[i],0,RunBenchWorker,&w[i])) { 
+	return ERROR_GENERAL;
+      }
+    }
+    for (i=0;i<workers;i++) { 
+      pthread_join(threads[i],0);
+    }
+  }
+  opspersec=2.0*count*workers/(Now()-start);
+  for (i=0;i<workers;i++) { 
+    if (w[i].rc) { 
+      cerr << "thread "<<i<<" failed with error "<<w[i].rc<<"\n";
+      return w[i].rc;
+    }
+  }
+
+  for (i=0;i<numkeys+count*workers;i++) { 
+    MakeKey(i,threadkeysize,key);
+    if ((rc=btree.Lookup(key,value)) || !(value==key)) { 
+      cerr << "key "<<i<<" lost after the threads ran\n";
+      return rc ? rc : ERROR_INSANE;
+    }
+  }
+  if ((rc=btree.SanityCheck())) { 
+    return rc;
+  }
+
+  btree.SetConcurrent(false);
+  return index.Close();
+}
+
+
+static int BenchThreads(int argc, char **argv)
+{
+  SIZE_T numkeys = argc>0 ? atoi(argv[0]) : 100000;
+  SIZE_T maxthreads = argc>1 ? atoi(argv[1]) : 8;
+  double base, ops;
+
+  cout << numkeys << " keys, then " << numkeys << " inserts and as many lookups, "
+       << "16 byte keys and values, 4 KB blocks, " << sysconf(_SC_NPROCESSORS_ONLN) << " CPUs\n";
+  cout << "threads\tops/s\tvs unlatched\n";
+  if (BenchThreadCount(0,numkeys,base)) { 
+    return -1;
+  }
+  cout << "unlatched\t" << base << "\t1\n";
+  for (SIZE_T n=1;n<=maxthreads;n*=2) { 
+    if (BenchThreadCount(n,numkeys,ops)) { 
+      return -1;
+    }
+    cout << n << "\t" << ops << "\t" << ops/base << "\n";
+  }
+  cout << "all keys found, sanity check passed\n";
+  return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc<2) { 
+    usage();
+    return -1;
+  }
+
+  string test=argv[1];
+
+  if (test=="crc") { 
+    return BenchChecksums(argc-2,argv+2);
+  } else if (test=="search") { 
+    return BenchSearch(argc-2,argv+2);
+  } else if (test=="split") { 
+    return BenchSplit(argc-2,argv+2);
+  } else if (test=="keys") { 
+    return BenchKeys(argc-2,argv+2);
+  } else if (test=="alloc") { 
+    return BenchAlloc(argc-2,argv+2);
+  } else if (test=="threads") { 
+    return BenchThreads(argc-2,argv+2);
+  } else {
+    usage();
+    return -1;
+  }
+}
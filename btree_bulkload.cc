@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "btree.h"
+
+void usage()
+{
+  cerr << "usage: btree_bulkload [-i] [-p|-t|-s] [-f fill] [-g numkeys] filestem cachesize keysize valuesize\n";
+  cerr << "  creates an index and loads it with \"key value\" lines, in key order,\n";
+  cerr << "  from stdin\n";
+  cerr << "  -i  use repeated Inserts instead of BulkLoad (for comparison)\n";
+  cerr << "  -p  use prefix compressed nodes\n";
+  cerr << "  -t  use short separators in slotted interior nodes\n";
+  cerr << "  -s  use slotted nodes, for variable length keys and values\n";
+  cerr << "  -f  fraction of each node to fill, from 0.5 to 1 (default 1)\n";
+  cerr << "  -g  generate numkeys sequential keys instead of reading stdin\n";
+}
+
+
+// "key value" lines from a file
+class LineSource : public BTreeBulkSource {
+ private:
+  FILE *file;
+  char line[65536];
+  char *k, *v;
+ public:
+  LineSource(FILE *f) : file(f) {}
+  ERROR_T Next(KEY_T &key, VALUE_T &value) {
+    if (fgets(line,sizeof(line),file)==NULL) {
+      return ERROR_NONEXISTENT;
+    }
+    if ((k=strtok(line," \t\n"))==NULL || (v=strtok(NULL," \t\n"))==NULL) {
+      return ERROR_SIZE;
+    }
+    key=KEY_T(k);
+    value=VALUE_T(v);
+    return ERROR_NOERROR;
+  }
+};
+
+
+// Decimal keys 0, 1, 2, ... padded with zeros, and the same digits,
+// repeated, as the values
+class SequenceSource : public BTreeBulkSource {
+ private:
+  SIZE_T next, num, keysize, valuesize;
+  char buf[64];
+ public:
+  SequenceSource(SIZE_T n, SIZE_T ks, SIZE_T vs) : next(0), num(n), keysize(ks), valuesize(vs) {}
+  ERROR_T Next(KEY_T &key, VALUE_T &value) {
+    if (next==num) {
+      return ERROR_NONEXISTENT;
+    }
+    snprintf(buf,sizeof(buf),"%0*llu",(int)keysize,(unsigned long long)next);
+    if (strlen(buf)!=keysize) {
+      return ERROR_SIZE;
+    }
+    if (key.length!=keysize) {
+      key.Resize(keysize,false);
+      value.Resize(valuesize,false);
+    }
+    memcpy(key.data,buf,keysize);
+    for (SIZE_T i=0;i<valuesize;i++) {
+      value.data[i]=buf[i%keysize];
+    }
+    next++;
+    return ERROR_NOERROR;
+  }
+};
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize, keysize, valuesize;
+  SIZE_T superblocknum;
+  bool inserts=false;
+  SIZE_T format=BTREE_FORMAT_PLAIN;
+  double fill=1.0;
+  SIZE_T generate=0;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"iptsf:g:"))!=-1) {
+    switch (opt) {
+    case 'i':
+      inserts=true;
+      break;
+    case 'p':
+      format=BTREE_FORMAT_PREFIX;
+      break;
+    case 't':
+      format=BTREE_FORMAT_TRUNCATE;
+      break;
+    case 's':
+      format=BTREE_FORMAT_SLOTTED;
+      break;
+    case 'f':
+      fill=atof(optarg);
+      break;
+    case 'g':
+      generate=atoll(optarg);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind!=4) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[optind];
+  cachesize=atoi(argv[optind+1]);
+  keysize=atoi(argv[optind+2]);
+  valuesize=atoi(argv[optind+3]);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
+  LineSource lines(stdin);
+  SequenceSource sequence(generate,keysize,valuesize);
+  BTreeBulkSource &source = generate ? (BTreeBulkSource &)sequence : (BTreeBulkSource &)lines;
+  SIZE_T numkeys=0;
+  struct timeval start, end;
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return -1;
+  }
+
+  gettimeofday(&start,0);
+
+  if (inserts) {
+    KEY_T key;
+    VALUE_T value;
+    while ((rc=source.Next(key,value))==ERROR_NOERROR) {
+      if ((rc=btree.Insert(key,value))!=ERROR_NOERROR) {
+	break;
+      }
+      numkeys++;
+    }
+    if (rc==ERROR_NONEXISTENT) {
+      rc=ERROR_NOERROR;
+    }
+  } else {
+    rc=btree.BulkLoad(source,fill);
+  }
+
+  if (rc!=ERROR_NOERROR) {
+    cerr << "Can't load index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  gettimeofday(&end,0);
+
+  cerr << "Index loaded with "<<(inserts ? "inserts" : "BulkLoad");
+  if (inserts) {
+    cerr << " ("<<numkeys<<" keys)";
+  }
+  cerr << " in "<<(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1e6<<" s\n";
+  cerr << "Performance statistics:\n";
+
+  cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+  cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << endl;
+
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  return 0;
+}
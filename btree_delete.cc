@@ -40,7 +40,11 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Delete(KEY_T(key)))!=ERROR_NOERROR) { 
+    // typed keys are given as their fields, separated by commas
+    KEY_T k(key);
+    if (!btree.GetKeySchema().Empty() && (rc=btree.GetKeySchema().ParseKey(key,k))!=ERROR_NOERROR) { 
+      cerr <<"Key does not fit the index's schema ("<<btree.GetKeySchema()<<")\n";
+    } else if ((rc=btree.Delete(k))!=ERROR_NOERROR) { 
       cerr <<"Can't delete from index due to error "<<rc<<endl;
     } else {
       cerr <<"Delete succeeded\n";
@@ -2,14 +2,35 @@
 #include <iostream>
 #include <assert.h>
 #include <string.h>
+#include <vector>
 
 #include "btree_ds.h"
 #include "buffercache.h"
+#include "keysearch.h"
 
 #include "btree.h"
 
 using namespace std;
 
+//
+// A slot of a slotted interior node: the pointer after the key, and
+// where the key's stored bytes are.  Offsets are from the start of the
+// node's data, which is at most 64K.
+//
+struct NodeSlot {
+  SIZE_T         ptr;
+  unsigned short offset;
+  unsigned short length;
+};
+
+// A slot of a slotted leaf.  The value's bytes follow the key's.
+struct LeafSlot {
+  unsigned short offset;
+  unsigned short keylength;
+  unsigned short valuelength;
+};
+
+
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
   SIZE_T n=blocksize-sizeof(*this);
@@ -19,12 +40,102 @@ SIZE_T NodeMetadata::GetNumDataBytes() const
 
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  if (format==BTREE_FORMAT_TRUNCATE || format==BTREE_FORMAT_SLOTTED) { 
+    return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(NodeSlot));
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T)-prefixlen)/(keysize-prefixlen+sizeof(SIZE_T));  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  if (format==BTREE_FORMAT_SLOTTED) { 
+    return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize+sizeof(LeafSlot));
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T)-prefixlen)/(keysize-prefixlen+valuesize);  // floor intended
+}
+
+
+// Sorted keys between first and last all share what those two do
+SIZE_T NodeMetadata::GetPrefixLength(const BYTE_T *first, const BYTE_T *last) const
+{
+  if (format!=BTREE_FORMAT_PREFIX) { 
+    return 0;
+  }
+  return CommonPrefix(first,last,keysize);
+}
+
+
+bool NodeMetadata::IsSlotted() const
+{
+  return format==BTREE_FORMAT_SLOTTED || 
+    (format==BTREE_FORMAT_TRUNCATE && nodetype!=BTREE_LEAF_NODE);
+}
+
+
+SIZE_T NodeMetadata::GetPairSize() const
+{
+  if (nodetype!=BTREE_LEAF_NODE) { 
+    return keysize+sizeof(SIZE_T);
+  }
+  // a slotted leaf's values are of any length up to valuesize, which
+  // comes after the value
+  return keysize+valuesize+(format==BTREE_FORMAT_SLOTTED ? sizeof(SIZE_T) : 0);
+}
+
+
+void NodeMetadata::MakeKeyVal(const KEY_T &key, const VALUE_T &value, BYTE_T *pair) const
+{
+  memcpy(pair,key.data,keysize);
+  memcpy(pair+keysize,value.data,value.length);
+  if (format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T length=value.length;
+    memset(pair+keysize+length,0,valuesize-length);
+    memcpy(pair+keysize+valuesize,&length,sizeof(SIZE_T));
+  }
+}
+
+
+// The length of a slotted leaf pair's value
+static inline SIZE_T PairValueLength(const NodeMetadata *info, const BYTE_T *pair)
+{
+  SIZE_T length;
+  memcpy(&length,pair+info->keysize+info->valuesize,sizeof(SIZE_T));
+  return length;
+}
+
+
+SIZE_T NodeMetadata::GetStoredKeyLength(const BYTE_T *key) const
+{
+  SIZE_T n=keysize;
+  while (n>0 && key[n-1]==0) { 
+    n--;
+  }
+  return n;
+}
+
+
+SIZE_T NodeMetadata::GetStoredSize(const BYTE_T *pairs, const SIZE_T n) const
+{
+  const bool leaf=nodetype==BTREE_LEAF_NODE;
+  SIZE_T pairsize=GetPairSize();
+  SIZE_T bytes=n*(leaf ? sizeof(LeafSlot) : sizeof(NodeSlot));
+
+  for (SIZE_T i=0;i<n;i++) { 
+    bytes+=GetStoredKeyLength(pairs+i*pairsize);
+    if (leaf) { 
+      bytes+=PairValueLength(this,pairs+i*pairsize);
+    }
+  }
+  return bytes;
+}
+
+
+SIZE_T CommonPrefix(const BYTE_T *a, const BYTE_T *b, const SIZE_T n)
+{
+  SIZE_T i;
+  for (i=0; i<n && a[i]==b[i]; i++) { 
+  }
+  return i;
 }
 
 
@@ -34,9 +145,21 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_OVERFLOW_BLOCK ? "OVERFLOW_BLOCK" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist
+     << ", numkeys="<<numkeys<<", format="<<format
+     << (IsSlotted() ? ", heapstart=" : ", prefixlen=")<<prefixlen
+     << ", maxfill="<<maxfill<<")";
+  return os;
+}
+
+
+ostream & SuperblockMetadata::Print(ostream &os) const
+{
+  os << "SuperblockMetadata(highwater="<<highwater<<", overflowsize="<<overflowsize
+     << ", splitpoint="<<splitpoint<<", appendsplit="<<appendsplit<<")";
   return os;
 }
 
@@ -65,8 +188,11 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.format=BTREE_FORMAT_PLAIN;
+  info.prefixlen=0;
+  info.maxfill=0;
   data=0;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
     data = new char [info.GetNumDataBytes()];
     memset(data,0,info.GetNumDataBytes());
   }
@@ -81,6 +207,9 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
+  info.format=rhs.info.format;
+  info.prefixlen=rhs.info.prefixlen;
+  info.maxfill=rhs.info.maxfill;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -91,7 +220,12 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
 
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  // release what we hold before copying over it
+  if (this!=&rhs) { 
+    this->~BTreeNode();
+    new (this) BTreeNode(rhs);
+  }
+  return *this;
 }
 
 
@@ -102,7 +236,7 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
   Block block(sizeof(info)+info.GetNumDataBytes());
 
   memcpy(block.data,&info,sizeof(info));
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && data) { 
     memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
   }
 
@@ -131,7 +265,7 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
     data = new char [info.GetNumDataBytes()];
     memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
   }
@@ -140,17 +274,169 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 }
 
 
-char * BTreeNode::ResolveKey(const SIZE_T offset) const
+BTreeNodeView::BTreeNodeView() :
+  info(0), data(0), cache(0), block(0), modified(false)
+{}
+
+
+BTreeNodeView::BTreeNodeView(NodeMetadata *i, char *d) :
+  info(i), data(d), cache(0), block(0), modified(false)
+{}
+
+
+BTreeNodeView::BTreeNodeView(const BTreeNodeView &rhs) :
+  info(rhs.info), data(rhs.data), cache(0), block(rhs.block), modified(false)
+{}
+
+
+BTreeNodeView & BTreeNodeView::operator=(const BTreeNodeView &rhs)
+{
+  if (this!=&rhs) { 
+    Unpin();
+    info=rhs.info;
+    data=rhs.data;
+    block=rhs.block;
+  }
+  return *this;
+}
+
+
+BTreeNodeView::~BTreeNodeView()
+{
+  Unpin();
+}
+
+
+ERROR_T BTreeNodeView::Pin(BufferCache *b, const SIZE_T blocknum, const bool fresh)
+{
+  BYTE_T *frame;
+  ERROR_T rc;
+
+  Unpin();
+
+  rc=b->PinBlock(blocknum,frame,fresh);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  cache=b;
+  block=blocknum;
+  modified=false;
+  info=(NodeMetadata *)frame;
+  data=(char *)frame+sizeof(NodeMetadata);
+
+  assert(fresh || info->nodetype==BTREE_UNALLOCATED_BLOCK || 
+	 b->GetBlockSize()==(unsigned)info->blocksize);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::Unpin()
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (cache) { 
+    if (modified) { 
+      rc=cache->MarkDirty(block);
+    }
+    ERROR_T urc=cache->UnpinBlock(block);
+    if (rc==ERROR_NOERROR) { 
+      rc=urc;
+    }
+    cache=0;
+  }
+  modified=false;
+  return rc;
+}
+
+
+void BTreeNodeView::Format(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, SIZE_T format,
+			   SIZE_T max_fill)
+{
+  info->nodetype=node_type;
+  info->keysize=key_size;
+  info->valuesize=value_size;
+  info->blocksize=block_size;
+  info->rootnode=0;
+  info->freelist=0;
+  info->numkeys=0;
+  info->format=format;
+  info->prefixlen=0;
+  info->maxfill=max_fill;
+  memset(data,0,info->GetNumDataBytes());
+  modified=true;
+}
+
+
+// What follows each key: its value in a leaf, the pointer after it
+// in an interior node
+static inline SIZE_T PayloadSize(const NodeMetadata *info)
+{
+  return info->nodetype==BTREE_LEAF_NODE ? info->valuesize : sizeof(SIZE_T);
+}
+
+
+static inline NodeSlot *Slot(const BTreeNodeView &b, const SIZE_T i)
+{
+  return (NodeSlot *)(b.data+sizeof(SIZE_T))+i;
+}
+
+static inline LeafSlot *SlotOfLeaf(const BTreeNodeView &b, const SIZE_T i)
+{
+  return (LeafSlot *)(b.data+sizeof(SIZE_T))+i;
+}
+
+static inline SIZE_T SlotSize(const NodeMetadata *info)
+{
+  return info->nodetype==BTREE_LEAF_NODE ? sizeof(LeafSlot) : sizeof(NodeSlot);
+}
+
+// Where the ith key's bytes are in a slotted node, how many there
+// are, and how many there are with its value's
+static inline SIZE_T KeyOffset(const BTreeNodeView &b, const SIZE_T i)
+{
+  return b.info->nodetype==BTREE_LEAF_NODE ? SlotOfLeaf(b,i)->offset : Slot(b,i)->offset;
+}
+
+static inline SIZE_T KeyLength(const BTreeNodeView &b, const SIZE_T i)
+{
+  return b.info->nodetype==BTREE_LEAF_NODE ? SlotOfLeaf(b,i)->keylength : Slot(b,i)->length;
+}
+
+static inline SIZE_T RecordLength(const BTreeNodeView &b, const SIZE_T i)
+{
+  return b.info->nodetype==BTREE_LEAF_NODE ? 
+    SlotOfLeaf(b,i)->keylength+SlotOfLeaf(b,i)->valuelength : Slot(b,i)->length;
+}
+
+
+// Where a slotted node's heap starts: its lowest record, or the end of
+// the node
+static inline SIZE_T HeapStart(const BTreeNodeView &b)
+{
+  return b.info->heapstart ? b.info->heapstart : b.info->GetNumDataBytes();
+}
+
+
+char * BTreeNodeView::ResolveKey(const SIZE_T offset) const
 {
-  switch (info.nodetype) { 
+  switch (info->nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
+    assert(offset<info->numkeys);
+    if (info->IsSlotted()) { 
+      return data+KeyOffset(*this,offset);
+    }
+    return data+sizeof(SIZE_T)+info->prefixlen+offset*(sizeof(SIZE_T)+info->keysize-info->prefixlen);
     break;
   case BTREE_LEAF_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    assert(offset<info->numkeys);
+    if (info->IsSlotted()) { 
+      return data+KeyOffset(*this,offset);
+    }
+    return data+sizeof(SIZE_T)+info->prefixlen+offset*(info->keysize-info->prefixlen+info->valuesize);
     break;
   default:
     return 0;
@@ -158,13 +444,20 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
 }
 
 
-char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+char * BTreeNodeView::ResolvePtr(const SIZE_T offset) const
 {
-  switch (info.nodetype) { 
+  switch (info->nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    assert(offset<=info->numkeys);
+    if (offset==0) { 
+      return data;
+    }
+    if (info->IsSlotted()) { 
+      return (char *)&Slot(*this,offset-1)->ptr;
+    }
+    // just after the (i-1)th key
+    return data+info->prefixlen+offset*(sizeof(SIZE_T)+info->keysize-info->prefixlen);
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
@@ -176,13 +469,14 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 }
 
 
-
-char * BTreeNode::ResolveVal(const SIZE_T offset) const
+char * BTreeNodeView::ResolveVal(const SIZE_T offset) const
 {
-  switch (info.nodetype) { 
+  switch (info->nodetype) { 
   case BTREE_LEAF_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (info->IsSlotted()) { 
+      return ResolveKey(offset)+KeyLength(*this,offset);
+    }
+    return ResolveKey(offset)+info->keysize-info->prefixlen;
     break;
   default:
     return 0;
@@ -190,18 +484,7 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
 }
 
 
-
-char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
-{
-  return ResolveKey(offset);
-}
-
-char * BTreeNode::ResolveKeyPtr(const SIZE_T offset) const
-{
-  return ResolveKey(offset);
-}
-
-ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
+ERROR_T BTreeNodeView::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
 
@@ -209,12 +492,22 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  if (k.length!=info->keysize) { 
+    k.Resize(info->keysize,false);
+  }
+  if (info->IsSlotted()) { 
+    SIZE_T length=KeyLength(*this,offset);
+    memcpy(k.data,p,length);
+    memset(k.data+length,0,info->keysize-length);
+    return ERROR_NOERROR;
+  }
+  memcpy(k.data,ResolvePrefix(),info->prefixlen);
+  memcpy(k.data+info->prefixlen,p,info->keysize-info->prefixlen);
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+
+ERROR_T BTreeNodeView::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
 {
   char *p=ResolvePtr(offset);
 
@@ -226,7 +519,8 @@ ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+
+ERROR_T BTreeNodeView::GetVal(const SIZE_T offset, VALUE_T &v) const
 {
   char *p=ResolveVal(offset);
 
@@ -234,13 +528,17 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T length = info->IsSlotted() ? SlotOfLeaf(*this,offset)->valuelength : info->valuesize;
+
+  if (v.length!=length) { 
+    v.Resize(length,false);
+  }
+  memcpy(v.data,p,length);
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
+ERROR_T BTreeNodeView::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 {
   ERROR_T rc= GetKey(offset,p.key);
 
@@ -252,7 +550,7 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
-ERROR_T BTreeNode::GetKeyPtr(const SIZE_T offset, KeyPointerPair &p) const
+ERROR_T BTreeNodeView::GetKeyPtr(const SIZE_T offset, KeyPointerPair &p) const
 {
   ERROR_T rc= GetKey(offset,p.key);
 
@@ -264,7 +562,82 @@ ERROR_T BTreeNode::GetKeyPtr(const SIZE_T offset, KeyPointerPair &p) const
 }
 
 
-ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+//
+// A key that doesn't share the node's prefix can only go in by laying
+// the whole node out again with a shorter one.  The pair at offset is
+// replaced, or a new one inserted there; a null payload keeps the
+// one that is there.
+//
+static ERROR_T Repack(BTreeNodeView &b, const SIZE_T offset, 
+		      const BYTE_T *key, const BYTE_T *payload, const bool insert)
+{
+  SIZE_T pairsize=b.GetPairSize();
+  SIZE_T n=b.info->numkeys;
+  vector<BYTE_T> pairs((n+1)*pairsize);
+
+  b.GetPairs(0,n,&pairs[0]);
+  if (insert) { 
+    memmove(&pairs[(offset+1)*pairsize],&pairs[offset*pairsize],(n-offset)*pairsize);
+    n++;
+  }
+  memcpy(&pairs[offset*pairsize],key,b.info->keysize);
+  if (payload) { 
+    memcpy(&pairs[offset*pairsize+b.info->keysize],payload,pairsize-b.info->keysize);
+  }
+  return b.SetPairs(&pairs[0],n);
+}
+
+
+//
+// A pair goes into a slotted node's free space between its directory
+// and its heap.  If there is not enough of that, but would be without
+// the holes, the node is laid out again.
+//
+static ERROR_T InsertSlotted(BTreeNodeView &b, const SIZE_T offset, const BYTE_T *pair)
+{
+  const bool leaf=b.info->nodetype==BTREE_LEAF_NODE;
+  const SIZE_T slotsize=SlotSize(b.info);
+  SIZE_T keylength=b.info->GetStoredKeyLength(pair);
+  SIZE_T valuelength=leaf ? PairValueLength(b.info,pair) : 0;
+  SIZE_T length=keylength+valuelength;
+  SIZE_T dirend=sizeof(SIZE_T)+(b.info->numkeys+1)*slotsize;
+  SIZE_T heap=HeapStart(b);
+
+  if (dirend+length>heap) { 
+    if (b.GetUsedBytes()+slotsize+length>b.info->GetNumDataBytes()) { 
+      return ERROR_NOSPACE;
+    }
+    return Repack(b,offset,pair,pair+b.info->keysize,true);
+  }
+
+  char *slot=b.data+sizeof(SIZE_T)+offset*slotsize;
+  memmove(slot+slotsize,slot,(b.info->numkeys-offset)*slotsize);
+  b.info->numkeys++;
+  heap-=length;
+  b.info->heapstart=heap;
+  if (leaf) { 
+    SlotOfLeaf(b,offset)->offset=heap;
+    SlotOfLeaf(b,offset)->keylength=keylength;
+    SlotOfLeaf(b,offset)->valuelength=valuelength;
+    memcpy(b.data+heap+keylength,pair+b.info->keysize,valuelength);
+  } else {
+    memcpy(&Slot(b,offset)->ptr,pair+b.info->keysize,sizeof(SIZE_T));
+    Slot(b,offset)->offset=heap;
+    Slot(b,offset)->length=keylength;
+  }
+  memcpy(b.data+heap,pair,keylength);
+  b.modified=true;
+  return ERROR_NOERROR;
+}
+
+
+static inline bool SharesPrefix(const BTreeNodeView &b, const KEY_T &k)
+{
+  return b.info->prefixlen==0 || memcmp(b.ResolvePrefix(),k.data,b.info->prefixlen)==0;
+}
+
+
+ERROR_T BTreeNodeView::SetKey(const SIZE_T offset, const KEY_T &k)
 {
   char *p=ResolveKey(offset);
 
@@ -272,13 +645,34 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  if (info->IsSlotted()) { 
+    // a separator no longer than the old one goes where it was (a
+    // leaf's key only if it is the same length, since its value
+    // follows it)
+    SIZE_T length=info->GetStoredKeyLength(k.data);
+    if (info->nodetype==BTREE_LEAF_NODE ? length!=KeyLength(*this,offset) : length>KeyLength(*this,offset)) { 
+      return Repack(*this,offset,k.data,0,false);
+    }
+    memcpy(p,k.data,length);
+    if (info->nodetype!=BTREE_LEAF_NODE) { 
+      Slot(*this,offset)->length=length;
+    }
+    modified=true;
+    return ERROR_NOERROR;
+  }
+
+  if (!SharesPrefix(*this,k)) { 
+    return Repack(*this,offset,k.data,0,false);
+  }
+
+  memcpy(p,k.data+info->prefixlen,info->keysize-info->prefixlen);
+  modified=true;
 
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
+ERROR_T BTreeNodeView::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 {
   char *p=ResolvePtr(offset);
 
@@ -287,27 +681,43 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
   }
 
   memcpy(p,&ptr,sizeof(SIZE_T));
+  modified=true;
 
   return ERROR_NOERROR;
 }
 
 
-
-ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+ERROR_T BTreeNodeView::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
   char *p=ResolveVal(offset);
   
   if (p==0) { 
     return ERROR_NOMEM;
   }
+
+  if (info->IsSlotted()) { 
+    // a value no longer than the old one goes where it was
+    if (v.length>SlotOfLeaf(*this,offset)->valuelength) { 
+      KEY_T k;
+      vector<BYTE_T> pair(GetPairSize());
+      GetKey(offset,k);
+      info->MakeKeyVal(k,v,&pair[0]);
+      return Repack(*this,offset,&pair[0],&pair[info->keysize],false);
+    }
+    memcpy(p,v.data,v.length);
+    SlotOfLeaf(*this,offset)->valuelength=v.length;
+    modified=true;
+    return ERROR_NOERROR;
+  }
   
-  memcpy(p,v.data,info.valuesize);
+  memcpy(p,v.data,info->valuesize);
+  modified=true;
   
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
+ERROR_T BTreeNodeView::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 {
   ERROR_T rc=SetKey(offset,p.key);
 
@@ -318,7 +728,8 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
   }
 }
 
-ERROR_T BTreeNode::SetKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
+
+ERROR_T BTreeNodeView::SetKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
 {
   ERROR_T rc=SetKey(offset,p.key);
 
@@ -329,82 +740,338 @@ ERROR_T BTreeNode::SetKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
   }
 }
 
-ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KeyValuePair &p)
+
+ERROR_T BTreeNodeView::InsertKeyVal(const SIZE_T offset, const KeyValuePair &p)
 {
+  SIZE_T pairsize=info->keysize-info->prefixlen+info->valuesize;
+
+  if (info->nodetype!=BTREE_LEAF_NODE || offset>info->numkeys) { 
+    return ERROR_NOMEM;
+  }
+
+  if (info->IsSlotted()) { 
+    vector<BYTE_T> pair(GetPairSize());
+    info->MakeKeyVal(p.key,p.value,&pair[0]);
+    return InsertSlotted(*this,offset,&pair[0]);
+  }
+
+  if (!SharesPrefix(*this,p.key)) { 
+    return Repack(*this,offset,p.key.data,p.value.data,true);
+  }
+  if (info->numkeys>=info->GetNumSlotsAsLeaf()) { 
+    return ERROR_NOSPACE;
+  }
+
   // make room for p by shifting existing, greater pairs over to the right
-  ERROR_T rc;
+  info->numkeys++;
+  char *p0=ResolveKey(offset);
+  memmove(p0+pairsize,p0,(info->numkeys-1-offset)*pairsize);
 
-  info.numkeys++;
-  for (SIZE_T i=info.numkeys-1; (int)i-1>=(int)offset; i--) {
-    KeyValuePair tmp;
-    rc = GetKeyVal(i-1,tmp);
-    if (rc) {  return rc;  }
-    rc = SetKeyVal(i,tmp);
-    if (rc) {  return rc;  }
+  return SetKeyVal(offset,p);
+}
+
+
+ERROR_T BTreeNodeView::InsertKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
+{
+  SIZE_T pairsize=info->keysize-info->prefixlen+sizeof(SIZE_T);
+
+  if (info->nodetype==BTREE_LEAF_NODE || offset>info->numkeys) { 
+    return ERROR_NOMEM;
   }
-  // set new p and update counter
-  rc = SetKeyVal(offset,p);
-  if (rc) {
-    info.numkeys--;
+
+  if (info->IsSlotted()) { 
+    vector<BYTE_T> pair(GetPairSize());
+    memcpy(&pair[0],p.key.data,info->keysize);
+    memcpy(&pair[info->keysize],&p.pointer,sizeof(SIZE_T));
+    return InsertSlotted(*this,offset,&pair[0]);
   }
-  return rc;
+
+  if (!SharesPrefix(*this,p.key)) { 
+    return Repack(*this,offset,p.key.data,(const BYTE_T *)&p.pointer,true);
+  }
+  if (info->numkeys>=info->GetNumSlotsAsInterior()) { 
+    return ERROR_NOSPACE;
+  }
+
+  // make room for p by shifting existing, greater pairs (each key with
+  // the pointer after it) over to the right
+  info->numkeys++;
+  char *p0=ResolveKey(offset);
+  memmove(p0+pairsize,p0,(info->numkeys-1-offset)*pairsize);
+
+  return SetKeyPtr(offset,p);
 }
 
-ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
+
+ERROR_T BTreeNodeView::DeleteKeyVal(const SIZE_T offset)
 {
-  // make room for p by shifting existing, greater pairs over to the right
-  ERROR_T rc;
+  SIZE_T pairsize=info->keysize-info->prefixlen+info->valuesize;
 
-  info.numkeys++;
-  for (SIZE_T i=info.numkeys-1; (int)i-1>=(int)offset; i--) {
-    KeyPointerPair tmp;
-    rc = GetKeyPtr(i-1,tmp);
-    if (rc) {  return rc;  }
-    rc = SetKeyPtr(i,tmp);
-    if (rc) {  return rc;  }
+  if (info->nodetype!=BTREE_LEAF_NODE || offset>=info->numkeys) { 
+    return ERROR_NOMEM;
   }
-  // set new p and update counter
-  rc = SetKeyPtr(offset,p);
-  if (rc) {
-    info.numkeys--;
+
+  if (info->IsSlotted()) { 
+    // the record is left as a hole in the heap
+    memmove(SlotOfLeaf(*this,offset),SlotOfLeaf(*this,offset+1),(info->numkeys-1-offset)*sizeof(LeafSlot));
+    SetNumKeys(info->numkeys-1);
+    return ERROR_NOERROR;
   }
-  return rc;
+
+  // shift the greater pairs over to the left, on top of this one
+  char *p0=ResolveKey(offset);
+  memmove(p0,p0+pairsize,(info->numkeys-1-offset)*pairsize);
+  SetNumKeys(info->numkeys-1);
+
+  return ERROR_NOERROR;
 }
 
-ostream & BTreeNode::Print(ostream &os) const 
+
+ERROR_T BTreeNodeView::DeleteKeyPtr(const SIZE_T offset)
+{
+  SIZE_T pairsize=info->keysize-info->prefixlen+sizeof(SIZE_T);
+
+  if (info->nodetype==BTREE_LEAF_NODE || offset>=info->numkeys) { 
+    return ERROR_NOMEM;
+  }
+
+  if (info->IsSlotted()) { 
+    // the key's bytes are left as a hole in the heap
+    memmove(Slot(*this,offset),Slot(*this,offset+1),(info->numkeys-1-offset)*sizeof(NodeSlot));
+    SetNumKeys(info->numkeys-1);
+    return ERROR_NOERROR;
+  }
+
+  char *p0=ResolveKey(offset);
+  memmove(p0,p0+pairsize,(info->numkeys-1-offset)*pairsize);
+  SetNumKeys(info->numkeys-1);
+
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNodeView::GetPairSize() const
+{
+  return info->GetPairSize();
+}
+
+
+SIZE_T BTreeNodeView::GetUsedBytes() const
+{
+  SIZE_T bytes=sizeof(SIZE_T)+info->numkeys*SlotSize(info);
+
+  for (SIZE_T i=0;i<info->numkeys;i++) { 
+    bytes+=RecordLength(*this,i);
+  }
+  return bytes;
+}
+
+
+void BTreeNodeView::GetPairs(const SIZE_T offset, const SIZE_T n, BYTE_T *pairs) const
+{
+  SIZE_T pairsize=GetPairSize();
+  SIZE_T prefixlen=info->prefixlen;
+
+  if (n==0) { 
+    return;
+  }
+  if (info->IsSlotted()) { 
+    for (SIZE_T i=0;i<n;i++) { 
+      BYTE_T *pair=pairs+i*pairsize;
+      SIZE_T keylength=KeyLength(*this,offset+i);
+      memcpy(pair,ResolveKey(offset+i),keylength);
+      memset(pair+keylength,0,info->keysize-keylength);
+      if (info->nodetype==BTREE_LEAF_NODE) { 
+	SIZE_T valuelength=SlotOfLeaf(*this,offset+i)->valuelength;
+	memcpy(pair+info->keysize,ResolveVal(offset+i),valuelength);
+	memset(pair+info->keysize+valuelength,0,info->valuesize-valuelength);
+	memcpy(pair+info->keysize+info->valuesize,&valuelength,sizeof(SIZE_T));
+      } else {
+	memcpy(pair+info->keysize,&Slot(*this,offset+i)->ptr,sizeof(SIZE_T));
+      }
+    }
+    return;
+  }
+  if (prefixlen==0) { 
+    memcpy(pairs,ResolveKey(offset),n*pairsize);
+    return;
+  }
+  for (SIZE_T i=0;i<n;i++) { 
+    memcpy(pairs+i*pairsize,ResolvePrefix(),prefixlen);
+    memcpy(pairs+i*pairsize+prefixlen,ResolveKey(offset+i),pairsize-prefixlen);
+  }
+}
+
+
+ERROR_T BTreeNodeView::SetPairs(const BYTE_T *pairs, const SIZE_T n)
+{
+  SIZE_T pairsize=GetPairSize();
+  NodeMetadata shape=*info;
+
+  if (info->IsSlotted()) { 
+    // the records go in from the end of the node down, in order,
+    // leaving no holes
+    if (sizeof(SIZE_T)+info->GetStoredSize(pairs,n)>info->GetNumDataBytes()) { 
+      return ERROR_NOSPACE;
+    }
+    const bool leaf=info->nodetype==BTREE_LEAF_NODE;
+    SIZE_T heap=info->GetNumDataBytes();
+    for (SIZE_T i=0;i<n;i++) { 
+      const BYTE_T *pair=pairs+i*pairsize;
+      SIZE_T keylength=info->GetStoredKeyLength(pair);
+      SIZE_T valuelength=leaf ? PairValueLength(info,pair) : 0;
+      heap-=keylength+valuelength;
+      if (leaf) { 
+	SlotOfLeaf(*this,i)->offset=heap;
+	SlotOfLeaf(*this,i)->keylength=keylength;
+	SlotOfLeaf(*this,i)->valuelength=valuelength;
+	memcpy(data+heap+keylength,pair+info->keysize,valuelength);
+      } else {
+	memcpy(&Slot(*this,i)->ptr,pair+info->keysize,sizeof(SIZE_T));
+	Slot(*this,i)->offset=heap;
+	Slot(*this,i)->length=keylength;
+      }
+      memcpy(data+heap,pair,keylength);
+    }
+    info->heapstart=heap;
+    SetNumKeys(n);
+    return ERROR_NOERROR;
+  }
+
+  shape.prefixlen = n>0 ? info->GetPrefixLength(pairs,pairs+(n-1)*pairsize) : 0;
+  if (n > (info->nodetype==BTREE_LEAF_NODE ? shape.GetNumSlotsAsLeaf() : shape.GetNumSlotsAsInterior())) { 
+    return ERROR_NOSPACE;
+  }
+
+  info->prefixlen=shape.prefixlen;
+  SetNumKeys(n);
+  if (n==0) { 
+    return ERROR_NOERROR;
+  }
+  if (info->prefixlen==0) { 
+    memcpy(ResolveKey(0),pairs,n*pairsize);
+    return ERROR_NOERROR;
+  }
+  memcpy(ResolvePrefix(),pairs,info->prefixlen);
+  for (SIZE_T i=0;i<n;i++) { 
+    memcpy(ResolveKey(i),pairs+i*pairsize+info->prefixlen,pairsize-info->prefixlen);
+  }
+  return ERROR_NOERROR;
+}
+
+
+int BTreeNodeView::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  if (info->IsSlotted()) { 
+    // the stored bytes, then the zeros left off
+    SIZE_T length=KeyLength(*this,offset);
+    int c=memcmp(ResolveKey(offset),k.data,length);
+    if (c!=0) { 
+      return c;
+    }
+    for (SIZE_T i=length;i<info->keysize;i++) { 
+      if (k.data[i]!=0) { 
+	return -1;
+      }
+    }
+    return 0;
+  }
+
+  int c=memcmp(ResolvePrefix(),k.data,info->prefixlen);
+
+  if (c!=0) { 
+    return c;
+  }
+  return memcmp(ResolveKey(offset),k.data+info->prefixlen,info->keysize-info->prefixlen);
+}
+
+
+SIZE_T BTreeNodeView::FindKey(const KEY_T &k, bool &found) const
+{
+  const SIZE_T prefixlen=info->prefixlen;
+
+  if (info->IsSlotted()) { 
+    SIZE_T lo=0, hi=info->numkeys;
+    while (lo<hi) { 
+      SIZE_T mid=lo+(hi-lo)/2;
+      if (CompareKey(mid,k)<0) { 
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    found = lo<info->numkeys && CompareKey(lo,k)==0;
+    return lo;
+  }
+
+  // A key outside the prefix is before or after all of the keys
+  if (prefixlen>0) { 
+    int c=memcmp(k.data,ResolvePrefix(),prefixlen);
+    if (c!=0) { 
+      found=false;
+      return c<0 ? 0 : info->numkeys;
+    }
+  }
+
+  // the rest of key i is at base+i*stride for both node types
+  const char *base=data+sizeof(SIZE_T)+prefixlen;
+  const SIZE_T stride=info->keysize-prefixlen+PayloadSize(info);
+
+  return KeySearch((const BYTE_T *)base,stride,info->numkeys,info->keysize-prefixlen,k.data+prefixlen,found);
+}
+
+
+SIZE_T BTreeNodeView::FindChild(const KEY_T &k) const
 {
-  os << "BTreeNode(info="<<info;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
+  bool found;
+  SIZE_T offset=FindKey(k,found);
+  return found ? offset+1 : offset;
+}
+
+
+// An entry that cannot be read ends the list with "?"
+ostream & BTreeNodeView::Print(ostream &os) const 
+{
+  os << "BTreeNode(info="<<*info;
+  if (info->nodetype!=BTREE_UNALLOCATED_BLOCK && info->nodetype!=BTREE_SUPERBLOCK) { 
     os <<", ";
-    if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
+    if (info->nodetype==BTREE_INTERIOR_NODE || info->nodetype==BTREE_ROOT_NODE) {
       SIZE_T ptr;
       KEY_T key;
       os << "pointers_and_values=(";
-      if (info.numkeys>0) { // ==0 implies an empty root node
-	for (SIZE_T i=0;i<info.numkeys;i++) {
-	  GetPtr(i,ptr);
-	  os<<ptr<<", ";
-	  GetKey(i,key);
-	  os<<key<<", ";
+      if (info->numkeys>0) { // ==0 implies an empty root node
+	SIZE_T i;
+	for (i=0;i<info->numkeys;i++) {
+	  if (GetPtr(i,ptr) || GetKey(i,key)) { 
+	    os<<"?";
+	    break;
+	  }
+	  os<<ptr<<", "<<key<<", ";
+	}
+	if (i==info->numkeys) { 
+	  if (GetPtr(info->numkeys,ptr)) { 
+	    os<<"?";
+	  } else {
+	    os<<ptr;
+	  }
 	}
-	GetPtr(info.numkeys,ptr);
-	os <<ptr;
       } 
       os << ")";
 	
     }
-    if (info.nodetype==BTREE_LEAF_NODE) { 
+    if (info->nodetype==BTREE_LEAF_NODE) { 
       KEY_T key;
       VALUE_T val;
       os << "keys_and_values=(";
-      for (SIZE_T i=0;i<info.numkeys;i++) {
+      for (SIZE_T i=0;i<info->numkeys;i++) {
 	if (i>0) { 
 	  os<<", ";
 	}
-	GetKey(i,key);
-	os<<key<<", ";
-	GetVal(i,val);
-	os<<val;
+	if (GetKey(i,key) || GetVal(i,val)) { 
+	  os<<"?";
+	  break;
+	}
+	os<<key<<", "<<val;
       }
       os <<")";
     }
@@ -412,3 +1079,113 @@ ostream & BTreeNode::Print(ostream &os) const
   os <<")";
   return os;
 }
+
+
+//
+// The accessors of a private copy are those of a view of it
+//
+
+char * BTreeNode::ResolveKey(const SIZE_T offset) const
+{
+  return View().ResolveKey(offset);
+}
+
+char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+{
+  return View().ResolvePtr(offset);
+}
+
+char * BTreeNode::ResolveVal(const SIZE_T offset) const
+{
+  return View().ResolveVal(offset);
+}
+
+char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+{
+  return ResolveKey(offset);
+}
+
+char * BTreeNode::ResolveKeyPtr(const SIZE_T offset) const
+{
+  return ResolveKey(offset);
+}
+
+ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
+{
+  return View().GetKey(offset,k);
+}
+
+ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+{
+  return View().GetPtr(offset,ptr);
+}
+
+ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+{
+  return View().GetVal(offset,v);
+}
+
+ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
+{
+  return View().GetKeyVal(offset,p);
+}
+
+ERROR_T BTreeNode::GetKeyPtr(const SIZE_T offset, KeyPointerPair &p) const
+{
+  return View().GetKeyPtr(offset,p);
+}
+
+ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+{
+  return View().SetKey(offset,k);
+}
+
+ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
+{
+  return View().SetPtr(offset,ptr);
+}
+
+ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+{
+  return View().SetVal(offset,v);
+}
+
+ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
+{
+  return View().SetKeyVal(offset,p);
+}
+
+ERROR_T BTreeNode::SetKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
+{
+  return View().SetKeyPtr(offset,p);
+}
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KeyValuePair &p)
+{
+  return View().InsertKeyVal(offset,p);
+}
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KeyPointerPair &p)
+{
+  return View().InsertKeyPtr(offset,p);
+}
+
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  return View().CompareKey(offset,k);
+}
+
+SIZE_T BTreeNode::FindKey(const KEY_T &k, bool &found) const
+{
+  return View().FindKey(k,found);
+}
+
+SIZE_T BTreeNode::FindChild(const KEY_T &k) const
+{
+  return View().FindChild(k);
+}
+
+ostream & BTreeNode::Print(ostream &os) const 
+{
+  return View().Print(os);
+}
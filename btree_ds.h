@@ -13,6 +13,13 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_OVERFLOW_BLOCK 5 // part of a value too long for a leaf
+
+// Node layouts
+#define BTREE_FORMAT_PLAIN 0    // every key stored whole
+#define BTREE_FORMAT_PREFIX 1   // the prefix a node's keys share stored once
+#define BTREE_FORMAT_TRUNCATE 2 // interior separators cut short, stored by length
+#define BTREE_FORMAT_SLOTTED 3  // every node slotted; keys and values of any length
 
 
 typedef Block Buffer;
@@ -25,18 +32,43 @@ class BufferCache;
 struct KeyValuePair;
 struct KeyPointerPair;
 
+// How many leading bytes of a and b are the same
+SIZE_T CommonPrefix(const BYTE_T *a, const BYTE_T *b, const SIZE_T n);
+
 struct NodeMetadata {
   int nodetype;
   SIZE_T keysize; 
   SIZE_T valuesize;
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
-  SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T freelist; //unused, free blocks are in the disk's bitmap (btree_alloc.h)
   SIZE_T numkeys;
+  SIZE_T format;    // BTREE_FORMAT_*; for the superblock, that of new nodes
+  union { 
+    SIZE_T prefixlen; // bytes of prefix stored once (prefix format nodes)
+    SIZE_T heapstart; // where the lowest record is (slotted nodes), 0 if none
+  };
+  SIZE_T maxfill;   // percent of its room a node fills before it splits, or 0
+                    // for two thirds; for the superblock, that of new nodes
 
   SIZE_T GetNumDataBytes() const;
+  // with the node's current prefix; for a slotted node, with every
+  // key stored whole
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  // the prefix a node of this format gives keys from first to last
+  SIZE_T GetPrefixLength(const BYTE_T *first, const BYTE_T *last) const;
+
+  // Whether the node's keys are stored by length in a slotted page,
+  // and if so the bytes a key, or n pairs with whole keys, take there
+  bool   IsSlotted() const;
+  SIZE_T GetStoredKeyLength(const BYTE_T *key) const;
+  SIZE_T GetStoredSize(const BYTE_T *pairs, const SIZE_T n) const;
+
+  // The size of the pairs with whole keys that nodes of this type
+  // exchange, and a leaf's pair for a whole key and a value
+  SIZE_T GetPairSize() const;
+  void   MakeKeyVal(const KEY_T &key, const VALUE_T &value, BYTE_T *pair) const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -46,6 +78,118 @@ struct NodeMetadata {
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
 
+//
+// What only the superblock keeps, at the start of its data (the key
+// schema, if any, follows it), so that other nodes do not carry it
+//
+struct SuperblockMetadata {
+  SIZE_T highwater;    // no block at or past it has been handed out
+  SIZE_T overflowsize; // the largest value, if values too long for the
+                       // leaves go to overflow blocks
+  SIZE_T splitpoint;   // percent of the keys the left node keeps when
+                       // one splits in two, or 0 for half
+  SIZE_T appendsplit;  // nonzero to fill up the left nodes of splits at
+                       // the right end of the tree
+
+  SuperblockMetadata() : highwater(0), overflowsize(0), splitpoint(0), appendsplit(0) {}
+
+  ostream &Print(ostream &rhs) const;
+};
+
+
+inline ostream & operator<< (ostream &os, const SuperblockMetadata &meta) { return meta.Print(os); }
+
+
+
+//
+// A node seen in place.  Its metadata and arrays are not copied but
+// overlaid on memory that belongs to someone else.  
+//
+// Pinned on a buffer cache frame, a view is the cached block itself:
+// nothing is allocated or copied to read it, and if it is changed
+// (through the Set and Insert functions, or after MarkDirty) the frame
+// is marked dirty when it is unpinned, which happens at destruction
+// at the latest.  BTreeNode keeps a private copy with the same layout
+// and uses an unpinned view for all of its accessors.
+//
+// Copying a view gives an unpinned alias of the same memory, which
+// must not outlive the original's pin.
+//
+struct BTreeNodeView {
+  NodeMetadata *info;
+  char         *data;
+  BufferCache  *cache;    // nonzero while pinned
+  SIZE_T        block;
+  bool          modified;
+
+  BTreeNodeView();
+  BTreeNodeView(NodeMetadata *info, char *data);
+  BTreeNodeView(const BTreeNodeView &rhs);
+  BTreeNodeView & operator=(const BTreeNodeView &rhs);
+  ~BTreeNodeView();
+
+  // fresh is for a block just allocated, which is zeroed, not read
+  ERROR_T Pin(BufferCache *b, const SIZE_T block, const bool fresh=false);
+  ERROR_T Unpin();
+
+  // Lay out an empty node of the given type and format
+  void    Format(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, SIZE_T format,
+		 SIZE_T max_fill=0);
+
+  void    MarkDirty() { modified=true; }
+  void    SetNumKeys(const SIZE_T n) { info->numkeys=n; modified=true; }
+
+  // What is stored of the ith key: all of it, or what follows the
+  // node's prefix
+  char *ResolveKey(const SIZE_T offset) const;
+  char *ResolvePtr(const SIZE_T offset) const;
+  char *ResolveVal(const SIZE_T offset) const;
+  char *ResolvePrefix() const { return data+sizeof(SIZE_T); }
+
+  ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const;
+  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const;
+  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const;
+  ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const;
+  ERROR_T GetKeyPtr(const SIZE_T offset, KeyPointerPair &p) const;
+
+  ERROR_T SetKey(const SIZE_T offset, const KEY_T &k);
+  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);
+  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v);
+  ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p);
+  ERROR_T SetKeyPtr(const SIZE_T offset, const KeyPointerPair &p);
+
+  // Make room at offset by moving the later entries over, then write.
+  // A key that does not share the node's prefix shortens it, which
+  // can leave no room: these and SetKey then return ERROR_NOSPACE and
+  // change nothing.
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KeyValuePair &p);
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KeyPointerPair &p);
+
+  // Close the gap left by the pair at offset (for an interior node,
+  // the key and the pointer after it)
+  ERROR_T DeleteKeyVal(const SIZE_T offset);
+  ERROR_T DeleteKeyPtr(const SIZE_T offset);
+
+  // Pairs with whole keys, key and value for a leaf or key and the
+  // pointer after it for an interior node, as they are moved between
+  // nodes.  SetPairs replaces all of a node's pairs (but not its first
+  // pointer), choosing its prefix again; it returns ERROR_NOSPACE,
+  // changing nothing, if they don't fit.
+  SIZE_T  GetPairSize() const;
+  // Of a slotted node's data, what its pairs and first pointer take
+  SIZE_T  GetUsedBytes() const;
+  void    GetPairs(const SIZE_T offset, const SIZE_T n, BYTE_T *pairs) const;
+  ERROR_T SetPairs(const BYTE_T *pairs, const SIZE_T n);
+
+  int     CompareKey(const SIZE_T offset, const KEY_T &k) const;
+  SIZE_T  FindKey(const KEY_T &k, bool &found) const;
+  SIZE_T  FindChild(const KEY_T &k) const;
+
+  ostream &Print(ostream &rhs) const;
+};
+
+inline ostream & operator<<(ostream &os, const BTreeNodeView &node) { return node.Print(os); }
+
 
 //
 // Interior node:
@@ -56,14 +200,55 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *The next leaf in key order, or 0 for the last
+//
+// In the prefix format, the first prefixlen bytes, which all of the
+// keys of the node share, come once after the first PTR, and each KEY
+// is just the rest.  Every KEY is still the same size, so a search
+// compares the prefix once and then the suffixes in place.
+//
+// PTR PREFIX SUFFIX PTR SUFFIX PTR
+// PTR* PREFIX SUFFIX VALUE SUFFIX VALUE
+//
+// In the truncate format, interior nodes are slotted pages.  After the
+// first PTR is a directory with a SLOT for each key, holding the PTR
+// after it and where the key's bytes are in a heap that grows down
+// from the end of the node, and whose start the header keeps in place
+// of a prefix length.  A key is stored without its trailing zero
+// bytes, and separators are chosen to have many of them, so most are
+// a few bytes long.  Deletes leave holes in the heap, which are
+// squeezed out when an insert needs the room.
+//
+// PTR SLOT SLOT SLOT ... free ... KEY KEY KEY
+// SLOT = PTR OFFSET(2 bytes) LENGTH(2 bytes)
+//
+// In the slotted format, leaves are laid out the same way, and every
+// key and value is stored at its own length, up to keysize and
+// valuesize.  A key shorter than keysize is the same key as it is with
+// zeros after it (keys are stored without them).  The pairs leaves
+// exchange have the value's length after the value.
+//
+// PTR* SLOT SLOT ... free ... KEY VALUE KEY VALUE
+// SLOT = OFFSET(2 bytes) KEYLENGTH(2 bytes) VALUELENGTH(2 bytes)
+//
+// An index whose superblock has an overflowsize (SuperblockMetadata) keeps values too long
+// for its leaves in chains of overflow blocks.  Every VALUE in a leaf
+// is then a TAG byte and either the value itself or where the chain
+// starts and how long the value is.  Each overflow block has the next
+// block of the chain (0 for the last) and, in its numkeys, how many
+// bytes of the value it holds.
+//
+// VALUE = TAG(0) BYTES  or  TAG(1) PTR LENGTH
+// Overflow block: PTR* BYTES
 
 
 struct BTreeNode {
   NodeMetadata  info;
   char         *data;
   //
-  // unallocated or superblock => blank
+  // unallocated => blank
+  // superblock => SuperblockMetadata, then the key schema, if any
+  //               (btree_keys.h)
   // interior => array of keys
   // leaf => array of key/value pairs
 
@@ -104,6 +289,14 @@ struct BTreeNode {
   ERROR_T SetKeyPtr(const SIZE_T offset, const KeyPointerPair &p); // Writes the ith key pointer pair (leaf)
   ERROR_T InsertKeyPtr(const SIZE_T offset, const KeyPointerPair &p); // Makes room for and then writes the ith key pointer pair (leaf)
 
+  // Searching compares keys where they sit in the node, without copying
+  int     CompareKey(const SIZE_T offset, const KEY_T &k) const; // memcmp of the ith key with k (interior or leaf)
+  SIZE_T  FindKey(const KEY_T &k, bool &found) const; // Binary search for the first key >= k, found if it is == k (interior or leaf)
+  SIZE_T  FindChild(const KEY_T &k) const; // Which pointer to follow for k: keys equal to key i go right, to i+1 (interior)
+
+
+  // An unpinned view of this copy
+  BTreeNodeView View() const { return BTreeNodeView((NodeMetadata *)&info,data); }
 
   ostream &Print(ostream &rhs) const;
 };
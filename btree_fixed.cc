@@ -0,0 +1,38 @@
+#include "btree_fixed.h"
+
+struct FixedLayout {
+  SIZE_T        keysize;
+  SIZE_T        valuesize;
+  FixedLookupFn lookup;
+};
+
+// The common shapes: integer keys and values, short strings, and
+// short keys with a small record
+static const FixedLayout layouts[] = {
+  { 8, 8, &BTreeNodeT<8,8>::Lookup },
+  { 16, 16, &BTreeNodeT<16,16>::Lookup },
+  { 32, 100, &BTreeNodeT<32,100>::Lookup }
+};
+static const SIZE_T numlayouts = sizeof(layouts)/sizeof(layouts[0]);
+
+static bool fixedlayouts=true;
+
+
+FixedLookupFn FixedLookupFor(const NodeMetadata &info)
+{
+  if (!fixedlayouts || info.format!=BTREE_FORMAT_PLAIN) {
+    return 0;
+  }
+  for (SIZE_T i=0;i<numlayouts;i++) {
+    if (layouts[i].keysize==info.keysize && layouts[i].valuesize==info.valuesize) {
+      return layouts[i].lookup;
+    }
+  }
+  return 0;
+}
+
+
+void FixedLayoutsUse(const bool use)
+{
+  fixedlayouts=use;
+}
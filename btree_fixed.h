@@ -0,0 +1,135 @@
+#ifndef _btree_fixed
+#define _btree_fixed
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+#include "btree_ds.h"
+#include "buffercache.h"
+
+//
+// Plain format nodes of one key and value size, with the sizes known
+// at compile time.  The strides between keys are constants, and a key
+// compares as a fixed number of big endian words, unrolled, instead
+// of through memcmp and the general accessors, which work out the
+// layout from the node's metadata on every call.
+//
+// Only lookups use these; BTreeIndex picks one when it attaches to a
+// plain index without overflow blocks whose sizes have a
+// specialization (FixedLookupFor).
+//
+template <SIZE_T KS>
+static inline int CompareFixedKey(const BYTE_T *a, const BYTE_T *b)
+{
+  SIZE_T i=0;
+  for (; i+8<=KS; i+=8) {
+    uint64_t x, y;
+    memcpy(&x,a+i,8);
+    memcpy(&y,b+i,8);
+    if (x!=y) {
+      return __builtin_bswap64(x)<__builtin_bswap64(y) ? -1 : 1;
+    }
+  }
+  for (; i<KS; i++) {
+    if (a[i]!=b[i]) {
+      return a[i]<b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+
+template <SIZE_T KS, SIZE_T VS>
+struct BTreeNodeT {
+  enum {
+    LEAFSTRIDE = KS+VS,
+    INTERIORSTRIDE = KS+sizeof(SIZE_T)
+  };
+
+  // The first key that is >= key, at base, base+STRIDE, ...
+  template <SIZE_T STRIDE>
+  static inline SIZE_T Search(const BTreeNodeView &b, const BYTE_T *key, bool &found) {
+    const BYTE_T *base=(const BYTE_T *)b.data+sizeof(SIZE_T);
+    const SIZE_T n=b.info->numkeys;
+    SIZE_T lo=0, hi=n;
+    while (lo<hi) {
+      SIZE_T mid=lo+(hi-lo)/2;
+      if (CompareFixedKey<KS>(base+mid*STRIDE,key)<0) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    found = lo<n && CompareFixedKey<KS>(base+lo*STRIDE,key)==0;
+    return lo;
+  }
+
+  static inline SIZE_T FindKey(const BTreeNodeView &b, const BYTE_T *key, bool &found) {
+    return Search<LEAFSTRIDE>(b,key,found);
+  }
+
+  // Keys equal to a separator live to its right
+  static inline SIZE_T FindChild(const BTreeNodeView &b, const BYTE_T *key) {
+    bool found;
+    SIZE_T slot=Search<INTERIORSTRIDE>(b,key,found);
+    return found ? slot+1 : slot;
+  }
+
+  static inline SIZE_T GetPtr(const BTreeNodeView &b, const SIZE_T slot) {
+    SIZE_T ptr;
+    memcpy(&ptr, slot==0 ? b.data : b.data+sizeof(SIZE_T)+(slot-1)*INTERIORSTRIDE+KS, sizeof(SIZE_T));
+    return ptr;
+  }
+
+  static inline void GetVal(const BTreeNodeView &b, const SIZE_T slot, VALUE_T &value) {
+    value.Resize(VS,false);
+    memcpy(value.data,b.data+sizeof(SIZE_T)+slot*LEAFSTRIDE+KS,VS);
+  }
+
+  // BTreeIndex::Lookup from the root down
+  static ERROR_T Lookup(BufferCache *cache, SIZE_T node, const BYTE_T *key, VALUE_T &value) {
+    BTreeNodeView b;
+    SIZE_T slot;
+    bool found;
+    ERROR_T rc;
+
+    for (;;) {
+      rc=b.Pin(cache,node);
+      if (rc) { return rc; }
+      assert(b.info->format==BTREE_FORMAT_PLAIN && b.info->keysize==KS && b.info->valuesize==VS);
+      switch (b.info->nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (b.info->numkeys==0) {
+	  return ERROR_NONEXISTENT;
+	}
+	node=GetPtr(b,FindChild(b,key));
+	break;
+      case BTREE_LEAF_NODE:
+	slot=FindKey(b,key,found);
+	if (!found) {
+	  return ERROR_NONEXISTENT;
+	}
+	GetVal(b,slot,value);
+	return ERROR_NOERROR;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+  }
+};
+
+
+typedef ERROR_T (*FixedLookupFn)(BufferCache *cache, SIZE_T root, const BYTE_T *key, VALUE_T &value);
+
+// The specialized lookup for an index with this superblock, or 0 if
+// there is none
+FixedLookupFn FixedLookupFor(const NodeMetadata &info);
+
+// Whether to use the specializations at all (for comparison); takes
+// effect when an index is next attached
+void FixedLayoutsUse(const bool use);
+
+#endif
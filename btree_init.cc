@@ -4,7 +4,9 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize|keyschema valuesize\n";
+  cerr << "  keyschema is typed key fields, such as u32,i64,s12 (uint32, int64,\n";
+  cerr << "  and a 12 byte string); u64 is a uint64\n";
 }
 
 
@@ -13,6 +15,7 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  BTreeKeySchema schema;
 
   if (argc!=5) { 
     usage();
@@ -24,9 +27,14 @@ int main(int argc, char **argv)
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
 
+  if (keysize==0 && schema.Parse(argv[3])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree = schema.Empty() ? BTreeIndex(keysize,valuesize,&cache) : BTreeIndex(schema,valuesize,&cache);
   
   ERROR_T rc;
 
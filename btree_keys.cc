@@ -0,0 +1,429 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_keys.h"
+
+// Stored: a magic number, the number of fields, then each field's
+// type and length
+//
+// MAGIC NUMFIELDS TYPE LENGTH TYPE LENGTH ...
+#define BTREE_KEY_MAGIC 0x4b455953  // "KEYS"
+
+
+static SIZE_T FieldLength(const SIZE_T type, const SIZE_T length)
+{
+  switch (type) {
+  case BTREE_KEY_UINT32:
+    return 4;
+  case BTREE_KEY_UINT64:
+  case BTREE_KEY_INT64:
+    return 8;
+  case BTREE_KEY_STRING:
+    return length;
+  default:
+    return 0;
+  }
+}
+
+
+static inline void PutBigEndian(BYTE_T *p, uint64_t v, const SIZE_T n)
+{
+  for (SIZE_T i=n;i>0;i--) {
+    p[i-1]=(BYTE_T)v;
+    v>>=8;
+  }
+}
+
+static inline uint64_t GetBigEndian(const BYTE_T *p, const SIZE_T n)
+{
+  uint64_t v=0;
+  for (SIZE_T i=0;i<n;i++) {
+    v=(v<<8)|p[i];
+  }
+  return v;
+}
+
+// An int64 with its sign bit flipped orders as a uint64 does
+#define BTREE_KEY_SIGNBIT (((uint64_t)1)<<63)
+
+
+BTreeKeySchema::BTreeKeySchema() : keysize(0)
+{}
+
+
+ERROR_T BTreeKeySchema::Add(const SIZE_T type, const SIZE_T length)
+{
+  BTreeKeyField f;
+
+  f.type=type;
+  f.length=FieldLength(type,length);
+  if (fields.size()==BTREE_KEY_MAXFIELDS || f.length==0) {
+    return ERROR_SIZE;
+  }
+  fields.push_back(f);
+  keysize+=f.length;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeySchema::Parse(const char *text)
+{
+  BTreeKeySchema s;
+  const char *p=text;
+  char *end;
+
+  while (*p) {
+    ERROR_T rc;
+    if (!strncmp(p,"u32",3)) {
+      rc=s.Add(BTREE_KEY_UINT32);
+      p+=3;
+    } else if (!strncmp(p,"u64",3)) {
+      rc=s.Add(BTREE_KEY_UINT64);
+      p+=3;
+    } else if (!strncmp(p,"i64",3)) {
+      rc=s.Add(BTREE_KEY_INT64);
+      p+=3;
+    } else if (*p=='s') {
+      rc=s.Add(BTREE_KEY_STRING,strtoul(p+1,&end,10));
+      p=end;
+    } else {
+      return ERROR_BADCONFIG;
+    }
+    if (rc || (*p!=',' && *p!=0) || (*p==',' && p[1]==0)) {
+      return ERROR_BADCONFIG;
+    }
+    if (*p==',') {
+      p++;
+    }
+  }
+  if (s.Empty()) {
+    return ERROR_BADCONFIG;
+  }
+  *this=s;
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeKeySchema::GetStoredSize() const
+{
+  return (2+2*BTREE_KEY_MAXFIELDS)*sizeof(SIZE_T);
+}
+
+
+void BTreeKeySchema::Store(BYTE_T *buf) const
+{
+  SIZE_T magic=BTREE_KEY_MAGIC;
+  SIZE_T n=fields.size();
+
+  memset(buf,0,GetStoredSize());
+  memcpy(buf,&magic,sizeof(SIZE_T));
+  memcpy(buf+sizeof(SIZE_T),&n,sizeof(SIZE_T));
+  for (SIZE_T i=0;i<n;i++) {
+    memcpy(buf+(2+2*i)*sizeof(SIZE_T),&(fields[i].type),sizeof(SIZE_T));
+    memcpy(buf+(3+2*i)*sizeof(SIZE_T),&(fields[i].length),sizeof(SIZE_T));
+  }
+}
+
+
+ERROR_T BTreeKeySchema::Load(const BYTE_T *buf, const SIZE_T n)
+{
+  BTreeKeySchema s;
+  SIZE_T magic, numfields, type, length;
+
+  if (n<GetStoredSize()) {
+    return ERROR_INSANE;
+  }
+  memcpy(&magic,buf,sizeof(SIZE_T));
+  memcpy(&numfields,buf+sizeof(SIZE_T),sizeof(SIZE_T));
+  if (magic!=BTREE_KEY_MAGIC) {
+    numfields=0;
+  } else if (numfields>BTREE_KEY_MAXFIELDS) {
+    return ERROR_INSANE;
+  }
+  for (SIZE_T i=0;i<numfields;i++) {
+    memcpy(&type,buf+(2+2*i)*sizeof(SIZE_T),sizeof(SIZE_T));
+    memcpy(&length,buf+(3+2*i)*sizeof(SIZE_T),sizeof(SIZE_T));
+    if (s.Add(type,length) || s.fields.back().length!=length) {
+      return ERROR_INSANE;
+    }
+  }
+  *this=s;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeySchema::ParseKey(const char *text, KEY_T &key) const
+{
+  BTreeKeyEncoder enc(*this,key);
+  const char *p=text;
+  char *end;
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<fields.size();i++) {
+    if (i>0) {
+      if (*p!=',') {
+	return ERROR_SIZE;
+      }
+      p++;
+    }
+    // strto* would skip leading blanks, take a minus sign for an
+    // unsigned field, and clamp whatever overflows
+    if (fields[i].type!=BTREE_KEY_STRING &&
+	(isspace((unsigned char)*p) || (*p=='-' && fields[i].type!=BTREE_KEY_INT64))) {
+      return ERROR_SIZE;
+    }
+    errno=0;
+    switch (fields[i].type) {
+    case BTREE_KEY_UINT32:
+    case BTREE_KEY_UINT64: {
+      unsigned long long v=strtoull(p,&end,10);
+      if (errno==ERANGE || (fields[i].type==BTREE_KEY_UINT32 && v>UINT32_MAX)) {
+	return ERROR_SIZE;
+      }
+      rc = fields[i].type==BTREE_KEY_UINT32 ? enc.PutUInt32(v) : enc.PutUInt64(v);
+      break;
+    }
+    case BTREE_KEY_INT64: {
+      long long v=strtoll(p,&end,10);
+      if (errno==ERANGE) {
+	return ERROR_SIZE;
+      }
+      rc=enc.PutInt64(v);
+      break;
+    }
+    default:
+      end=(char*)strchr(p,',');
+      if (!end) {
+	end=(char*)p+strlen(p);
+      }
+      rc=enc.PutString(p,end-p);
+      break;
+    }
+    if (rc) {
+      return rc;
+    }
+    if (end==p && fields[i].type!=BTREE_KEY_STRING) {
+      return ERROR_SIZE;
+    }
+    p=end;
+  }
+  if (*p) {
+    return ERROR_SIZE;
+  }
+  return enc.Done();
+}
+
+
+ostream &BTreeKeySchema::PrintKey(ostream &os, const KEY_T &key) const
+{
+  BTreeKeyDecoder dec(*this,key);
+  uint32_t u32;
+  uint64_t u64;
+  int64_t i64;
+  string s;
+
+  // a key that does not decode prints up to the field that failed
+  for (SIZE_T i=0;i<fields.size();i++) {
+    if (i>0) {
+      os << ",";
+    }
+    switch (fields[i].type) {
+    case BTREE_KEY_UINT32:
+      if (dec.GetUInt32(u32)) {
+	return os;
+      }
+      os << u32;
+      break;
+    case BTREE_KEY_UINT64:
+      if (dec.GetUInt64(u64)) {
+	return os;
+      }
+      os << u64;
+      break;
+    case BTREE_KEY_INT64:
+      if (dec.GetInt64(i64)) {
+	return os;
+      }
+      os << i64;
+      break;
+    default:
+      if (dec.GetString(s)) {
+	return os;
+      }
+      os << s;
+      break;
+    }
+  }
+  return os;
+}
+
+
+ostream &BTreeKeySchema::Print(ostream &os) const
+{
+  for (SIZE_T i=0;i<fields.size();i++) {
+    if (i>0) {
+      os << ",";
+    }
+    switch (fields[i].type) {
+    case BTREE_KEY_UINT32:
+      os << "u32";
+      break;
+    case BTREE_KEY_UINT64:
+      os << "u64";
+      break;
+    case BTREE_KEY_INT64:
+      os << "i64";
+      break;
+    default:
+      os << "s" << fields[i].length;
+      break;
+    }
+  }
+  return os;
+}
+
+
+BTreeKeyEncoder::BTreeKeyEncoder(const BTreeKeySchema &s, KEY_T &k) :
+  schema(s), key(k), field(0), offset(0)
+{
+  if (key.length!=schema.GetKeySize()) {
+    key.Resize(schema.GetKeySize(),false);
+  }
+}
+
+
+ERROR_T BTreeKeyEncoder::Next(const SIZE_T type, BYTE_T *&p)
+{
+  if (field==schema.GetNumFields() || schema.GetField(field).type!=type) {
+    return ERROR_SIZE;
+  }
+  p=key.data+offset;
+  offset+=schema.GetField(field).length;
+  field++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyEncoder::PutUInt32(const uint32_t v)
+{
+  BYTE_T *p;
+  ERROR_T rc=Next(BTREE_KEY_UINT32,p);
+  if (rc) { return rc; }
+  PutBigEndian(p,v,4);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyEncoder::PutUInt64(const uint64_t v)
+{
+  BYTE_T *p;
+  ERROR_T rc=Next(BTREE_KEY_UINT64,p);
+  if (rc) { return rc; }
+  PutBigEndian(p,v,8);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyEncoder::PutInt64(const int64_t v)
+{
+  BYTE_T *p;
+  ERROR_T rc=Next(BTREE_KEY_INT64,p);
+  if (rc) { return rc; }
+  PutBigEndian(p,(uint64_t)v^BTREE_KEY_SIGNBIT,8);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyEncoder::PutString(const char *s)
+{
+  return PutString(s,strlen(s));
+}
+
+
+ERROR_T BTreeKeyEncoder::PutString(const char *s, const SIZE_T n)
+{
+  if (field<schema.GetNumFields() && n>schema.GetField(field).length) {
+    return ERROR_SIZE;
+  }
+  BYTE_T *p;
+  ERROR_T rc=Next(BTREE_KEY_STRING,p);
+  if (rc) { return rc; }
+  memcpy(p,s,n);
+  memset(p+n,0,schema.GetField(field-1).length-n);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyEncoder::Done() const
+{
+  return field==schema.GetNumFields() ? ERROR_NOERROR : ERROR_SIZE;
+}
+
+
+BTreeKeyDecoder::BTreeKeyDecoder(const BTreeKeySchema &s, const KEY_T &k) :
+  schema(s), key(k), field(0), offset(0)
+{}
+
+
+// The next field's n bytes, with zeros for any past the end of the key
+ERROR_T BTreeKeyDecoder::Next(const SIZE_T type, BYTE_T *p, const SIZE_T n)
+{
+  if (field==schema.GetNumFields() || schema.GetField(field).type!=type) {
+    return ERROR_SIZE;
+  }
+  for (SIZE_T i=0;i<n;i++) {
+    p[i] = offset+i<key.length ? key.data[offset+i] : 0;
+  }
+  offset+=n;
+  field++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyDecoder::GetUInt32(uint32_t &v)
+{
+  BYTE_T buf[4];
+  ERROR_T rc=Next(BTREE_KEY_UINT32,buf,4);
+  if (rc) { return rc; }
+  v=(uint32_t)GetBigEndian(buf,4);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyDecoder::GetUInt64(uint64_t &v)
+{
+  BYTE_T buf[8];
+  ERROR_T rc=Next(BTREE_KEY_UINT64,buf,8);
+  if (rc) { return rc; }
+  v=GetBigEndian(buf,8);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyDecoder::GetInt64(int64_t &v)
+{
+  BYTE_T buf[8];
+  ERROR_T rc=Next(BTREE_KEY_INT64,buf,8);
+  if (rc) { return rc; }
+  v=(int64_t)(GetBigEndian(buf,8)^BTREE_KEY_SIGNBIT);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeKeyDecoder::GetString(string &s)
+{
+  if (field==schema.GetNumFields()) {
+    return ERROR_SIZE;
+  }
+  SIZE_T n=schema.GetField(field).length;
+  vector<BYTE_T> buf(n);
+  ERROR_T rc=Next(BTREE_KEY_STRING,&(buf[0]),n);
+  if (rc) { return rc; }
+  while (n>0 && buf[n-1]==0) {
+    n--;
+  }
+  s.assign((const char *)&(buf[0]),n);
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,140 @@
+#ifndef _btree_keys
+#define _btree_keys
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "global.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+// Types of the fields of a typed key
+#define BTREE_KEY_UINT32 1
+#define BTREE_KEY_UINT64 2
+#define BTREE_KEY_INT64 3
+#define BTREE_KEY_STRING 4  // a fixed number of bytes, padded with zeros
+
+// So that a schema always fits in a superblock
+#define BTREE_KEY_MAXFIELDS 16
+
+struct BTreeKeyField {
+  SIZE_T type;
+  SIZE_T length;
+};
+
+//
+// The layout of a typed key: a tuple of fields, each stored in turn in
+// a form whose memcmp order is the order of its values.  Integers are
+// stored big endian, an int64 with its sign bit flipped, and a string
+// is its bytes padded out with zeros.  Keys then compare as tuples,
+// field by field, using the same byte compares the nodes always have:
+// a uint64 key is a single word compare (keysearch.h, btree_fixed.h),
+// where the same number formatted as text is 20 bytes of memcmp.
+//
+// An index created with a schema (BTreeIndex's schema constructor)
+// keeps it in its superblock, and has it again after Attach.
+//
+class BTreeKeySchema {
+ private:
+  vector<BTreeKeyField> fields;
+  SIZE_T                keysize;
+
+ public:
+  BTreeKeySchema();
+
+  // Add a field after the others; length is only for strings.
+  // return ERROR_SIZE if there are already BTREE_KEY_MAXFIELDS, or
+  // a string has no length
+  ERROR_T Add(const SIZE_T type, const SIZE_T length=0);
+
+  // Fields from text such as "u32,i64,s12" (uint32, int64 and a 12
+  // byte string); u64 is a uint64.
+  // return ERROR_BADCONFIG if the text is not a schema
+  ERROR_T Parse(const char *text);
+
+  bool    Empty() const { return fields.empty(); }
+  SIZE_T  GetNumFields() const { return fields.size(); }
+  const BTreeKeyField &GetField(const SIZE_T i) const { return fields[i]; }
+  SIZE_T  GetKeySize() const { return keysize; }
+
+  // The schema as the superblock keeps it.  Loading what an older
+  // index's superblock holds (no magic number) gives no schema.
+  SIZE_T  GetStoredSize() const;
+  void    Store(BYTE_T *buf) const;
+  // return ERROR_INSANE if buf does not hold a schema
+  ERROR_T Load(const BYTE_T *buf, const SIZE_T n);
+
+  // A key from text, its fields separated by commas, and back.  Keys
+  // shorter than the schema's (a slotted index's keys, with their
+  // trailing zeros trimmed) print as though filled out with zeros.
+  // return ERROR_SIZE if the text does not fit the schema
+  ERROR_T ParseKey(const char *text, KEY_T &key) const;
+  ostream &PrintKey(ostream &os, const KEY_T &key) const;
+
+  ostream &Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const BTreeKeySchema &s) { return s.Print(os); }
+
+
+//
+// Builds a key of a schema in place, field by field, in order:
+//
+//   BTreeKeyEncoder enc(schema,key);
+//   if ((rc=enc.PutUInt32(region)) || (rc=enc.PutString(name)) ||
+//       (rc=enc.Done())) { ... }
+//
+// The key is resized only if it is not already the schema's size, so
+// one key reused for many lookups costs a few stores each time.
+// Each Put returns ERROR_SIZE if the next field is not of its type (or
+// the string is too long for it); Done returns ERROR_SIZE if fields
+// are missing.
+//
+class BTreeKeyEncoder {
+ private:
+  const BTreeKeySchema &schema;
+  KEY_T                &key;
+  SIZE_T                field;
+  SIZE_T                offset;
+
+  ERROR_T Next(const SIZE_T type, BYTE_T *&p);
+
+ public:
+  BTreeKeyEncoder(const BTreeKeySchema &schema, KEY_T &key);
+
+  ERROR_T PutUInt32(const uint32_t v);
+  ERROR_T PutUInt64(const uint64_t v);
+  ERROR_T PutInt64(const int64_t v);
+  ERROR_T PutString(const char *s);
+  ERROR_T PutString(const char *s, const SIZE_T n);
+  ERROR_T Done() const;
+};
+
+
+//
+// Takes a key of a schema apart again, field by field, in order.
+// GetString gives the string without its padding.  Each Get returns
+// ERROR_SIZE if the next field is not of its type.
+//
+class BTreeKeyDecoder {
+ private:
+  const BTreeKeySchema &schema;
+  const KEY_T          &key;
+  SIZE_T                field;
+  SIZE_T                offset;
+
+  ERROR_T Next(const SIZE_T type, BYTE_T *p, const SIZE_T n);
+
+ public:
+  BTreeKeyDecoder(const BTreeKeySchema &schema, const KEY_T &key);
+
+  ERROR_T GetUInt32(uint32_t &v);
+  ERROR_T GetUInt64(uint64_t &v);
+  ERROR_T GetInt64(int64_t &v);
+  ERROR_T GetString(string &s);
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "btree_latch.h"
+
+
+BTreeLatches::BTreeLatches() :
+  nodes(0), numblocks(0)
+{
+  pthread_rwlock_init(&tree,0);
+  pthread_mutex_init(&alloc,0);
+}
+
+
+BTreeLatches::~BTreeLatches()
+{
+  Init(0);
+  pthread_rwlock_destroy(&tree);
+  pthread_mutex_destroy(&alloc);
+}
+
+
+void BTreeLatches::Init(const SIZE_T n)
+{
+  for (SIZE_T i=0;i<numblocks;i++) {
+    pthread_rwlock_destroy(&nodes[i]);
+  }
+  delete [] nodes;
+  nodes=0;
+  numblocks=0;
+
+  if (n>0) {
+    nodes=new pthread_rwlock_t[n];
+    for (SIZE_T i=0;i<n;i++) {
+      pthread_rwlock_init(&nodes[i],0);
+    }
+    numblocks=n;
+  }
+}
+
+
+void BTreeLatches::LatchTree(const bool excl)
+{
+  if (!numblocks) {
+    return;
+  }
+  if (excl) {
+    pthread_rwlock_wrlock(&tree);
+  } else {
+    pthread_rwlock_rdlock(&tree);
+  }
+}
+
+
+void BTreeLatches::UnlatchTree()
+{
+  if (!numblocks) {
+    return;
+  }
+  pthread_rwlock_unlock(&tree);
+}
+
+
+void BTreeLatches::Latch(const SIZE_T block, const bool excl)
+{
+  if (block<numblocks) {
+    if (excl) {
+      pthread_rwlock_wrlock(&nodes[block]);
+    } else {
+      pthread_rwlock_rdlock(&nodes[block]);
+    }
+  }
+}
+
+
+void BTreeLatches::Unlatch(const SIZE_T block)
+{
+  if (block<numblocks) {
+    pthread_rwlock_unlock(&nodes[block]);
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef _btree_latch
+#define _btree_latch
+
+#include <pthread.h>
+
+#include "global.h"
+
+//
+// What lets several threads use one index at once
+// (BTreeIndex::SetConcurrent).
+//
+// A reader/writer latch for each block lets lookups and inserts
+// descend side by side, latching each child before letting go of its
+// parent.  An insert latches only the leaf it changes.  One whose
+// leaf has to split is made again with the tree latched exclusively,
+// so no node splits, and the root never changes, under a descent.
+//
+// The tree latch is taken shared by lookups and inserts, and
+// exclusively by everything else.  The allocation latch covers the
+// free blocks and the high water mark, and is not held while waiting
+// for a node.
+//
+// Without Init, or after Init(0), every latch is a no-op.
+//
+class BTreeLatches {
+ private:
+  pthread_rwlock_t   tree;
+  pthread_mutex_t    alloc;
+  pthread_rwlock_t  *nodes;
+  SIZE_T             numblocks;
+
+  // not copyable
+  BTreeLatches(const BTreeLatches &rhs);
+  BTreeLatches & operator=(const BTreeLatches &rhs);
+
+ public:
+  BTreeLatches();
+  ~BTreeLatches();
+
+  // Latches for blocks [0,numblocks); zero turns latching off
+  void Init(const SIZE_T numblocks);
+  bool Enabled() const { return numblocks>0; }
+
+  void LatchTree(const bool exclusive);
+  void UnlatchTree();
+
+  void Latch(const SIZE_T block, const bool exclusive);
+  void Unlatch(const SIZE_T block);
+
+  void LockAlloc()   { if (numblocks) { pthread_mutex_lock(&alloc); } }
+  void UnlockAlloc() { if (numblocks) { pthread_mutex_unlock(&alloc); } }
+};
+
+
+// Holds the tree latch for its lifetime
+class BTreeTreeLatch {
+ private:
+  BTreeLatches &latches;
+ public:
+  BTreeTreeLatch(BTreeLatches &l, const bool exclusive) : latches(l) { latches.LatchTree(exclusive); }
+  ~BTreeTreeLatch() { latches.UnlatchTree(); }
+};
+
+#endif
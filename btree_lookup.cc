@@ -41,7 +41,11 @@ int main(int argc, char **argv)
   } else {
     cerr << "Index attached!"<<endl;
     VALUE_T val;
-    if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
+    // typed keys are given as their fields, separated by commas
+    KEY_T k(key);
+    if (!btree.GetKeySchema().Empty() && (rc=btree.GetKeySchema().ParseKey(key,k))!=ERROR_NOERROR) { 
+      cerr <<"Key does not fit the index's schema ("<<btree.GetKeySchema()<<")\n";
+    } else if ((rc=btree.Lookup(k,val))!=ERROR_NOERROR) { 
       cerr <<"Lookup failed: error "<<rc<<endl;
     } else {
       cerr <<"Lookup succeeded\n";
@@ -1,5 +1,55 @@
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
 #include "buffercache.h"
 
+// lsn of a frame dirtied by the operation in progress
+#define LSN_UNCOMMITTED (~0ULL)
+
+
+// Holds the mutex of a thread safe cache, if it is one, for the rest
+// of a call.  The mutex is recursive, since calls nest (Detach
+// commits, and a commit may checkpoint).
+class CacheLock {
+ private:
+  pthread_mutex_t *mutex;
+ public:
+  CacheLock(pthread_mutex_t *m) : mutex(m) { if (mutex) { pthread_mutex_lock(mutex); } }
+  ~CacheLock() { if (mutex) { pthread_mutex_unlock(mutex); } }
+};
+
+
+//
+// Write a dirty frame back to disk.  With a log, the log must first
+// be durable up to the last commit that covered this block.
+//
+ERROR_T BufferCache::WriteBack(const SIZE_T blocknum, Block &frame)
+{
+  if (!frame.dirty) { 
+    return ERROR_NOERROR;
+  }
+
+  if (wal) { 
+    int rc=wal->ForceTo(frame.lsn);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  double reqtime;
+  int rc=disk->Write(blocknum,frame,reqtime);
+  curtime+=reqtime;
+  diskwrites++;
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  frame.dirty=false;
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BufferCache::CheckDeleteOldest()
 {
   // In a real buffer cache, we would use a priority queue to make this O(1)
@@ -12,12 +62,16 @@ ERROR_T BufferCache::CheckDeleteOldest()
     return ERROR_NOERROR;
   }
 
-  // Find oldest
+  // Find oldest.  Blocks changed by an uncommitted operation must not
+  // reach the disk (there is no undo), and pinned blocks are in use,
+  // so they are passed over, and if nothing else is left the cache
+  // temporarily grows.
 
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
+       if ((*i).second.lastaccessed<oldest && (*i).second.lsn!=LSN_UNCOMMITTED &&
+	   (*i).second.pins==0) { 
 	 oldestptr=i;
 	 oldest=(*i).second.lastaccessed;
        }
@@ -26,16 +80,9 @@ ERROR_T BufferCache::CheckDeleteOldest()
   // write and delete it if it exists
  
   if (oldestptr!=blockmap.end()) { 
-    if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
-      }
+    int rc=WriteBack((*oldestptr).first,(*oldestptr).second);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
     }
     blockmap.erase(oldestptr);
   }
@@ -46,7 +93,8 @@ BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
    disk(d), cachesize(cs), curtime(0),
    allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
+   diskreads(0), diskwrites(0), readahead(0),
+   wal(0), checkpointbytes(0), checkpoints(0), recovered(0), mutex(0)
 {}
 
 
@@ -55,36 +103,170 @@ BufferCache::~BufferCache()
   if (disk) { 
     Detach();
   }
+  SetThreadSafe(false);
   disk=0; cachesize=0; curtime=0;
 }
 
 ERROR_T BufferCache::Attach()
 {
+  CacheLock lock(mutex);
   blockmap.clear();
+  opblocks.clear();
+  recovered=0;
+
+  if (wal) { 
+    // Redo whatever the last run committed but did not checkpoint
+    double reqtime=0;
+    int rc=wal->Open();
+    if (rc==ERROR_NOERROR) { 
+      rc=wal->Redo(disk,reqtime,recovered);
+    }
+    curtime+=reqtime;
+    if (rc==ERROR_NOERROR) { 
+      rc=disk->Sync();
+    }
+    if (rc==ERROR_NOERROR) { 
+      rc=wal->Truncate();
+    }
+    return rc;
+  }
+
   return ERROR_NOERROR;
 }
 
 ERROR_T BufferCache::Detach()
 {
+  CacheLock lock(mutex);
   // write out all of our data and then throw it away
 
+  if (wal) { 
+    int rc=Commit();
+    if (rc==ERROR_NOERROR) { 
+      rc=Checkpoint();
+    }
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+	 i!=blockmap.end();
+	 ++i) {
+    int rc=WriteBack((*i).first,(*i).second);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  blockmap.clear();
+  return disk->SyncBitMap();
+}
+
+
+void BufferCache::SetLog(WriteAheadLog *log, const SIZE_T checkpointlogbytes)
+{
+  wal=log;
+  checkpointbytes=checkpointlogbytes;
+}
+
+
+//
+// Log the after-images of everything the current operation dirtied,
+// then a commit record.  The blocks themselves stay dirty in the
+// cache; the log is what makes them durable.
+//
+ERROR_T BufferCache::Commit()
+{
+  CacheLock lock(mutex);
+  LSN_T lsn;
+  int rc;
+
+  if (!wal || opblocks.empty()) { 
+    return ERROR_NOERROR;
+  }
+
+  for (SIZE_T i=0;i<opblocks.size();i++) { 
+    Block &frame=blockmap[opblocks[i]];
+    rc=wal->LogBlock(opblocks[i],frame.data,frame.length);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  rc=wal->Commit(lsn);
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  for (SIZE_T i=0;i<opblocks.size();i++) { 
+    blockmap[opblocks[i]].lsn=lsn;
+  }
+  opblocks.clear();
+
+  return ERROR_NOERROR;
+}
+
+
+bool BufferCache::CheckpointDue() const
+{
+  return wal && checkpointbytes && wal->GetLSN()>=checkpointbytes;
+}
+
+
+//
+// Write back every committed dirty block, make the disk durable, and
+// then the log is no longer needed.
+//
+ERROR_T BufferCache::Checkpoint()
+{
+  CacheLock lock(mutex);
+  int rc;
+
+  if (!wal) { 
+    return ERROR_NOERROR;
+  }
+
+  rc=wal->Force();
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
-    if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+    if ((*i).second.lsn!=LSN_UNCOMMITTED) { 
+      rc=WriteBack((*i).first,(*i).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
   }
-  blockmap.clear();
-  return ERROR_NOERROR;
+
+  rc=disk->Sync();
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  checkpoints++;
+
+  // Uncommitted blocks are not in the log yet, so nothing is lost
+  return wal->Truncate();
+}
+
+
+void BufferCache::SetThreadSafe(const bool threadsafe)
+{
+  if (threadsafe && !mutex) { 
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    mutex=new pthread_mutex_t;
+    pthread_mutex_init(mutex,&attr);
+    pthread_mutexattr_destroy(&attr);
+  } else if (!threadsafe && mutex) { 
+    pthread_mutex_destroy(mutex);
+    delete mutex;
+    mutex=0;
+  }
 }
 
 
@@ -106,17 +288,20 @@ SIZE_T BufferCache::GetNumBlocks() const
 
 double BufferCache::GetCurrentTime() const
 {
+  CacheLock lock(mutex);
   return curtime;
 }
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  CacheLock lock(mutex);
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  CacheLock lock(mutex);
   deallocs++;
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
@@ -124,12 +309,93 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  CacheLock lock(mutex);
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
+//
+// Read blocknum, and up to maxblocks-1 blocks following it, straight
+// into new cache frames with one disk request.  The first block is
+// always read; the following ones only while they are on the device
+// and not already cached.  They go into free frames, and with evict,
+// once those run out, into the frames of the least recently used
+// blocks that are clean, unpinned and committed, which cost nothing
+// to drop.  Without evict, or when there are no more such frames,
+// the run stops short.
+//
+ERROR_T BufferCache::FetchBlocks(const SIZE_T blocknum, const SIZE_T maxblocks, const bool evict)
+{
+  SIZE_T room = blockmap.size()<cachesize ? cachesize-blockmap.size() : 0;
+  SIZE_T n=1;
+
+  while (n<maxblocks && 
+	 blocknum+n<GetNumBlocks() &&
+	 blockmap.find(blocknum+n)==blockmap.end()) { 
+    n++;
+  }
+
+  if (n>room && n>1) { 
+    // Oldest droppable frames first
+    vector<pair<double, SIZE_T> > victims;
+    if (evict) { 
+      for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+	   i!=blockmap.end();
+	   ++i) {
+	if (!(*i).second.dirty && (*i).second.pins==0 && (*i).second.lsn!=LSN_UNCOMMITTED) { 
+	  victims.push_back(make_pair((*i).second.lastaccessed,(*i).first));
+	}
+      }
+    }
+    // The first block has room already (CheckDeleteOldest)
+    SIZE_T need=n-(room ? room : 1);
+    if (victims.size()<need) { 
+      n-=need-victims.size();
+      need=victims.size();
+    }
+    partial_sort(victims.begin(),victims.begin()+need,victims.end());
+    for (SIZE_T i=0;i<need;i++) { 
+      blockmap.erase(victims[i].second);
+    }
+  }
+
+  if (iobufs.size()<n) { 
+    iobufs.resize(n);
+  }
+
+  for (SIZE_T i=0;i<n;i++) { 
+    Block &frame=blockmap[blocknum+i];
+    if (frame.Resize(GetBlockSize(),false)!=ERROR_NOERROR) { 
+      for (SIZE_T j=0;j<=i;j++) { 
+	blockmap.erase(blocknum+j);
+      }
+      return ERROR_NOMEM;
+    }
+    iobufs[i]=frame.data;
+  }
+
+  double reqtime;
+  int rc = disk->Read(blocknum,n,&(iobufs[0]),reqtime);
+  curtime+=reqtime;
+  diskreads++;
+
+  for (SIZE_T i=0;i<n;i++) { 
+    if (rc!=ERROR_NOERROR) { 
+      blockmap.erase(blocknum+i);
+    } else {
+      Block &frame=blockmap[blocknum+i];
+      frame.lastaccessed=curtime;
+      frame.dirty=false;
+    }
+  }
+
+  return rc;
+}
+
+
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
+  CacheLock lock(mutex);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
   b = blockmap.find(inblocknum);
@@ -149,35 +415,50 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
 	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
       }
     }
-    double reqtime;
-    int rc = disk->Read(inblocknum,
-			outblock,
-			reqtime);
-    curtime+=reqtime;
-    diskreads++;
+    int rc = FetchBlocks(inblocknum,1+readahead,true);
     if (rc!=ERROR_NOERROR) { 
       return rc;
     } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
+      outblock=blockmap[inblocknum];
       reads++;
       return ERROR_NOERROR;
     }
   }
 } 
  
+// With a log, remember the blocks the current operation has changed
+void BufferCache::NoteDirty(const SIZE_T blocknum, Block &frame)
+{
+  if (wal && frame.lsn!=LSN_UNCOMMITTED) { 
+    frame.lsn=LSN_UNCOMMITTED;
+    opblocks.push_back(blocknum);
+  }
+}
+
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
+  CacheLock lock(mutex);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(inblocknum);
 
   if (b!=blockmap.end()) {
-    // It's in  cache, so just replace the block
-    (*b).second=inblock;
-    (*b).second.lastaccessed=curtime;
-    (*b).second.dirty=true;
+    // It's in  cache, so just replace the contents; the frame stays
+    // where it is, since it may be pinned
+    Block &frame=(*b).second;
+    if (frame.length==inblock.length) { 
+      memcpy(frame.data,inblock.data,inblock.length);
+    } else {
+      LSN_T lsn=frame.lsn;
+      SIZE_T pins=frame.pins;
+      assert(pins==0);
+      frame=inblock;
+      frame.lsn=lsn;
+      frame.pins=pins;
+    }
+    frame.lastaccessed=curtime;
+    frame.dirty=true;
+    NoteDirty(inblocknum,frame);
     writes++;
     return ERROR_NOERROR;
   } else {
@@ -188,49 +469,174 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
-    Block myblock=inblock;
-    myblock.lastaccessed=curtime;
-    myblock.dirty=true;
-    blockmap[inblocknum]=myblock;
+    Block &frame=blockmap[inblocknum];
+    frame=inblock;
+    frame.lastaccessed=curtime;
+    frame.dirty=true;
+    frame.lsn=0;
+    NoteDirty(inblocknum,frame);
     writes++;
     return ERROR_NOERROR;
   }
 }
   
+ERROR_T BufferCache::WriteBlocks(const SIZE_T blocknum, const SIZE_T numblocks, const BYTE_T * const bufs[])
+{
+  CacheLock lock(mutex);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  for (SIZE_T i=0;i<numblocks;i++) { 
+    b = blockmap.find(blocknum+i);
+    if (b!=blockmap.end()) { 
+      if ((*b).second.pins>0 || (*b).second.lsn==LSN_UNCOMMITTED) { 
+	return ERROR_CONFLICT;
+      }
+      blockmap.erase(b);
+    }
+  }
+
+  double reqtime;
+  int rc=disk->Write(blocknum,numblocks,bufs,reqtime);
+  curtime+=reqtime;
+  diskwrites++;
+  writes+=numblocks;
+  return rc;
+}
+
+
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  return PrefetchBlocks(blocknum,1);
+}
+
+ERROR_T BufferCache::PrefetchBlocks (const SIZE_T blocknum, const SIZE_T numblocks)
+{
+  CacheLock lock(mutex);
+  SIZE_T first=blocknum;
+
+  if (blocknum+numblocks > GetNumBlocks()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+
+  // skip what we already have
+  while (first<blocknum+numblocks && blockmap.find(first)!=blockmap.end()) { 
+    first++;
+  }
+
+  if (first==blocknum+numblocks) { 
+    return ERROR_NOERROR;
+  }
+
+  // Prefetching never evicts
+  if (blockmap.size()>=cachesize) { 
+    return ERROR_NOFETCH;
+  }
+
+  return FetchBlocks(first,blocknum+numblocks-first,false);
 }
   
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
+  CacheLock lock(mutex);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(blocknum);
 
   if (b==blockmap.end()) { 
     return ERROR_NOERROR;
+  } else if ((*b).second.lsn==LSN_UNCOMMITTED) { 
+    // Can't reach the disk before its operation commits
+    return ERROR_CONFLICT;
   } else {
-    if ((*b).second.dirty) { 
-      double reqtime;
-      int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+    int rc=WriteBack((*b).first,(*b).second);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    // a pinned block is written but stays
+    if ((*b).second.pins==0) { 
+      blockmap.erase(b);
+    }
+    return ERROR_NOERROR;
+  }
+}
+
+
+ERROR_T BufferCache::PinBlock(const SIZE_T blocknum, BYTE_T *&data, const bool fresh)
+{
+  CacheLock lock(mutex);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end()) { 
+    CheckDeleteOldest();
+    if (fresh) { 
+      // No need to read what is about to be overwritten
+      Block &frame=blockmap[blocknum];
+      if (frame.Resize(GetBlockSize(),false)!=ERROR_NOERROR) { 
+	blockmap.erase(blocknum);
+	return ERROR_NOMEM;
+      }
+      memset(frame.data,0,frame.length);
+      frame.lsn=0;
+    } else {
+      if (!(disk->IsBlockAllocated(blocknum))) { 
+	if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	  cerr << "BufferCache::PinBlock: Attempt to read unallocated block " << blocknum<<endl;
+	}
+      }
+      int rc = FetchBlocks(blocknum,1+readahead,true);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
-    blockmap.erase(b);
-    return ERROR_NOERROR;
+    b = blockmap.find(blocknum);
+  }
+
+  Block &frame=(*b).second;
+  frame.lastaccessed=curtime;
+  frame.pins++;
+  data=frame.data;
+  reads++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::UnpinBlock(const SIZE_T blocknum)
+{
+  CacheLock lock(mutex);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end() || (*b).second.pins==0) { 
+    return ERROR_IMPLBUG;
   }
+  (*b).second.pins--;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::MarkDirty(const SIZE_T blocknum)
+{
+  CacheLock lock(mutex);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end()) { 
+    return ERROR_IMPLBUG;
+  }
+  (*b).second.lastaccessed=curtime;
+  (*b).second.dirty=true;
+  NoteDirty(blocknum,(*b).second);
+  writes++;
+  return ERROR_NOERROR;
 }
   
 ostream & BufferCache::Print(ostream &os) const
 {
+  CacheLock lock(mutex);
   os << "BufferCache(cachesize="<<cachesize
      << ", blocksize="<<GetBlockSize()
      << ", curtime="<<curtime
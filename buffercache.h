@@ -1,12 +1,16 @@
 #ifndef _buffercache
 #define _buffercache
 
+#include <pthread.h>
+
 #include <iostream>
 #include <map>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "wal.h"
 
 using namespace std;
 
@@ -18,7 +22,7 @@ struct cache_compare_lessthan {
 
 
 //
-// LRU block cache with single step prefetch
+// LRU block cache with optional readahead on misses
 //
 // Write Back
 // Write Allocate
@@ -29,8 +33,23 @@ class BufferCache {
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
   double curtime;
   SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  SIZE_T readahead;
+  // frame pointers for vectored disk reads, grows to the readahead window
+  vector<BYTE_T *> iobufs;
+  // optional write-ahead log, and the blocks the current operation
+  // has dirtied, which are logged when it commits
+  WriteAheadLog *wal;
+  vector<SIZE_T> opblocks;
+  LSN_T checkpointbytes;
+  SIZE_T checkpoints;
+  SIZE_T recovered;
+  // recursive, and only there once SetThreadSafe(true)
+  pthread_mutex_t *mutex;
  protected:
   ERROR_T CheckDeleteOldest();
+  ERROR_T WriteBack(const SIZE_T blocknum, Block &frame);
+  void    NoteDirty(const SIZE_T blocknum, Block &frame);
+  ERROR_T FetchBlocks(const SIZE_T blocknum, const SIZE_T maxblocks, const bool evict);
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -45,6 +64,40 @@ class BufferCache {
   ERROR_T Attach();
   ERROR_T Detach();
 
+  //
+  // Write-ahead logging (optional, set before Attach).  
+  //
+  // Writes between two Commits form one atomic, durable operation.
+  // At Commit the images of the blocks it wrote go to the log, and
+  // the blocks stay dirty in the cache; they are written back lazily,
+  // after the log is forced, and are never evicted before their 
+  // operation commits.  Attach redoes whatever the log holds.  
+  // A checkpoint writes back all dirty blocks and empties the log; it
+  // happens at Detach, and whoever commits checkpoints once the log
+  // has grown past checkpointbytes (CheckpointDue; 0 means only at
+  // Detach), so that it can write out first whatever the checkpoint
+  // must find on disk.  Without a log, Commit and Checkpoint do
+  // nothing.  The disk's allocation bitmap is written at checkpoints
+  // too, so after Attach has redone any blocks
+  // (GetNumRecoveredBlocks) it may be behind what they hold.
+  //
+  void    SetLog(WriteAheadLog *log, const SIZE_T checkpointbytes=0);
+  bool    HasLog() const { return wal!=0; }
+  ERROR_T Commit();
+  bool    CheckpointDue() const;
+  ERROR_T Checkpoint();
+
+  //
+  // With thread safety on, each call holds a mutex while it runs, so
+  // several threads can share the cache.  A block a thread has pinned
+  // stays where it is, as always, and the cache does not stop two
+  // threads from changing it at once; that is up to them (see
+  // BTreeLatches).  Off by default, when it costs nothing.  Set it
+  // while no other thread is using the cache.
+  //
+  void    SetThreadSafe(const bool threadsafe);
+  bool    GetThreadSafe() const { return mutex!=0; }
+
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
   // Number of bytes per block
@@ -70,16 +123,50 @@ class BufferCache {
   // ERROR_NOSUCHBLOCK
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
+
+  // Write a run of blocks straight to the disk, around the cache, in
+  // a single request; block i comes from bufs[i].  Cached copies are
+  // dropped.  These writes are not logged, so with a log they are
+  // only durable after the next Checkpoint, and nothing committed
+  // before then may refer to them.
+  // ERROR_CONFLICT if one of the blocks is pinned or uncommitted
+  ERROR_T WriteBlocks(const SIZE_T blocknum, const SIZE_T numblocks, const BYTE_T * const bufs[]);
   
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
+
+  // Same, for a run of blocks.  The uncached part of the run that
+  // fits in the free space of the cache is read in a single request.
+  ERROR_T PrefetchBlocks (const SIZE_T blocknum, const SIZE_T numblocks);
+
+  // Number of following blocks that a read miss also brings in,
+  // as part of the same disk request, when they are not yet cached.
+  // Once the cache is full they take the frames of the least recently
+  // used clean blocks, never dirty or pinned ones.  Zero (the
+  // default) disables it.
+  void   SetReadAhead(const SIZE_T numblocks) { readahead=numblocks; }
+  SIZE_T GetReadAhead() const { return readahead; }
   
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+
+  //
+  // Access to a block in place, in its cache frame, without copying.
+  //
+  // PinBlock brings the block in (like ReadBlock) and returns its
+  // frame's data, which stays where it is and is not evicted until
+  // the matching UnpinBlock.  Pins nest.  With fresh=true a block
+  // that is not cached is not read but starts out zeroed, for blocks
+  // that have just been allocated.  Changes made through the pointer
+  // are reported with MarkDirty while the block is pinned.
+  //
+  ERROR_T PinBlock(const SIZE_T blocknum, BYTE_T *&data, const bool fresh=false);
+  ERROR_T UnpinBlock(const SIZE_T blocknum);
+  ERROR_T MarkDirty(const SIZE_T blocknum);
   
  
   SIZE_T GetNumAllocs() const { return allocs; }
@@ -88,6 +175,8 @@ class BufferCache {
   SIZE_T GetNumWrites() const { return writes;}
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  SIZE_T GetNumCheckpoints() const { return checkpoints;}
+  SIZE_T GetNumRecoveredBlocks() const { return recovered;}
 
   ostream & Print(ostream &os) const;
   
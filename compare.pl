@@ -15,12 +15,45 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
   $ref=<REF>; chomp($ref);
   $test=<TEST>; chomp($test);
   
-  if ($cmd =~ /DISPLAY/) { 
+  if ($cmd =~ /^SCAN/) { 
+    # SCAN spans multiple lines too, and the keys must come out in
+    # order, so they are compared line by line
+    @refscan=();
+    while (1) {
+      $disp=<REF>; chomp($disp);
+      last if $disp=~/END SCAN/;
+      $disp=~s/\s//g;
+      push @refscan, $disp;
+    }
+    @testscan=();
+    while (1) {
+      $disp=<TEST>; chomp($disp);
+      last if $disp=~/END SCAN/;
+      $disp=~s/\s//g;
+      push @testscan, $disp;
+    }
+    $sawerror=0;
+    for ($j=0; $j<=$#refscan || $j<=$#testscan; $j++) { 
+      $r = $j<=$#refscan ? $refscan[$j] : "nothing";
+      $t = $j<=$#testscan ? $testscan[$j] : "nothing";
+      if ($r ne $t) { 
+	print "----------------------------------------------------------------------------\n";
+	print "ERROR $numerr found on operation $i\n\n";
+	print "Operation is \"$cmd\"\n\n";
+	print "Reference implementation has $r at position $j\n";
+	print "Test implementation has      $t at position $j\n";
+	print "----------------------------------------------------------------------------\n";
+	$sawerror=1;
+	last;
+      }
+    }
+    $numerr++ if $sawerror;
+  } elsif ($cmd =~ /DISPLAY/) { 
     # DISPLAY is a special case since it
     # spans multiple output lines, each of which needs to be checked.
     # it must be the case that both implementations found this was OK.
 
-    undef %refcontent if defined(%refcontent);
+    %refcontent=();
     while (1) {
       $disp=<REF>; chomp($disp);
       last if $disp=~/END DISPLAY/;
@@ -28,7 +61,7 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
       $refcontent{$1}=$2;
     }
       
-    undef %testcontent if defined(%testcontent);
+    %testcontent=();
     while (1) {
       $disp=<TEST>; chomp($disp);
       last if $disp=~/END DISPLAY/;
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "crc32c.h"
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crctable[8][256];
+static bool     crcinited=false;
+static bool     crchardware=false;
+static bool     crcforcesoftware=false;
+
+
+static void CRC32CInit()
+{
+  for (uint32_t i=0;i<256;i++) { 
+    uint32_t c=i;
+    for (int k=0;k<8;k++) { 
+      c = (c&1) ? (c>>1)^CRC32C_POLY : c>>1;
+    }
+    crctable[0][i]=c;
+  }
+  for (uint32_t i=0;i<256;i++) { 
+    for (int t=1;t<8;t++) { 
+      crctable[t][i] = (crctable[t-1][i]>>8) ^ crctable[0][crctable[t-1][i]&0xff];
+    }
+  }
+#ifdef CRC32C_X86
+  __builtin_cpu_init();
+  crchardware = __builtin_cpu_supports("sse4.2");
+#endif
+  crcinited=true;
+}
+
+
+static uint32_t CRC32CSoftware(uint32_t crc, const BYTE_T *p, size_t len)
+{
+  while (len && ((uintptr_t)p & 7)) { 
+    crc = crctable[0][(crc^*p++)&0xff] ^ (crc>>8);
+    len--;
+  }
+  while (len>=8) { 
+    uint32_t lo, hi;
+    memcpy(&lo,p,4);
+    memcpy(&hi,p+4,4);
+    // assumes little endian, as the hardware path does
+    lo^=crc;
+    crc = crctable[7][lo&0xff] ^ crctable[6][(lo>>8)&0xff] ^
+          crctable[5][(lo>>16)&0xff] ^ crctable[4][lo>>24] ^
+          crctable[3][hi&0xff] ^ crctable[2][(hi>>8)&0xff] ^
+          crctable[1][(hi>>16)&0xff] ^ crctable[0][hi>>24];
+    p+=8;
+    len-=8;
+  }
+  while (len) { 
+    crc = crctable[0][(crc^*p++)&0xff] ^ (crc>>8);
+    len--;
+  }
+  return crc;
+}
+
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t CRC32CHardware(uint32_t crc, const BYTE_T *p, size_t len)
+{
+  while (len && ((uintptr_t)p & 7)) { 
+    crc = _mm_crc32_u8(crc,*p++);
+    len--;
+  }
+#ifdef __x86_64__
+  uint64_t c=crc;
+  while (len>=8) { 
+    uint64_t v;
+    memcpy(&v,p,8);
+    c = _mm_crc32_u64(c,v);
+    p+=8;
+    len-=8;
+  }
+  crc=(uint32_t)c;
+#endif
+  while (len>=4) { 
+    uint32_t v;
+    memcpy(&v,p,4);
+    crc = _mm_crc32_u32(crc,v);
+    p+=4;
+    len-=4;
+  }
+  while (len) { 
+    crc = _mm_crc32_u8(crc,*p++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+
+unsigned int CRC32CExtend(const unsigned int crc, const void *buf, const size_t len)
+{
+  if (!crcinited) { 
+    CRC32CInit();
+  }
+#ifdef CRC32C_X86
+  if (crchardware && !crcforcesoftware) { 
+    return ~CRC32CHardware(~crc,(const BYTE_T*)buf,len);
+  }
+#endif
+  return ~CRC32CSoftware(~crc,(const BYTE_T*)buf,len);
+}
+
+
+unsigned int CRC32C(const void *buf, const size_t len)
+{
+  return CRC32CExtend(0,buf,len);
+}
+
+
+bool CRC32CIsHardware()
+{
+  if (!crcinited) { 
+    CRC32CInit();
+  }
+  return crchardware && !crcforcesoftware;
+}
+
+
+void CRC32CForceSoftware(const bool force)
+{
+  crcforcesoftware=force;
+}
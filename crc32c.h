@@ -0,0 +1,27 @@
+#ifndef _crc32c
+#define _crc32c
+
+#include <stddef.h>
+
+#include "global.h"
+
+//
+// CRC32C (Castagnoli), as used for block checksums.
+//
+// Uses the SSE4.2 crc32 instruction when the processor has it, 
+// and a slicing-by-8 table otherwise.  The choice is made at run
+// time on first use.
+//
+unsigned int CRC32C(const void *buf, const size_t len);
+
+// Continue a checksum: CRC32C(a+b) == CRC32CExtend(CRC32C(a),b)
+unsigned int CRC32CExtend(const unsigned int crc, const void *buf, const size_t len);
+
+// true if the hardware instruction is being used
+bool CRC32CIsHardware();
+
+// Force the table implementation (for comparison) or go back to 
+// the default choice
+void CRC32CForceSoftware(const bool force);
+
+#endif
@@ -1,6 +1,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -8,6 +11,7 @@
 #include <math.h>
 
 #include "disksystem.h"
+#include "crc32c.h"
 
 
 static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int len)
@@ -71,6 +75,75 @@ static SIZE_T myread(FILE *f, const SIZE_T off, BYTE_T *buf, const int len, bool
 }
 
 
+//
+// Positioned scatter/gather helpers for the data file.  Both consume
+// the iovec array they are handed.  Anything past the end of the file
+// has never been written, so it reads back as zeros, just as the
+// truncate-and-retry path in myread would produce.
+//
+static SIZE_T myreadv(int fd, const off_t off, struct iovec *iov, int iovcnt)
+{
+  SIZE_T done=0;
+
+  while (iovcnt>0) {
+    ssize_t got=preadv(fd,iov,iovcnt,off+done);
+    if (got<0) {
+      if (errno==EINTR) {
+	continue;
+      }
+      break;
+    } else if (got==0) {
+      for (int i=0;i<iovcnt;i++) {
+	memset(iov[i].iov_base,0,iov[i].iov_len);
+	done+=iov[i].iov_len;
+      }
+      break;
+    } else {
+      done+=got;
+      while (iovcnt>0 && (size_t)got>=iov->iov_len) {
+	got-=iov->iov_len;
+	iov++;
+	iovcnt--;
+      }
+      if (iovcnt>0) {
+	iov->iov_base=(BYTE_T*)(iov->iov_base)+got;
+	iov->iov_len-=got;
+      }
+    }
+  }
+  return done;
+}
+
+static SIZE_T mywritev(int fd, const off_t off, struct iovec *iov, int iovcnt)
+{
+  SIZE_T done=0;
+
+  while (iovcnt>0) {
+    ssize_t sent=pwritev(fd,iov,iovcnt,off+done);
+    if (sent<0) {
+      if (errno==EINTR) {
+	continue;
+      }
+      break;
+    } else if (sent==0) {
+      break;
+    } else {
+      done+=sent;
+      while (iovcnt>0 && (size_t)sent>=iov->iov_len) {
+	sent-=iov->iov_len;
+	iov++;
+	iovcnt--;
+      }
+      if (iovcnt>0) {
+	iov->iov_base=(BYTE_T*)(iov->iov_base)+sent;
+	iov->iov_len-=sent;
+      }
+    }
+  }
+  return done;
+}
+
+
 DiskSystem::DiskSystem(const string &filestem,
 		       const bool   create,
 		       const SIZE_T offset,
@@ -81,7 +154,9 @@ DiskSystem::DiskSystem(const string &filestem,
 		       const SIZE_T tracks,
 		       const double avgseek,
 		       const double trackseek,
-		       const double rotlat) :
+		       const double rotlat,
+		       const bool checksum,
+		       const bool usefiles) :
   bitmap(0),
   datafilefd(0),
   configfilefd(0),
@@ -97,9 +172,20 @@ DiskSystem::DiskSystem(const string &filestem,
   last_sector(0),
   averageseeklatency(avgseek),
   trackseeklatency(trackseek),
-  rotationallatency(rotlat)
+  rotationallatency(rotlat),
+  checksums(checksum),
+  verifychecksums(true),
+  checksumerrors(0),
+  iov(IOV_MAX),
+  crcs(IOV_MAX/2),
+  bitmapflips(0),
+  bitmapsyncinterval(0),
+  bitmappagewrites(0),
+  statsfilefd(0)
 {
-  if (create) { 
+  if (!usefiles) { 
+    InitWithoutFiles(create);
+  } else if (create) { 
     // Only in this case are the parameters used:
     InitFromInMemoryConfig();
   } else {
@@ -109,11 +195,21 @@ DiskSystem::DiskSystem(const string &filestem,
 
 DiskSystem::~DiskSystem()
 {
-  WriteConfig();
-  WriteBitMap();
-  fclose(configfilefd);
-  fclose(bitmapfilefd);
-  fclose(datafilefd);
+  if (configfilefd) { 
+    WriteConfig();
+    fclose(configfilefd);
+  }
+  if (bitmapfilefd) { 
+    SyncBitMap();
+    fclose(bitmapfilefd);
+  }
+  if (datafilefd) { 
+    fclose(datafilefd);
+  }
+  if (statsfilefd) { 
+    GetTotalStats().Save(statsfilefd);
+    fclose(statsfilefd);
+  }
   delete [] bitmap;
 }
 
@@ -136,7 +232,7 @@ ERROR_T DiskSystem::WriteConfig()
 {
   ftruncate(fileno(configfilefd),0);
   rewind(configfilefd);
-  fprintf(configfilefd,"# disksystem config file version 0.9\n");
+  fprintf(configfilefd,"# disksystem config file version 1.0\n");
   fprintf(configfilefd,"# filestem\n");
   fprintf(configfilefd,"%s\n",diskfilestem.c_str());
   fprintf(configfilefd,"# offset\n");
@@ -157,6 +253,8 @@ ERROR_T DiskSystem::WriteConfig()
   fprintf(configfilefd,"%lf\n",trackseeklatency);
   fprintf(configfilefd,"# rotationalatency\n");
   fprintf(configfilefd,"%lf\n",rotationallatency);
+  fprintf(configfilefd,"# checksums\n");
+  fprintf(configfilefd,"%u\n",checksums);
   fflush(configfilefd);
 
   return ERROR_NOERROR;
@@ -197,6 +295,15 @@ ERROR_T DiskSystem::ReadConfig()
   GETNEXTVAL;
   PARSEDOUBLE(&rotationallatency);
 
+  // Not present in version 0.9 files
+  checksums=0;
+  while (fgets(buf,80,configfilefd)) { 
+    if (buf[0]!='#') { 
+      PARSEUNSIGNED(&checksums);
+      break;
+    }
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -211,6 +318,49 @@ ERROR_T DiskSystem::WriteBitMap()
     cerr << "Can't write bitmap file\n";
     return ERROR_IMPLBUG;
   }
+  fflush(bitmapfilefd);
+
+  bitmapdirty.assign(bitmapdirty.size(),false);
+  bitmapflips=0;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T DiskSystem::SyncBitMap()
+{
+  SIZE_T numbitmapbytes = GetNumBitMapBytes();
+  bool wrote=false;
+
+  if (bitmapfilefd==0) { 
+    // Nowhere to persist it to
+    bitmapdirty.assign(bitmapdirty.size(),false);
+    bitmapflips=0;
+    return ERROR_NOERROR;
+  }
+
+  for (SIZE_T page=0;page<bitmapdirty.size();page++) { 
+    if (!bitmapdirty[page]) { 
+      continue;
+    }
+    SIZE_T start = page*DISKSYSTEM_BITMAP_PAGE_BYTES;
+    SIZE_T len = (numbitmapbytes-start) < DISKSYSTEM_BITMAP_PAGE_BYTES ? (numbitmapbytes-start) : DISKSYSTEM_BITMAP_PAGE_BYTES;
+    if (mywrite(bitmapfilefd,start,bitmap+start,len)!=len) { 
+      cerr << "Can't write bitmap page "<<page<<"\n";
+      return ERROR_IMPLBUG;
+    }
+    bitmapdirty[page]=false;
+    bitmappagewrites++;
+    wrote=true;
+  }
+
+  if (wrote) { 
+    fflush(bitmapfilefd);
+    fdatasync(fileno(bitmapfilefd));
+  }
+
+  bitmapflips=0;
+
   return ERROR_NOERROR;
 }
 
@@ -224,6 +374,8 @@ ERROR_T DiskSystem::ReadBitMap()
 
   bitmap = new BYTE_T [numbitmapbytes];
 
+  bitmapdirty.assign((numbitmapbytes+DISKSYSTEM_BITMAP_PAGE_BYTES-1)/DISKSYSTEM_BITMAP_PAGE_BYTES,false);
+
   if (myread(bitmapfilefd,0,bitmap,numbitmapbytes,false)!=numbitmapbytes) { 
     cerr << "Can't read bitmap file\n";
     return ERROR_IMPLBUG;
@@ -276,7 +428,7 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
-  return ERROR_NOERROR;
+  return OpenStats(false);
 }
 
 
@@ -330,6 +482,8 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 
   memset(bitmap,0,numbitmapbytes);
 
+  bitmapdirty.assign((numbitmapbytes+DISKSYSTEM_BITMAP_PAGE_BYTES-1)/DISKSYSTEM_BITMAP_PAGE_BYTES,false);
+
   // create the bitmap file and write out the bitmap
 
   if (bitmapfilefd) { fclose(bitmapfilefd); }
@@ -362,11 +516,94 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
     }
   }
 
-  return ERROR_NOERROR;
+  // Extend the data file to cover the whole disk without writing
+  // anything, so that it is sparse and creation is O(1).  An existing
+  // file that is already long enough is left alone.
+  off_t datalen = (off_t)offset + (off_t)numblocks*(off_t)GetStoredBlockSize();
+
+  if (fstat(fileno(datafilefd),&s)==-1) { 
+    return ERROR_NOFILE;
+  }
+  if (s.st_size<datalen) { 
+    if (ftruncate(fileno(datafilefd),datalen)) { 
+      cerr << "Can't extend data file\n";
+      return ERROR_NOSPACE;
+    }
+  }
+
+  return OpenStats(true);
+}
+
+
+//
+// The stats file is optional: disks made before it existed simply
+// start counting from zero.
+//
+ERROR_T DiskSystem::OpenStats(const bool create)
+{
+  string statsname = diskfilestem + ".stats";
+
+  if (statsfilefd) { fclose(statsfilefd); }
+
+  stats.Clear();
+  paststats.Clear();
+
+  if (!create && (statsfilefd = fopen(statsname.c_str(),"r+"))!=0) { 
+    return paststats.Load(statsfilefd);
+  }
+
+  if ((statsfilefd = fopen(statsname.c_str(),"w+"))==0) { 
+    return ERROR_NOFILE;
+  }
+
+  return paststats.Save(statsfilefd);
+}
+
+
+DiskStats DiskSystem::GetTotalStats() const
+{
+  DiskStats total=paststats;
+  total.Add(stats);
+  return total;
 }
 
 
 
+
+
+ERROR_T DiskSystem::InitWithoutFiles(const bool create)
+{
+  int rc;
+
+  if (!create) { 
+    string configname = diskfilestem + ".config";
+
+    if ((configfilefd = fopen(configname.c_str(),"r"))==0) { 
+      return ERROR_NOFILE;
+    }
+    rc = ReadConfig();
+    fclose(configfilefd);
+    configfilefd=0;
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  rc=SanityCheckConfig();
+
+  if (rc) { 
+    return rc;
+  }
+
+  bitmap = new BYTE_T [GetNumBitMapBytes()];
+
+  memset(bitmap,0,GetNumBitMapBytes());
+
+  bitmapdirty.assign((GetNumBitMapBytes()+DISKSYSTEM_BITMAP_PAGE_BYTES-1)/DISKSYSTEM_BITMAP_PAGE_BYTES,false);
+
+  return ERROR_NOERROR;
+}
+
     
 
 //
@@ -409,102 +646,252 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   last_track=req_trackend;
   last_sector=req_sectorend;
 
+  stats.Add(numblock,trackhop,
+	    timeinseek+timeintrackbytrackhops,timeinrotation,timeinreadsectors);
+
   return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
 }
 
 
-ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
-			 const SIZE_T   numblock,
-			 vector<Block> &blocks,
-			 double        &reqtime)
+ERROR_T DiskSystem::CheckRequest(const char *who, const SIZE_T inoffblock, const SIZE_T numblock)
 {
-  reqtime=0;
-
   if (inoffblock+numblock > numblocks) { 
-    cerr << "DiskSystem::Read: Attempt to read blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    cerr << "DiskSystem::"<<who<<": Attempt to access blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
     return ERROR_NOSPACE;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
-
   for (SIZE_T i=0;i<numblock;i++) { 
-    Block b(blocksize);
     if (!IsBlockAllocated(inoffblock+i)) { 
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
+	cerr <<"DiskSystem::"<<who<<": accessing unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (myread(datafilefd,offset+(inoffblock+i)*blocksize,b.data,blocksize,true)!=blocksize) { 
-      cerr << "DiskSystem::Read: myread has failed"<<endl;
-      return ERROR_IMPLBUG;
-    }
-    blocks.push_back(b);
   }
 
   return ERROR_NOERROR;
 }
 
-ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
-			  const SIZE_T   numblock,
-			  const vector<Block> &blocks,
-			  double        &reqtime)
+
+//
+// Moves numblock blocks between the data file and the caller's
+// buffers.  Requests longer than the scratch io vector are split,
+// otherwise this is exactly one preadv/pwritev.  Each trailer, if
+// any, gets its own iovec right after its block.
+//
+ERROR_T DiskSystem::TransferBlocks(const bool write,
+				   const SIZE_T inoffblock,
+				   const SIZE_T numblock,
+				   BYTE_T * const bufs[],
+				   unsigned int trailers[])
 {
-  reqtime=0;
+  SIZE_T done=0;
+  SIZE_T pervec = trailers ? 2 : 1;
+  SIZE_T stride = GetStoredBlockSize();
 
-  if (inoffblock+numblock > numblocks) { 
-    cerr << "DiskSystem::Write: Attempt to write blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
-    return ERROR_NOSPACE;
+  if (datafilefd==0) { 
+    return ERROR_NOFILE;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
+  while (done<numblock) { 
+    SIZE_T n = (numblock-done) < iov.size()/pervec ? (numblock-done) : iov.size()/pervec;
 
-  for (SIZE_T i=0;i<numblock;i++) { 
-    if (!IsBlockAllocated(inoffblock+i)) { 
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
+    for (SIZE_T i=0;i<n;i++) { 
+      iov[i*pervec].iov_base=bufs[done+i];
+      iov[i*pervec].iov_len=blocksize;
+      if (trailers) { 
+	iov[i*pervec+1].iov_base=&(trailers[done+i]);
+	iov[i*pervec+1].iov_len=sizeof(unsigned int);
       }
     }
-    if (mywrite(datafilefd,offset+(inoffblock+i)*blocksize,blocks[i].data,blocksize)!=blocksize) {  
-      cerr << "DiskSystem::Write: mywrite has failed"<<endl;
-      return ERROR_IMPLBUG;
+
+    off_t pos = (off_t)offset + (off_t)(inoffblock+done)*(off_t)stride;
+    SIZE_T len = n*stride;
+
+    if (write) {
+      if (mywritev(fileno(datafilefd),pos,&(iov[0]),n*pervec)!=len) { 
+	cerr << "DiskSystem::Write: mywritev has failed"<<endl;
+	return ERROR_IMPLBUG;
+      }
+    } else {
+      if (myreadv(fileno(datafilefd),pos,&(iov[0]),n*pervec)!=len) { 
+	cerr << "DiskSystem::Read: myreadv has failed"<<endl;
+	return ERROR_IMPLBUG;
+      }
     }
+    done+=n;
   }
 
   return ERROR_NOERROR;
 }
 
 
-ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime)
+//
+// Compare the trailers just read (in crcs) against the data.
+// A block that has never been written reads back as all zeros,
+// trailer included, and is accepted as is.
+//
+ERROR_T DiskSystem::VerifyChecksums(const SIZE_T inoffblock, const SIZE_T numblock, BYTE_T * const bufs[])
 {
-  vector<Block> bl;
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (CRC32C(bufs[i],blocksize)!=crcs[i]) { 
+      bool blank = crcs[i]==0;
+      for (SIZE_T j=0; blank && j<blocksize; j++) { 
+	blank = bufs[i][j]==0;
+      }
+      if (!blank) { 
+	cerr << "DiskSystem::Read: checksum mismatch on block "<<(inoffblock+i)<<endl;
+	checksumerrors++;
+	return ERROR_CHECKSUM;
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
 
-  ERROR_T rc = Read(inoffblock,1,bl,reqtime);
+
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 BYTE_T * const bufs[],
+			 double        &reqtime)
+{
+  reqtime=0;
+
+  ERROR_T rc = CheckRequest("Read",inoffblock,numblock);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
 
-  blocks = bl[0];
+  reqtime=ModelAccess(inoffblock,numblock);
+
+  if (!checksums) { 
+    return TransferBlocks(false,inoffblock,numblock,bufs,0);
+  }
+
+  // Trailers are read into crcs, so go a chunk at a time
+  for (SIZE_T done=0; done<numblock; ) { 
+    SIZE_T n = (numblock-done) < crcs.size() ? (numblock-done) : crcs.size();
+    rc = TransferBlocks(false,inoffblock+done,n,bufs+done,&(crcs[0]));
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    if (verifychecksums) { 
+      rc = VerifyChecksums(inoffblock+done,n,bufs+done);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
+    done+=n;
+  }
 
   return ERROR_NOERROR;
 }
 
-ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &reqtime)
-{
-  vector<Block> bl;
 
-  bl.push_back(blocks);
+ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
+			  const SIZE_T   numblock,
+			  const BYTE_T * const bufs[],
+			  double        &reqtime)
+{
+  reqtime=0;
 
-  ERROR_T rc = Write(inoffblock,1,bl,reqtime);
+  ERROR_T rc = CheckRequest("Write",inoffblock,numblock);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
 
+  reqtime=ModelAccess(inoffblock,numblock);
+
+  // The buffers are only read from
+  BYTE_T * const *wbufs = const_cast<BYTE_T * const *>(bufs);
+
+  if (!checksums) { 
+    return TransferBlocks(true,inoffblock,numblock,wbufs,0);
+  }
+
+  for (SIZE_T done=0; done<numblock; ) { 
+    SIZE_T n = (numblock-done) < crcs.size() ? (numblock-done) : crcs.size();
+    for (SIZE_T i=0;i<n;i++) { 
+      crcs[i]=CRC32C(wbufs[done+i],blocksize);
+    }
+    rc = TransferBlocks(true,inoffblock+done,n,wbufs+done,&(crcs[0]));
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    done+=n;
+  }
+
   return ERROR_NOERROR;
 }
 
 
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 vector<Block> &blocks,
+			 double        &reqtime)
+{
+  reqtime=0;
+
+  if (numblock==0) { 
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T first=blocks.size();
+  vector<BYTE_T *> bufs(numblock);
+
+  blocks.resize(first+numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (blocks[first+i].Resize(blocksize,false)!=ERROR_NOERROR) { 
+      return ERROR_NOMEM;
+    }
+    bufs[i]=blocks[first+i].data;
+  }
+
+  return Read(inoffblock,numblock,&(bufs[0]),reqtime);
+}
+
+ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
+			  const SIZE_T   numblock,
+			  const vector<Block> &blocks,
+			  double        &reqtime)
+{
+  reqtime=0;
+
+  if (numblock==0) { 
+    return ERROR_NOERROR;
+  }
+
+  vector<const BYTE_T *> bufs(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    bufs[i]=blocks[i].data;
+  }
+
+  return Write(inoffblock,numblock,&(bufs[0]),reqtime);
+}
+
+
+ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &block, double &reqtime)
+{
+  if (block.length!=blocksize) { 
+    if (block.Resize(blocksize,false)!=ERROR_NOERROR) { 
+      return ERROR_NOMEM;
+    }
+  }
+
+  return Read(inoffblock,1,&(block.data),reqtime);
+}
+
+ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &block, double &reqtime)
+{
+  const BYTE_T *buf=block.data;
+
+  return Write(inoffblock,1,&buf,reqtime);
+}
+
+
 SIZE_T DiskSystem::GetBlockSize() const
 {
   return blocksize;
@@ -522,12 +909,31 @@ SIZE_T DiskSystem::GetNumBlocks() const
 #define CLEARBIT(x) do { bitmap[(x)/8] &= ~(0x1 << (7-((x)%8))); } while (0)
 
 
+ERROR_T DiskSystem::Sync()
+{
+  if (datafilefd) { 
+    if (fdatasync(fileno(datafilefd))) { 
+      cerr << "DiskSystem::Sync: can't sync data file\n";
+      return ERROR_IMPLBUG;
+    }
+  }
+  return SyncBitMap();
+}
+
+
 bool DiskSystem::IsBlockAllocated(const SIZE_T block)
 {
   return GETBIT(block);
 }
 
 
+void DiskSystem::MarkBitMapDirty(const SIZE_T block)
+{
+  bitmapdirty[(block/8)/DISKSYSTEM_BITMAP_PAGE_BYTES]=true;
+  bitmapflips++;
+}
+
+
 ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innumblocks)
 {
   if (offset+innumblocks > numblocks) { 
@@ -541,8 +947,14 @@ ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innum
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr << "Disksystem: NotifyAllocateBlocks: Block "<<i<<" is being allocated, but it's already allocated!"<<endl;
       }
+    } else {
+      SETBIT(i);
+      MarkBitMapDirty(i);
     }
-    SETBIT(i);
+  }
+
+  if (bitmapsyncinterval && bitmapflips>=bitmapsyncinterval) { 
+    return SyncBitMap();
   }
 
   return ERROR_NOERROR;
@@ -561,14 +973,177 @@ ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innu
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr << "Disksystem: NotifyDeallocateBlocks: Block "<<i<<" is being deallocated, but it's already deallocated!"<<endl;
       }
+    } else {
+      CLEARBIT(i);
+      MarkBitMapDirty(i);
     }
-    CLEARBIT(i);
+  }
+
+  if (bitmapsyncinterval && bitmapflips>=bitmapsyncinterval) { 
+    return SyncBitMap();
   }
 
   return ERROR_NOERROR;
 }
 
 
+void DiskStats::Clear()
+{
+  requests=0;
+  blocks=0;
+  seektime=0;
+  rotationtime=0;
+  transfertime=0;
+  for (SIZE_T i=0;i<DISKSTATS_BUCKETS;i++) { 
+    trackhops[i]=0;
+    servicetimes[i]=0;
+  }
+}
+
+
+SIZE_T DiskStats::Bucket(const double value)
+{
+  SIZE_T b=0;
+  double limit=1;
+
+  if (value<=0) { 
+    return 0;
+  }
+  // bucket b holds [limit/2,limit)
+  for (b=1, limit=2; value>=limit && b<DISKSTATS_BUCKETS-1; b++, limit*=2) {
+  }
+  return b;
+}
+
+
+void DiskStats::Add(const SIZE_T numblocks, const SIZE_T trackhop,
+		    const double seek, const double rotation, const double transfer)
+{
+  requests++;
+  blocks+=numblocks;
+  seektime+=seek;
+  rotationtime+=rotation;
+  transfertime+=transfer;
+  trackhops[Bucket(trackhop)]++;
+  // milliseconds to microseconds
+  servicetimes[Bucket(1000.0*(seek+rotation+transfer))]++;
+}
+
+
+// next line that is not a comment
+static bool GetStatsLine(FILE *f, char *buf, const int len)
+{
+  do { 
+    if (!fgets(buf,len,f)) { 
+      return false;
+    }
+  } while (buf[0]=='#');
+  return true;
+}
+
+
+void DiskStats::Add(const DiskStats &rhs)
+{
+  requests+=rhs.requests;
+  blocks+=rhs.blocks;
+  seektime+=rhs.seektime;
+  rotationtime+=rhs.rotationtime;
+  transfertime+=rhs.transfertime;
+  for (SIZE_T i=0;i<DISKSTATS_BUCKETS;i++) { 
+    trackhops[i]+=rhs.trackhops[i];
+    servicetimes[i]+=rhs.servicetimes[i];
+  }
+}
+
+
+ERROR_T DiskStats::Load(FILE *f)
+{
+  char buf[80];
+
+  rewind(f);
+  if (!GetStatsLine(f,buf,80) ||
+      sscanf(buf,"%u %u %lf %lf %lf",&requests,&blocks,&seektime,&rotationtime,&transfertime)!=5) { 
+    Clear();
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T i=0;i<DISKSTATS_BUCKETS;i++) { 
+    if (!GetStatsLine(f,buf,80) ||
+	sscanf(buf,"%u %u",&(trackhops[i]),&(servicetimes[i]))!=2) { 
+      cerr << "DiskStats::Load: truncated stats file, starting over\n";
+      Clear();
+      return ERROR_NOERROR;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T DiskStats::Save(FILE *f) const
+{
+  ftruncate(fileno(f),0);
+  rewind(f);
+  fprintf(f,"# disksystem stats file version 1.0\n");
+  fprintf(f,"# requests blocks seektime rotationtime transfertime (ms)\n");
+  fprintf(f,"%u %u %.6f %.6f %.6f\n",requests,blocks,seektime,rotationtime,transfertime);
+  fprintf(f,"# per bucket: trackhops servicetimes\n");
+  for (SIZE_T i=0;i<DISKSTATS_BUCKETS;i++) { 
+    fprintf(f,"%u %u\n",trackhops[i],servicetimes[i]);
+  }
+  fflush(f);
+  return ERROR_NOERROR;
+}
+
+
+static void PrintHistogram(ostream &os, const char *what, const char *unit,
+			   const SIZE_T hist[], const SIZE_T total)
+{
+  SIZE_T last=0;
+
+  for (SIZE_T i=0;i<DISKSTATS_BUCKETS;i++) { 
+    if (hist[i]) { 
+      last=i;
+    }
+  }
+  os << what << " ("<<unit<<"):\n";
+  for (SIZE_T i=0;i<=last;i++) { 
+    char range[64];
+    if (i<2) { 
+      sprintf(range,"%u",i);
+    } else if (i==DISKSTATS_BUCKETS-1) { 
+      sprintf(range,"%u+",1U<<(i-1));
+    } else {
+      sprintf(range,"%u-%u",1U<<(i-1),(1U<<i)-1);
+    }
+    os << "  " << range << "\t" << hist[i];
+    if (total) { 
+      os << "\t(" << (100.0*hist[i]/total) << "%)";
+    }
+    os << "\n";
+  }
+}
+
+
+ostream & DiskStats::Print(ostream &os) const
+{
+  double total=GetTotalTime();
+
+  os << "DiskStats(requests="<<requests
+     << ", blocks="<<blocks
+     << ", totaltime="<<total
+     << ", seektime="<<seektime
+     << ", rotationtime="<<rotationtime
+     << ", transfertime="<<transfertime
+     << ")\n";
+  if (total>0) { 
+    os << "time split: seek "<<(100*seektime/total)<<"%, rotation "
+       <<(100*rotationtime/total)<<"%, transfer "<<(100*transfertime/total)<<"%\n";
+  }
+  PrintHistogram(os,"track hops per request","tracks",trackhops,requests);
+  PrintHistogram(os,"service time per request","us",servicetimes,requests);
+  return os;
+}
+
+
 ostream & DiskSystem::Print(ostream &os) const
 {
   os << "DiskSystem(diskfilestem="<<diskfilestem
@@ -583,6 +1158,7 @@ ostream & DiskSystem::Print(ostream &os) const
      << ", averageseeklatency="<<averageseeklatency
      << ", trackseeklatency="<<trackseeklatency
      << ", rotationallatency="<<rotationallatency
+     << ", checksums="<<checksums
      << ", bitmap=";
 
   for (SIZE_T i=0;i<numblocks;i++) { 
@@ -5,11 +5,56 @@
 #include <iostream>
 #include <vector>
 
+#include <sys/uio.h>
+
 #include "global.h"
 #include "block.h"
 
 using namespace std;
 
+// The allocation bitmap is persisted in pages of this many bytes,
+// each covering 8 times as many blocks.  Only pages that have changed
+// since the last sync are written.
+const SIZE_T DISKSYSTEM_BITMAP_PAGE_BYTES=512;
+
+// Histograms are kept in power of two buckets: bucket 0 counts the
+// value 0 and bucket i>0 counts values in [2^(i-1),2^i).  The last
+// bucket also takes everything larger.
+const SIZE_T DISKSTATS_BUCKETS=32;
+
+//
+// Where the modeled time goes, accumulated over requests.  
+// Seek time includes the track to track hops within a request.
+// Service times are histogrammed in microseconds.
+//
+struct DiskStats {
+  SIZE_T requests;
+  SIZE_T blocks;
+  double seektime;
+  double rotationtime;
+  double transfertime;
+  SIZE_T trackhops[DISKSTATS_BUCKETS];
+  SIZE_T servicetimes[DISKSTATS_BUCKETS];
+
+  DiskStats() { Clear(); }
+
+  void   Clear();
+  void   Add(const SIZE_T numblocks, const SIZE_T trackhop,
+	     const double seek, const double rotation, const double transfer);
+  void   Add(const DiskStats &rhs);
+  double GetTotalTime() const { return seektime+rotationtime+transfertime; }
+
+  static SIZE_T Bucket(const double value);
+
+  ERROR_T Load(FILE *f);
+  ERROR_T Save(FILE *f) const;
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<< (ostream &os, const DiskStats &rhs) { return rhs.Print(os);}
+
+
 // Models a single disk with a single outstanding request
 //
 // Includes storage allocator and free space bitmap to 
@@ -41,21 +86,73 @@ class DiskSystem {
   double trackseeklatency;
   double rotationallatency;
 
+  // If nonzero, each block is followed on the device by a 4 byte
+  // CRC32C trailer, written on the way out and checked on the way in
+  SIZE_T checksums;
+  bool   verifychecksums;
+  SIZE_T checksumerrors;
+
+  // scratch io vector and trailers, sized once so that transfers
+  // do not allocate
+  vector<struct iovec> iov;
+  vector<unsigned int> crcs;
+
+  // one flag per bitmap page that differs from the bitmap file
+  vector<bool> bitmapdirty;
+  SIZE_T bitmapflips;           // bits changed since the last sync
+  SIZE_T bitmapsyncinterval;    // sync after this many, 0=only on request
+  SIZE_T bitmappagewrites;
+
+  // since the disk was opened, and before that (from filestem.stats)
+  DiskStats stats;
+  DiskStats paststats;
+  FILE*  statsfilefd;
+
  protected:
   virtual double ModelAccess(const SIZE_T off, const SIZE_T num);
 
+  ERROR_T CheckRequest(const char *who, const SIZE_T off, const SIZE_T num);
+
+  // Moves whole blocks between the device and the caller's buffers.
+  // Timing has already been charged by the caller.  If trailers is
+  // nonzero, trailers[i] is the checksum stored after block i, which
+  // is written, or read back, in the same transfer.  Devices that do
+  // not keep their data in filestem.data override this.
+  virtual ERROR_T TransferBlocks(const bool write,
+				 const SIZE_T off,
+				 const SIZE_T num,
+				 BYTE_T * const bufs[],
+				 unsigned int trailers[]);
+
+  // bytes each block occupies on the device, trailer included
+  SIZE_T   GetStoredBlockSize() const { return blocksize + (checksums ? sizeof(unsigned int) : 0); }
+  ERROR_T  VerifyChecksums(const SIZE_T off, const SIZE_T num, BYTE_T * const bufs[]);
+
+  const string & GetFileStem() const { return diskfilestem; }
+  SIZE_T   GetOffset() const { return offset; }
+  BYTE_T * GetBitMap() { return bitmap; }
+  SIZE_T   GetNumBitMapBytes() const { return numblocks/8 + (numblocks%8 != 0); }
+
   ERROR_T SanityCheckConfig();
   ERROR_T InitFromConfigFile();
   ERROR_T InitFromInMemoryConfig();
+  ERROR_T InitWithoutFiles(const bool create);
   ERROR_T ReadConfig();
   ERROR_T WriteConfig();
   ERROR_T ReadBitMap();
   ERROR_T WriteBitMap();
+  void    MarkBitMapDirty(const SIZE_T block);
+  ERROR_T OpenStats(const bool create);
   
    
  public:
   // The data is stored in file "filestem.data"
   // The config is stored in file "filestem.config"
+  //
+  // Subclasses that keep the data elsewhere pass usefiles=false.
+  // Then only the geometry is set up, from filestem.config or, 
+  // with create=true, from the arguments, the bitmap starts clear,
+  // and no file is written or held open.
 
   DiskSystem(const string &filestem,
 	     const bool create=false,
@@ -67,7 +164,9 @@ class DiskSystem {
 	     const SIZE_T tracks=0,
 	     const double avgseek=0,
 	     const double trackseek=0,
-	     const double rotlat=0);
+	     const double rotlat=0,
+	     const bool checksums=false,
+	     const bool usefiles=true);
   DiskSystem() { throw GenericException(); } 
   DiskSystem(const DiskSystem &rhs) { throw GenericException();}
   DiskSystem & operator=(const DiskSystem &rhs) { throw GenericException(); return *this;}
@@ -94,9 +193,29 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // Scatter/gather variants.  Block i of the request is transferred
+  // to or from bufs[i], each of which holds GetBlockSize() bytes.
+  // The request is a single positioned I/O and nothing is allocated.
+  ERROR_T Read(const SIZE_T inoffblock,
+	       const SIZE_T numblock,
+	       BYTE_T * const bufs[],
+	       double &reqtime);
+
+  ERROR_T Write(const SIZE_T inoffblock,
+		const SIZE_T numblock,
+		const BYTE_T * const bufs[],
+		double &reqtime);
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
+  // Checksums are chosen when the disk is created.  Verification of
+  // blocks as they are read can be turned off, for instance by a 
+  // caller that has just verified the whole device.
+  bool   HasChecksums() const { return checksums!=0; }
+  void   SetVerifyChecksums(const bool verify) { verifychecksums=verify; }
+  SIZE_T GetNumChecksumErrors() const { return checksumerrors; }
+
   //
   // These are notification functions that should be called when
   // a block is allocated or deallocated.  They keep the bitmap updated
@@ -109,6 +228,30 @@ class DiskSystem {
 
   bool    IsBlockAllocated(const SIZE_T offset);
 
+  //
+  // Bitmap changes are kept in memory and written back a page at a
+  // time, so that the cost of a sync is proportional to the number
+  // of pages touched since the last one rather than the disk size.
+  // SyncBitMap writes the dirty pages (it is called on destruction
+  // and by BufferCache::Detach).  With a nonzero interval, a sync 
+  // also happens automatically after that many bits have changed.
+  //
+  ERROR_T SyncBitMap();
+
+  // Make everything written so far durable, data and bitmap both
+  virtual ERROR_T Sync();
+
+  void    SetBitMapSyncInterval(const SIZE_T numchanges) { bitmapsyncinterval=numchanges; }
+  SIZE_T  GetNumBitMapPageWrites() const { return bitmappagewrites; }
+
+  // Breakdown of the time charged by requests since the disk was 
+  // opened, and since it was made (or the stats were last cleared).
+  // The latter is kept in filestem.stats, updated when the disk is
+  // closed; a disk kept in memory has no history.
+  const DiskStats & GetStats() const { return stats; }
+  DiskStats GetTotalStats() const;
+  void    ClearStats() { stats.Clear(); paststats.Clear(); }
+
 
   ostream & Print(ostream &os) const;
 };
@@ -1,8 +1,12 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
+($#ARGV==3 || ($#ARGV==4 && $ARGV[4] eq "variable")) or 
+  die "usage: gen_test_sequence.pl keysize valsize seed num [variable]\n";
 
 ($keysize,$valuesize,$seed,$num)=@ARGV;
+# keys and values of any length up to keysize and valsize (for an
+# index of slotted nodes, sim -s)
+$variable=($#ARGV==4);
 
 srand $seed;
 
@@ -13,13 +17,13 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 INSERT_EXISTS => \&gen_insert_exists,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
-#
-# No deletes required this quarter
-# 
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
+	 DELETE_NEW => \&gen_delete_new,
+	 DELETE_EXISTS => \&gen_delete_exists,
 	 LOOKUP_NEW => \&gen_lookup_new,
 	 LOOKUP_EXISTS => \&gen_lookup_exists,
+	 MINSERT => \&gen_minsert,
+	 MLOOKUP => \&gen_mlookup,
+	 SCAN => \&gen_scan,
 	 DISPLAY => \&gen_display
        );
 
@@ -42,8 +46,13 @@ for ($i=1;$i<$num;$i++) {
 print "DEINIT\n";
 
 
+sub Length {
+  my ($size)=@_;
+  return $variable ? 1+int(rand($size)) : $size;
+}
+
 sub MakeKey {
-  return join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize));
+  return join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..Length($keysize)));
 }
 
 sub MakeNonExistentKey {
@@ -60,7 +69,7 @@ sub MakeExistentKey {
 }
 
 sub MakeValue {
-  return join("", map { substr($valuebytes,int(rand(length($valuebytes))),1) } (1..$valuesize));
+  return join("", map { substr($valuebytes,int(rand(length($valuebytes))),1) } (1..Length($valuesize)));
 }
 
 
@@ -94,6 +103,37 @@ sub gen_delete_exists {
   return "DELETE $key  # should succeed";
 }
 
+# Batches of up to 8 keys, some new and some existing; MINSERT
+# needs no existing keys, since its new keys may repeat
+sub gen_minsert {
+  my @words=();
+  my %batch=();
+  foreach (1..1+int(rand(8))) {
+    my $key = (rand(1)<0.25 && keys %content) ? MakeExistentKey() : 
+              (rand(1)<0.1 && keys %batch) ? (keys %batch)[0] : MakeNonExistentKey();
+    my $value=MakeValue();
+    if (!defined $content{$key}) {
+      $content{$key}=$value;
+      $batch{$key}=$value;
+    }
+    push @words, $key, $value;
+  }
+  return "MINSERT @words";
+}
+
+sub gen_mlookup {
+  my @keys=();
+  foreach (1..1+int(rand(8))) {
+    push @keys, (rand(1)<0.5 && keys %content) ? MakeExistentKey() : MakeNonExistentKey();
+  }
+  return "MLOOKUP @keys";
+}
+
+sub gen_scan {
+  my ($lo, $hi) = sort (MakeKey(), MakeKey());
+  return "SCAN $lo $hi";
+}
+
 sub gen_lookup_new {
   return "LOOKUP ".MakeNonExistentKey()."  # should fail";
 }
@@ -6,7 +6,7 @@
 
 void usage() 
 {
-  cerr << "usage: readdisk filestem\n";
+  cerr << "usage: infodisk filestem [clearstats]\n";
 }
 
 int main(int argc, char *argv[])
@@ -22,6 +22,13 @@ int main(int argc, char *argv[])
   
   cerr << "Disk is as follows.\n" << disk << "\n";
 
+  cerr << "Accumulated disk time.\n" << disk.GetTotalStats();
+
+  if (argc>2 && string(argv[2])=="clearstats") { 
+    disk.ClearStats();
+    cerr << "Stats cleared.\n";
+  }
+
   cerr << "Done.\n";
 
   return 0;
@@ -0,0 +1,317 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEYSEARCH_X86 1
+#endif
+
+#include "keysearch.h"
+
+// The window, in keys, left for the vector scan once the binary
+// search has narrowed things down; a few vectors' worth
+#define KEYSEARCH_WINDOW 16
+
+static bool keysearchinited=false;
+static bool havesse42=false;
+static bool haveavx2=false;
+static KeySearchKernel keysearchkernel=KEYSEARCH_AUTO;
+
+
+static void KeySearchInit()
+{
+#ifdef KEYSEARCH_X86
+  __builtin_cpu_init();
+  havesse42 = __builtin_cpu_supports("sse4.2");
+  haveavx2 = __builtin_cpu_supports("avx2");
+#endif
+  keysearchinited=true;
+}
+
+
+// Keys compare as big endian integers; these assume a little endian
+// machine, as the vector kernels do
+static inline uint64_t LoadKey8(const BYTE_T *p)
+{
+  uint64_t v;
+  memcpy(&v,p,8);
+  return __builtin_bswap64(v);
+}
+
+static inline uint32_t LoadKey4(const BYTE_T *p)
+{
+  uint32_t v;
+  memcpy(&v,p,4);
+  return __builtin_bswap32(v);
+}
+
+static inline uint32_t LoadKey2(const BYTE_T *p)
+{
+  return ((uint32_t)p[0]<<8) | p[1];
+}
+
+static inline uint32_t LoadKey1(const BYTE_T *p)
+{
+  return p[0];
+}
+
+
+static SIZE_T MemcmpSearch(const BYTE_T *base, const SIZE_T stride,
+			   SIZE_T lo, SIZE_T hi,
+			   const SIZE_T keysize, const BYTE_T *key)
+{
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (memcmp(base+mid*stride,key,keysize)<0) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+// Binary search on [lo,hi) until at most window keys remain
+template <class T, T (*LOAD)(const BYTE_T *)>
+static inline void IntegerNarrow(const BYTE_T *base, const SIZE_T stride,
+				 SIZE_T &lo, SIZE_T &hi, const T key,
+				 const SIZE_T window)
+{
+  while (hi-lo>window) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LOAD(base+mid*stride)<key) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+}
+
+
+template <class T, T (*LOAD)(const BYTE_T *)>
+static SIZE_T IntegerSearch(const BYTE_T *base, const SIZE_T stride,
+			    SIZE_T lo, SIZE_T hi, const T key)
+{
+  IntegerNarrow<T,LOAD>(base,stride,lo,hi,key,0);
+  return lo;
+}
+
+
+#ifdef KEYSEARCH_X86
+
+//
+// The vector scans count the keys in [lo,hi) that are less than the
+// search key.  The keys are sorted, so that is the answer's offset
+// from lo, and the scan stops at the first vector that is not all
+// less.  Byte swapping puts the keys in integer order, and flipping
+// the sign bit turns the signed compare into an unsigned one.
+//
+
+__attribute__((target("avx2")))
+static SIZE_T CountLess8AVX2(const BYTE_T *base, const SIZE_T stride,
+			     const SIZE_T lo, const SIZE_T hi, const uint64_t key)
+{
+  const __m256i swap=_mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+				      7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  const __m256i sign=_mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  const __m256i k=_mm256_set1_epi64x((long long)(key^0x8000000000000000ULL));
+  const __m128i idx=_mm_setr_epi32(0,(int)stride,(int)(2*stride),(int)(3*stride));
+  SIZE_T i=lo;
+
+  for (; i+4<=hi; i+=4) {
+    __m256i v=_mm256_i32gather_epi64((const long long *)(base+i*stride),idx,1);
+    v=_mm256_xor_si256(_mm256_shuffle_epi8(v,swap),sign);
+    int less=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,v)));
+    if (less!=0xf) {
+      return i-lo+__builtin_popcount(less);
+    }
+  }
+  for (; i<hi && LoadKey8(base+i*stride)<key; i++) {
+  }
+  return i-lo;
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T CountLess4AVX2(const BYTE_T *base, const SIZE_T stride,
+			     const SIZE_T lo, const SIZE_T hi, const uint32_t key)
+{
+  const __m256i swap=_mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+				      3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m256i sign=_mm256_set1_epi32((int)0x80000000U);
+  const __m256i k=_mm256_set1_epi32((int)(key^0x80000000U));
+  const __m256i idx=_mm256_setr_epi32(0,(int)stride,(int)(2*stride),(int)(3*stride),
+				      (int)(4*stride),(int)(5*stride),(int)(6*stride),(int)(7*stride));
+  SIZE_T i=lo;
+
+  for (; i+8<=hi; i+=8) {
+    __m256i v=_mm256_i32gather_epi32((const int *)(base+i*stride),idx,1);
+    v=_mm256_xor_si256(_mm256_shuffle_epi8(v,swap),sign);
+    int less=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k,v)));
+    if (less!=0xff) {
+      return i-lo+__builtin_popcount(less);
+    }
+  }
+  for (; i<hi && LoadKey4(base+i*stride)<key; i++) {
+  }
+  return i-lo;
+}
+
+
+// SSE has no gather, so keys are loaded one by one into a vector
+// and compared together
+__attribute__((target("sse4.2")))
+static SIZE_T CountLess8SSE(const BYTE_T *base, const SIZE_T stride,
+			    const SIZE_T lo, const SIZE_T hi, const uint64_t key)
+{
+  const __m128i swap=_mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  const __m128i sign=_mm_set1_epi64x((long long)0x8000000000000000ULL);
+  const __m128i k=_mm_set1_epi64x((long long)(key^0x8000000000000000ULL));
+  SIZE_T i=lo;
+
+  for (; i+2<=hi; i+=2) {
+    long long a, b;
+    memcpy(&a,base+i*stride,8);
+    memcpy(&b,base+(i+1)*stride,8);
+    __m128i v=_mm_set_epi64x(b,a);
+    v=_mm_xor_si128(_mm_shuffle_epi8(v,swap),sign);
+    int less=_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k,v)));
+    if (less!=0x3) {
+      return i-lo+__builtin_popcount(less);
+    }
+  }
+  for (; i<hi && LoadKey8(base+i*stride)<key; i++) {
+  }
+  return i-lo;
+}
+
+
+__attribute__((target("sse4.2")))
+static SIZE_T CountLess4SSE(const BYTE_T *base, const SIZE_T stride,
+			    const SIZE_T lo, const SIZE_T hi, const uint32_t key)
+{
+  const __m128i swap=_mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m128i sign=_mm_set1_epi32((int)0x80000000U);
+  const __m128i k=_mm_set1_epi32((int)(key^0x80000000U));
+  SIZE_T i=lo;
+
+  for (; i+4<=hi; i+=4) {
+    int a, b, c, d;
+    memcpy(&a,base+i*stride,4);
+    memcpy(&b,base+(i+1)*stride,4);
+    memcpy(&c,base+(i+2)*stride,4);
+    memcpy(&d,base+(i+3)*stride,4);
+    __m128i v=_mm_setr_epi32(a,b,c,d);
+    v=_mm_xor_si128(_mm_shuffle_epi8(v,swap),sign);
+    int less=_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k,v)));
+    if (less!=0xf) {
+      return i-lo+__builtin_popcount(less);
+    }
+  }
+  for (; i<hi && LoadKey4(base+i*stride)<key; i++) {
+  }
+  return i-lo;
+}
+
+#endif
+
+
+KeySearchKernel KeySearchGetKernel(const SIZE_T keysize)
+{
+  if (!keysearchinited) {
+    KeySearchInit();
+  }
+
+  if (keysize!=1 && keysize!=2 && keysize!=4 && keysize!=8) {
+    return KEYSEARCH_MEMCMP;
+  }
+
+  KeySearchKernel k=keysearchkernel;
+
+  if (k==KEYSEARCH_AUTO) {
+    // gathers of 4 byte keys measure no faster than SSE loads
+    k = (haveavx2 && keysize==8) ? KEYSEARCH_AVX2 : havesse42 ? KEYSEARCH_SSE : KEYSEARCH_INTEGER;
+  }
+  // nothing to vectorize for the smallest keys
+  if ((k==KEYSEARCH_SSE || k==KEYSEARCH_AVX2) && keysize<4) {
+    k=KEYSEARCH_INTEGER;
+  }
+  return k;
+}
+
+
+bool KeySearchUse(const KeySearchKernel kernel)
+{
+  if (!keysearchinited) {
+    KeySearchInit();
+  }
+  if ((kernel==KEYSEARCH_SSE && !havesse42) ||
+      (kernel==KEYSEARCH_AVX2 && !haveavx2)) {
+    return false;
+  }
+  keysearchkernel=kernel;
+  return true;
+}
+
+
+const char *KeySearchName(const KeySearchKernel kernel)
+{
+  switch (kernel) {
+  case KEYSEARCH_AUTO:
+    return "auto";
+  case KEYSEARCH_MEMCMP:
+    return "memcmp";
+  case KEYSEARCH_INTEGER:
+    return "integer";
+  case KEYSEARCH_SSE:
+    return "sse4.2";
+  case KEYSEARCH_AVX2:
+    return "avx2";
+  }
+  return "unknown";
+}
+
+
+SIZE_T KeySearch(const BYTE_T *base,
+		 const SIZE_T stride,
+		 const SIZE_T n,
+		 const SIZE_T keysize,
+		 const BYTE_T *key,
+		 bool &found)
+{
+  KeySearchKernel kernel=KeySearchGetKernel(keysize);
+  SIZE_T lo=0, hi=n;
+  SIZE_T pos;
+
+  if (kernel==KEYSEARCH_MEMCMP) {
+    pos=MemcmpSearch(base,stride,lo,hi,keysize,key);
+  } else if (keysize==8) {
+    uint64_t k=LoadKey8(key);
+#ifdef KEYSEARCH_X86
+    if (kernel!=KEYSEARCH_INTEGER) {
+      IntegerNarrow<uint64_t,LoadKey8>(base,stride,lo,hi,k,KEYSEARCH_WINDOW);
+      pos = lo + (kernel==KEYSEARCH_AVX2 ? CountLess8AVX2(base,stride,lo,hi,k)
+		                         : CountLess8SSE(base,stride,lo,hi,k));
+    } else
+#endif
+    pos=IntegerSearch<uint64_t,LoadKey8>(base,stride,lo,hi,k);
+  } else if (keysize==4) {
+    uint32_t k=LoadKey4(key);
+#ifdef KEYSEARCH_X86
+    if (kernel!=KEYSEARCH_INTEGER) {
+      IntegerNarrow<uint32_t,LoadKey4>(base,stride,lo,hi,k,2*KEYSEARCH_WINDOW);
+      pos = lo + (kernel==KEYSEARCH_AVX2 ? CountLess4AVX2(base,stride,lo,hi,k)
+		                         : CountLess4SSE(base,stride,lo,hi,k));
+    } else
+#endif
+    pos=IntegerSearch<uint32_t,LoadKey4>(base,stride,lo,hi,k);
+  } else if (keysize==2) {
+    pos=IntegerSearch<uint32_t,LoadKey2>(base,stride,lo,hi,LoadKey2(key));
+  } else {
+    pos=IntegerSearch<uint32_t,LoadKey1>(base,stride,lo,hi,LoadKey1(key));
+  }
+
+  found = pos<n && memcmp(base+pos*stride,key,keysize)==0;
+  return pos;
+}
@@ -0,0 +1,47 @@
+#ifndef _keysearch
+#define _keysearch
+
+#include "global.h"
+
+//
+// Search of the fixed size keys in a node.
+//
+// The n keys, each keysize bytes, are at base, base+stride, ... in
+// increasing memcmp order.  KeySearch returns the index of the first
+// key that is >= key (n if there is none) and sets found if that key
+// is equal to key.
+//
+// Keys of 1, 2, 4 or 8 bytes are loaded as big endian integers, so
+// that one integer comparison replaces a memcmp.  For 4 and 8 byte
+// keys, a binary search narrows the range to a small window which is
+// then scanned with SIMD compares, several keys per instruction
+// (AVX2 gathers for 8 byte keys, SSE4.2 for 4 byte keys, where the
+// gathers measured no faster).  Other key sizes use a binary search
+// with memcmp.  The kernel is chosen at run time on first use from
+// what the processor supports.
+//
+SIZE_T KeySearch(const BYTE_T *base,
+		 const SIZE_T stride,
+		 const SIZE_T n,
+		 const SIZE_T keysize,
+		 const BYTE_T *key,
+		 bool &found);
+
+enum KeySearchKernel {
+  KEYSEARCH_AUTO,      // the best available
+  KEYSEARCH_MEMCMP,    // binary search, memcmp
+  KEYSEARCH_INTEGER,   // binary search, integer compares
+  KEYSEARCH_SSE,       // + SSE4.2 window scan
+  KEYSEARCH_AVX2       // + AVX2 window scan
+};
+
+// Choose a kernel (for comparison).  Returns false, and changes
+// nothing, if the processor does not support it.
+bool KeySearchUse(const KeySearchKernel kernel);
+
+// The kernel that will be used for a given key size
+KeySearchKernel KeySearchGetKernel(const SIZE_T keysize);
+
+const char *KeySearchName(const KeySearchKernel kernel);
+
+#endif
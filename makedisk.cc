@@ -6,7 +6,8 @@
 
 void usage() 
 {
-  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat\n";
+  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat [checksums]\n";
+  cerr << "  checksums=1 adds a CRC32C trailer to every block\n";
 }
 
 int main(int argc, char *argv[])
@@ -26,7 +27,8 @@ int main(int argc, char *argv[])
 		  atoi(argv[6]),
 		  atof(argv[7]),
 		  atof(argv[8]),
-		  atof(argv[9]));
+		  atof(argv[9]),
+		  argc>10 ? atoi(argv[10])!=0 : false);
   
   
   cerr << "Disk is as follows.\n" << disk << "\n";
@@ -0,0 +1,187 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <string.h>
+#include <stdio.h>
+
+#include "ramdisk.h"
+
+
+RamDiskSystem::RamDiskSystem(const string &filestem, const bool load) :
+  DiskSystem(filestem,false,0,0,0,0,0,0,0,0,0,false,false),
+  region(0),
+  regionlen(0),
+  status(ERROR_NOERROR)
+{
+  status=MapRegion();
+  if (status==ERROR_NOERROR && load) { 
+    status=Load();
+  }
+}
+
+
+RamDiskSystem::RamDiskSystem(const SIZE_T blocks,
+			     const SIZE_T blocksize,
+			     const SIZE_T heads,
+			     const SIZE_T blockspertrack,
+			     const SIZE_T tracks,
+			     const double avgseek,
+			     const double trackseek,
+			     const double rotlat,
+			     const bool checksums) :
+  DiskSystem("",true,0,blocks,blocksize,heads,blockspertrack,tracks,
+	     avgseek,trackseek,rotlat,checksums,false),
+  region(0),
+  regionlen(0),
+  status(ERROR_NOERROR)
+{
+  status=MapRegion();
+}
+
+
+RamDiskSystem::~RamDiskSystem()
+{
+  if (region) { 
+    munmap(region,regionlen);
+  }
+  region=0;
+  regionlen=0;
+}
+
+
+//
+// Pages of an anonymous mapping read as zero until written, so
+// like a sparse data file, only blocks that have been written cost
+// any memory.
+//
+ERROR_T RamDiskSystem::MapRegion()
+{
+  regionlen = (size_t)GetNumBlocks()*(size_t)GetStoredBlockSize();
+
+  if (regionlen==0) { 
+    return ERROR_BADCONFIG;
+  }
+
+  void *p = mmap(0,regionlen,PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+
+  if (p==MAP_FAILED) { 
+    cerr << "RamDiskSystem: cannot map "<<regionlen<<" bytes\n";
+    region=0;
+    regionlen=0;
+    return ERROR_NOMEM;
+  }
+
+  region=(BYTE_T*)p;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T RamDiskSystem::TransferBlocks(const bool write,
+				      const SIZE_T off,
+				      const SIZE_T num,
+				      BYTE_T * const bufs[],
+				      unsigned int trailers[])
+{
+  SIZE_T blocksize=GetBlockSize();
+  SIZE_T stride=GetStoredBlockSize();
+
+  if (region==0) { 
+    return ERROR_NOMEM;
+  }
+
+  for (SIZE_T i=0;i<num;i++) { 
+    BYTE_T *b = region + (size_t)(off+i)*stride;
+    if (write) { 
+      memcpy(b,bufs[i],blocksize);
+      if (trailers) { 
+	memcpy(b+blocksize,&(trailers[i]),sizeof(unsigned int));
+      }
+    } else {
+      memcpy(bufs[i],b,blocksize);
+      if (trailers) { 
+	memcpy(&(trailers[i]),b+blocksize,sizeof(unsigned int));
+      }
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T RamDiskSystem::Load()
+{
+  string dataname = GetFileStem() + ".data";
+  string bitmapname = GetFileStem() + ".bitmap";
+  FILE *f;
+
+  if (region==0) { 
+    return ERROR_NOMEM;
+  }
+
+  if ((f=fopen(dataname.c_str(),"r"))==0) { 
+    return ERROR_NOFILE;
+  }
+  // A short data file just means the tail was never written
+  if (fseek(f,GetOffset(),SEEK_SET)!=0 ||
+      (fread(region,1,regionlen,f)<regionlen && ferror(f))) { 
+    cerr << "RamDiskSystem::Load: can't read data file\n";
+    fclose(f);
+    return ERROR_IMPLBUG;
+  }
+  fclose(f);
+
+  if ((f=fopen(bitmapname.c_str(),"r"))==0) { 
+    return ERROR_NOFILE;
+  }
+  if (fread(GetBitMap(),1,GetNumBitMapBytes(),f)!=GetNumBitMapBytes()) { 
+    cerr << "RamDiskSystem::Load: can't read bitmap file\n";
+    fclose(f);
+    return ERROR_IMPLBUG;
+  }
+  fclose(f);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T RamDiskSystem::Snapshot()
+{
+  string dataname = GetFileStem() + ".data";
+  string bitmapname = GetFileStem() + ".bitmap";
+  FILE *f;
+
+  if (region==0) { 
+    return ERROR_NOMEM;
+  }
+
+  if (GetFileStem().empty()) { 
+    return ERROR_NOFILE;
+  }
+
+  // keep whatever precedes our offset in an existing data file
+  if ((f=fopen(dataname.c_str(),"r+"))==0 && 
+      (f=fopen(dataname.c_str(),"w+"))==0) { 
+    return ERROR_NOFILE;
+  }
+  fseek(f,GetOffset(),SEEK_SET);
+  if (fwrite(region,1,regionlen,f)!=regionlen) { 
+    cerr << "RamDiskSystem::Snapshot: can't write data file\n";
+    fclose(f);
+    return ERROR_IMPLBUG;
+  }
+  fclose(f);
+
+  if ((f=fopen(bitmapname.c_str(),"w"))==0) { 
+    return ERROR_NOFILE;
+  }
+  if (fwrite(GetBitMap(),1,GetNumBitMapBytes(),f)!=GetNumBitMapBytes()) { 
+    cerr << "RamDiskSystem::Snapshot: can't write bitmap file\n";
+    fclose(f);
+    return ERROR_IMPLBUG;
+  }
+  fclose(f);
+
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,72 @@
+#ifndef _ramdisk
+#define _ramdisk
+
+#include <string>
+#include <iostream>
+
+#include "global.h"
+#include "disksystem.h"
+
+using namespace std;
+
+//
+// A DiskSystem whose blocks live in an anonymous memory region
+// instead of filestem.data.  Geometry and the simulated timing of
+// ModelAccess are exactly those of the file backed disk, so the 
+// times it reports are comparable, but no data I/O is done.  This
+// is intended for measuring the CPU cost of the layers above.
+//
+// The region can be loaded from and snapshotted to the filestem.data
+// and filestem.bitmap files of an existing disk.
+//
+class RamDiskSystem : public DiskSystem {
+ private:
+  BYTE_T *region;
+  size_t  regionlen;
+  ERROR_T status;
+
+  ERROR_T MapRegion();
+
+ protected:
+  virtual ERROR_T TransferBlocks(const bool write,
+				 const SIZE_T off,
+				 const SIZE_T num,
+				 BYTE_T * const bufs[],
+				 unsigned int trailers[]);
+
+ public:
+  // Geometry comes from filestem.config, which is only read.
+  // If load is true, the data and bitmap are loaded too.
+  // GetStatus says whether that worked.
+  RamDiskSystem(const string &filestem, const bool load=false);
+
+  // Geometry is given directly and no file is touched at all.
+  RamDiskSystem(const SIZE_T blocks,
+		const SIZE_T blocksize,
+		const SIZE_T heads,
+		const SIZE_T blockspertrack,
+		const SIZE_T tracks,
+		const double avgseek,
+		const double trackseek,
+		const double rotlat,
+		const bool checksums=false);
+
+  RamDiskSystem() : DiskSystem() {}
+  RamDiskSystem(const RamDiskSystem &rhs) : DiskSystem(rhs) {}
+  RamDiskSystem & operator=(const RamDiskSystem &rhs) { throw GenericException(); return *this;}
+
+  virtual ~RamDiskSystem();
+
+  // ERROR_NOERROR if the region was mapped (and loaded, if asked),
+  // or why not
+  ERROR_T GetStatus() const { return status; }
+
+  // Copy filestem.data and filestem.bitmap into memory
+  ERROR_T Load();
+
+  // Write the in-memory data and bitmap out to filestem.data
+  // and filestem.bitmap
+  ERROR_T Snapshot();
+};
+
+#endif
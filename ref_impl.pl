@@ -63,6 +63,36 @@ while ($line=<STDIN>) {
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
+  } elsif ($op eq "MINSERT") { 
+    # a batch of inserts, done in order
+    @words=split(/\s+/,$rest);
+    @replies=();
+    while ($#words>=1 && $words[0]!~/^#/) { 
+      ($key, $value) = splice(@words,0,2);
+      if (defined $content{$key} || Bug()) { 
+	print STDERR "Inserting ($key, $value) failed because $key already exists\n" if $debug;
+	push @replies, "FAIL";
+      } else {
+	$content{$key}=$value;
+	print STDERR "Inserted ($key, $value)\n" if $debug;
+	push @replies, "OK";
+      }
+    }
+    print join(" ; ",@replies), "\n";
+  } elsif ($op eq "MLOOKUP") { 
+    @words=split(/\s+/,$rest);
+    @replies=();
+    foreach $key (@words) { 
+      last if $key=~/^#/;
+      if (!(defined $content{$key}) || Bug() ) { 
+	print STDERR "Looking up ($key) failed because $key does not exist\n" if $debug;
+	push @replies, "FAIL";
+      } else {
+	print STDERR "Lookup ($key) found $content{$key}\n" if $debug;
+	push @replies, "OK $content{$key}";
+      }
+    }
+    print join(" ; ",@replies), "\n";
   } elsif ($op eq "DISPLAY") { 
     print STDERR "Displaying content in sorted order\n" if $debug;
     print "OK BEGIN DISPLAY\n";
@@ -70,6 +100,14 @@ while ($line=<STDIN>) {
       print "($key, $content{$key})\n";
     }
     print "OK END DISPLAY\n";
+  } elsif ($op eq "SCAN") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    print STDERR "Scanning from $lo to $hi\n" if $debug;
+    print "OK BEGIN SCAN\n";
+    foreach $key (sort keys %content) {
+      print "($key, $content{$key})\n" if ($key ge $lo && $key le $hi);
+    }
+    print "OK END SCAN\n";
   } elsif ($op eq "DEINIT") {
     print STDERR "Got a deinit.  Finishing up now\n" if $debug;
     print "OK\n";
@@ -4,14 +4,44 @@
 #include <string>
 #include <strstream>
 #include <fstream>
+#include <unistd.h>
 #include "btree.h"
+#include "ramdisk.h"
 
 
 using namespace std;
 
+static bool PrintKeyVal(const KEY_T &key, const VALUE_T &value, void *)
+{
+  cout << "(";
+  for (unsigned int k=0; k<key.length; k++) {
+    cout << key.data[k];
+  }
+  cout << ",";
+  for (unsigned int k=0; k<value.length; k++) {
+    cout << value.data[k];
+  }
+  cout << ")\n";
+  return true;
+}
+
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim [-r|-R] [-p|-t|-s] [-w groupsize] [-m maxfill] [-k splitpoint] [-a] [-c] [-f readahead] [-b changes] filestem cachesize < specfile \n";
+  cerr << "  -r  keep the disk in memory (geometry from filestem.config)\n";
+  cerr << "  -R  the same, but load filestem's data and bitmap first, and write\n";
+  cerr << "      them back at DEINIT\n";
+  cerr << "  -p  create the index with prefix compressed nodes\n";
+  cerr << "  -t  create the index with short separators in slotted interior nodes\n";
+  cerr << "  -s  create the index with slotted nodes, for variable length keys and values\n";
+  cerr << "  -w  log every operation to filestem.wal, syncing once per groupsize commits\n";
+  cerr << "  -m  percent of a node it fills before splitting (50 to 100, default 66)\n";
+  cerr << "  -k  percent of the keys the left node keeps in a split (default 50)\n";
+  cerr << "  -a  fill the left nodes of splits at the right end of the tree\n";
+  cerr << "  -c  latch nodes as threads sharing the index would (not with -w)\n";
+  cerr << "  -f  read this many following blocks along with each cache miss\n";
+  cerr << "  -b  write the allocation bitmap's changed pages after this many\n";
+  cerr << "      allocations and frees, not only when the cache detaches\n";
 }
 
 
@@ -20,28 +50,100 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  bool ramdisk=false;
+  bool snapshot=false;
+  SIZE_T format=BTREE_FORMAT_PLAIN;
+  SIZE_T groupcommit=0;
+  BTreeSplitPolicy policy;
+  bool concurrent=false;
+  SIZE_T readahead=0;
+  SIZE_T bitmapsync=0;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"rRptsw:m:k:acf:b:"))!=-1) { 
+    switch (opt) { 
+    case 'r':
+      ramdisk=true;
+      break;
+    case 'R':
+      ramdisk=true;
+      snapshot=true;
+      break;
+    case 'p':
+      format=BTREE_FORMAT_PREFIX;
+      break;
+    case 't':
+      format=BTREE_FORMAT_TRUNCATE;
+      break;
+    case 's':
+      format=BTREE_FORMAT_SLOTTED;
+      break;
+    case 'w':
+      groupcommit=atoi(optarg);
+      if (groupcommit<1) { 
+	usage();
+	return 1;
+      }
+      break;
+    case 'm':
+      policy.maxfill=atoi(optarg);
+      break;
+    case 'k':
+      policy.splitpoint=atoi(optarg);
+      break;
+    case 'a':
+      policy.append=true;
+      break;
+    case 'c':
+      concurrent=true;
+      break;
+    case 'f':
+      readahead=atoi(optarg);
+      break;
+    case 'b':
+      bitmapsync=atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc-optind != 2){
     usage();
     return 1;
   }
 
-  char *filestem=argv[1];
-  SIZE_T cachesize=atoi(argv[2]);
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
   SIZE_T superblocknum;
 
   FILE *file; 
-  char line[1024];
-  int max = 8192;
+  char line[65536];
+  int max = sizeof(line);
   ERROR_T rc;
   
   // We'll connect to the btree only once and then
   // run lots of operations
   // so we need to do this outside the loop
-  DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  RamDiskSystem *ram = ramdisk ? new RamDiskSystem(filestem,snapshot) : 0;
+  DiskSystem *disk = ram ? ram : new DiskSystem(filestem);
+  BufferCache *cachep = new BufferCache(disk,cachesize);
+  BufferCache &cache = *cachep;
+  WriteAheadLog *wal = groupcommit ? new WriteAheadLog(filestem,groupcommit) : 0;
   // will be set on init
-  BTreeIndex *btree;
+  BTreeIndex *btree=0;
 
+  if (ram && (rc=ram->GetStatus())!=ERROR_NOERROR) { 
+    cerr << "Can't set up the disk in memory due to error "<<rc<<"\n";
+    return -1;
+  }
+
+  if (wal) { 
+    cache.SetLog(wal);
+  }
+  cache.SetReadAhead(readahead);
+  disk->SetBitMapSyncInterval(bitmapsync);
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
     cerr << "Can't attach cache due to error "<<rc<<"\n";
@@ -59,8 +161,10 @@ int main(int argc, char *argv[])
     is >> action >> key >> value;
 
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
-      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,format);
+      if ((rc=btree->SetSplitPolicy(policy))!=ERROR_NOERROR ||
+	  (rc=btree->Attach(0, true))!=ERROR_NOERROR ||
+	  (rc=btree->SetConcurrent(concurrent))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
       } else {
@@ -99,6 +203,62 @@ int main(int argc, char *argv[])
 	}
  	cout << endl;
       }
+    } else if (action == "MINSERT" || action == "MLOOKUP") {
+      // A batch: the rest of the line is keys, or keys and values,
+      // and the reply is each key's own reply, separated by " ; "
+      vector<KeyValuePair> pairs;
+      vector<KEY_T> keys;
+      vector<VALUE_T> values;
+      vector<ERROR_T> results;
+      vector<string> words;
+      string word;
+      words.push_back(key);
+      words.push_back(value);
+      while (is >> word) {
+	words.push_back(word);
+      }
+      for (unsigned int i=0; i<words.size() && words[i]!="" && words[i][0]!='#'; i++) {
+	if (action == "MLOOKUP") {
+	  keys.push_back(KEY_T(words[i].c_str()));
+	} else if (i+1<words.size()) {
+	  pairs.push_back(KeyValuePair(KEY_T(words[i].c_str()),VALUE_T(words[i+1].c_str())));
+	  i++;
+	}
+      }
+      if (!btree) {
+	rc=ERROR_NOTANINDEX;
+      } else if (action == "MINSERT") {
+	rc=btree->MultiInsert(pairs,results);
+      } else {
+	rc=btree->MultiLookup(keys,values,results);
+      }
+      if (rc!=ERROR_NOERROR) {
+	cerr <<"Can't do batch due to error "<<rc<<endl;
+	results.assign(action == "MINSERT" ? pairs.size() : keys.size(),rc);
+      }
+      for (unsigned int i=0; i<results.size(); i++) {
+	if (i>0) {
+	  cout << " ; ";
+	}
+	if (results[i]!=ERROR_NOERROR) {
+	  cout << "FAIL";
+	} else if (action == "MINSERT") {
+	  cout << "OK";
+	} else {
+	  cout << "OK ";
+	  for (unsigned int k=0; k<values[i].length; k++) {
+	    cout << values[i].data[k];
+	  }
+	}
+      }
+      cout << endl;
+    } else if (action == "SCAN") {
+      // key and value are the two ends of the range
+      cout <<"OK BEGIN SCAN\n";
+      if ((rc=btree->Scan(KEY_T(key.c_str()),KEY_T(value.c_str()),PrintKeyVal))!=ERROR_NOERROR) { 
+	cerr <<"Can't scan due to error "<<rc<<endl;
+      }
+      cout <<"OK END SCAN\n";
     } else if (action == "DISPLAY") {
       // This should always be OK
       cout <<"OK BEGIN DISPLAY\n";
@@ -112,8 +272,14 @@ int main(int argc, char *argv[])
 	if ((rc=cache.Detach())!=ERROR_NOERROR) { 
 	  cout <<"FAIL"<<endl;
 	  cerr <<"Can't detach cache due to error "<<rc<<endl;
+	} else if (snapshot && (rc=ram->Snapshot())!=ERROR_NOERROR) { 
+	  cout <<"FAIL"<<endl;
+	  cerr <<"Can't snapshot the disk due to error "<<rc<<endl;
 	} else {
+	  cerr << "superblock writes: "<<btree->GetNumSuperblockWrites()<<"\n";
+	  cerr << "bitmap page writes: "<<disk->GetNumBitMapPageWrites()<<"\n";
 	  delete btree;
+	  btree=0;
 	  cout << "OK\n";
 	}
       }
@@ -122,6 +288,20 @@ int main(int argc, char *argv[])
     
   fclose(file);
 
+  cerr << "simulated time: "<<cache.GetCurrentTime()<<" ms\n";
+  cerr << disk->GetStats();
+
+  if (wal) { 
+    cerr << "log: "<<wal->GetNumCommits()<<" commits, "
+	 <<wal->GetNumBlockRecords()<<" block images, "
+	 <<wal->GetNumSyncs()<<" syncs, "
+	 <<cache.GetNumCheckpoints()<<" checkpoints\n";
+  }
+
+  delete cachep;
+  delete wal;
+  delete disk;
+
   return 0;
 
 }
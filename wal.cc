@@ -0,0 +1,227 @@
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#include "wal.h"
+#include "crc32c.h"
+
+#define WAL_MAGIC 0x57414c31   // "WAL1"
+#define WAL_BLOCK_RECORD 1
+#define WAL_COMMIT_RECORD 2
+
+// Written in front of every record.  crc covers the header (with crc
+// zero) and the payload, so a torn record is recognized as such.
+struct WALRecordHeader {
+  unsigned int magic;
+  unsigned int type;
+  unsigned int blocknum;
+  unsigned int length;
+  unsigned int crc;
+};
+
+
+WriteAheadLog::WriteAheadLog(const string &filestem, const SIZE_T group) :
+  logfilefd(0),
+  logname(filestem+".wal"),
+  groupcommit(group>0 ? group : 1),
+  pendingcommits(0),
+  curlsn(0),
+  durablelsn(0),
+  numblockrecords(0),
+  numcommits(0),
+  numsyncs(0)
+{}
+
+
+WriteAheadLog::~WriteAheadLog()
+{
+  if (logfilefd) { 
+    Force();
+    fclose(logfilefd);
+  }
+  logfilefd=0;
+}
+
+
+ERROR_T WriteAheadLog::Open()
+{
+  if (logfilefd) { 
+    return ERROR_NOERROR;
+  }
+
+  if ((logfilefd=fopen(logname.c_str(),"r+"))==0 &&
+      (logfilefd=fopen(logname.c_str(),"w+"))==0) { 
+    cerr << "WriteAheadLog: can't open "<<logname<<endl;
+    return ERROR_NOFILE;
+  }
+
+  fseek(logfilefd,0,SEEK_END);
+  curlsn=durablelsn=ftell(logfilefd);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Append(const SIZE_T type, const SIZE_T blocknum,
+			      const BYTE_T *data, const SIZE_T len)
+{
+  WALRecordHeader h;
+
+  if (logfilefd==0) { 
+    return ERROR_NOFILE;
+  }
+
+  h.magic=WAL_MAGIC;
+  h.type=type;
+  h.blocknum=blocknum;
+  h.length=len;
+  h.crc=0;
+  h.crc=CRC32CExtend(CRC32C(&h,sizeof(h)),data,len);
+
+  pending.insert(pending.end(),(BYTE_T*)&h,(BYTE_T*)&h+sizeof(h));
+  pending.insert(pending.end(),data,data+len);
+  curlsn+=sizeof(h)+len;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::LogBlock(const SIZE_T blocknum, const BYTE_T *data, const SIZE_T len)
+{
+  numblockrecords++;
+  return Append(WAL_BLOCK_RECORD,blocknum,data,len);
+}
+
+
+ERROR_T WriteAheadLog::Commit(LSN_T &commitlsn)
+{
+  ERROR_T rc = Append(WAL_COMMIT_RECORD,0,0,0);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  commitlsn=curlsn;
+  numcommits++;
+
+  if (++pendingcommits>=groupcommit) { 
+    return Force();
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::ForceTo(const LSN_T lsn)
+{
+  if (lsn<=durablelsn) { 
+    return ERROR_NOERROR;
+  }
+
+  if (logfilefd==0) { 
+    return ERROR_NOFILE;
+  }
+
+  fseek(logfilefd,0,SEEK_END);
+  if (!pending.empty() && 
+      fwrite(&(pending[0]),1,pending.size(),logfilefd)!=pending.size()) { 
+    cerr << "WriteAheadLog: can't append to "<<logname<<endl;
+    return ERROR_IMPLBUG;
+  }
+  fflush(logfilefd);
+  fdatasync(fileno(logfilefd));
+  numsyncs++;
+
+  pending.clear();
+  pendingcommits=0;
+  durablelsn=curlsn;
+
+  return ERROR_NOERROR;
+}
+
+
+//
+// Two passes: find the end of the last intact commit, then apply the
+// block images that precede it.
+//
+ERROR_T WriteAheadLog::Redo(DiskSystem *disk, double &reqtime, SIZE_T &numblocks)
+{
+  WALRecordHeader h;
+  vector<BYTE_T> payload;
+  long end=0;
+  long pos=0;
+
+  reqtime=0;
+  numblocks=0;
+
+  if (logfilefd==0) { 
+    return ERROR_NOFILE;
+  }
+
+  rewind(logfilefd);
+  while (fread(&h,sizeof(h),1,logfilefd)==1) { 
+    unsigned int crc=h.crc;
+    if (h.magic!=WAL_MAGIC) { 
+      break;
+    }
+    payload.resize(h.length);
+    if (h.length>0 && fread(&(payload[0]),1,h.length,logfilefd)!=h.length) { 
+      break;
+    }
+    h.crc=0;
+    if (CRC32CExtend(CRC32C(&h,sizeof(h)),h.length ? &(payload[0]) : 0,h.length)!=crc) { 
+      break;
+    }
+    pos+=sizeof(h)+h.length;
+    if (h.type==WAL_COMMIT_RECORD) { 
+      end=pos;
+    }
+  }
+
+  pos=0;
+  fseek(logfilefd,0,SEEK_SET);
+  while (pos<end && fread(&h,sizeof(h),1,logfilefd)==1) { 
+    payload.resize(h.length);
+    if (h.length>0 && fread(&(payload[0]),1,h.length,logfilefd)!=h.length) { 
+      return ERROR_IMPLBUG;
+    }
+    if (h.type==WAL_BLOCK_RECORD) { 
+      double t;
+      BYTE_T *buf=&(payload[0]);
+      if (h.length!=disk->GetBlockSize()) { 
+	cerr << "WriteAheadLog::Redo: block image of the wrong size\n";
+	return ERROR_WRONGSIZEBLOCK;
+      }
+      ERROR_T rc=disk->Write(h.blocknum,1,&buf,t);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+      reqtime+=t;
+      numblocks++;
+    }
+    pos+=sizeof(h)+h.length;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Truncate()
+{
+  if (logfilefd==0) { 
+    return ERROR_NOFILE;
+  }
+
+  if (ftruncate(fileno(logfilefd),0)) { 
+    return ERROR_IMPLBUG;
+  }
+  rewind(logfilefd);
+  fdatasync(fileno(logfilefd));
+
+  pending.clear();
+  pendingcommits=0;
+  curlsn=durablelsn=0;
+
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,83 @@
+#ifndef _wal
+#define _wal
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "global.h"
+#include "disksystem.h"
+
+using namespace std;
+
+// Log sequence number: the log offset just past a record
+typedef unsigned long long LSN_T;
+
+//
+// Write-ahead log kept in filestem.wal, next to the data file.
+//
+// The log holds after-images of blocks.  When an operation commits,
+// the images of the blocks it dirtied are appended, followed by a 
+// commit record.  Records are buffered in memory and written and
+// fsynced together once groupcommit commits have accumulated (or when
+// forced), so one fsync covers a whole group of operations.
+//
+// Redo applies the images of every committed operation in log order
+// and ignores anything after the last intact commit record, such as a
+// torn tail or an operation that never committed.  Once the data disk
+// holds everything in the log, the log is truncated (a checkpoint).
+//
+class WriteAheadLog {
+ private:
+  FILE   *logfilefd;
+  string  logname;
+  SIZE_T  groupcommit;
+
+  vector<BYTE_T> pending;  // records not yet written to the file
+  SIZE_T  pendingcommits;
+  LSN_T   curlsn;          // end of the log, pending records included
+  LSN_T   durablelsn;      // end of what is known to be on stable storage
+
+  SIZE_T  numblockrecords, numcommits, numsyncs;
+
+  ERROR_T Append(const SIZE_T type, const SIZE_T blocknum,
+		 const BYTE_T *data, const SIZE_T len);
+
+ public:
+  WriteAheadLog(const string &filestem, const SIZE_T groupcommit=1);
+  WriteAheadLog() { throw GenericException(); }
+  WriteAheadLog(const WriteAheadLog &rhs) { throw GenericException(); }
+  WriteAheadLog & operator=(const WriteAheadLog &rhs) { throw GenericException(); return *this; }
+  ~WriteAheadLog();
+
+  // Open (creating if needed) the log file
+  ERROR_T Open();
+
+  // Record the new contents of a block as part of the current operation
+  ERROR_T LogBlock(const SIZE_T blocknum, const BYTE_T *data, const SIZE_T len);
+
+  // End the current operation.  It is durable once the log has been
+  // forced to commitlsn, which happens when the group fills up.
+  ERROR_T Commit(LSN_T &commitlsn);
+
+  // Make everything up to lsn durable (a no-op if it already is)
+  ERROR_T ForceTo(const LSN_T lsn);
+  ERROR_T Force() { return ForceTo(curlsn); }
+
+  // Apply the committed block images to the disk.  reqtime is the
+  // simulated time spent writing them, and numblocks how many there
+  // were.
+  ERROR_T Redo(DiskSystem *disk, double &reqtime, SIZE_T &numblocks);
+
+  // Discard the log; the caller guarantees the disk has it all
+  ERROR_T Truncate();
+
+  LSN_T  GetLSN() const { return curlsn; }
+  LSN_T  GetDurableLSN() const { return durablelsn; }
+  SIZE_T GetGroupCommit() const { return groupcommit; }
+  SIZE_T GetNumBlockRecords() const { return numblockrecords; }
+  SIZE_T GetNumCommits() const { return numcommits; }
+  SIZE_T GetNumSyncs() const { return numsyncs; }
+};
+
+#endif